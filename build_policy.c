@@ -20,11 +20,14 @@
 #include <linux/sched/rt.h>
 
 #include <linux/cpuidle.h>
+#include <linux/delay.h>
 #include <linux/jiffies.h>
 #include <linux/livepatch.h>
 #include <linux/psi.h>
+#include <linux/rhashtable.h>
 #include <linux/seqlock_api.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/suspend.h>
 #include <linux/tsacct_kern.h>
 #include <linux/vtime.h>
@@ -39,6 +42,7 @@
 #include "autogroup.h"
 #include "stats.h"
 #include "pelt.h"
+#include "slim.h"
 
 /* Source code modules: */
 
@@ -56,6 +60,10 @@
 
 #ifdef CONFIG_SCHED_CLASS_EXT
 # include "ext.c"
+# include "ext_bench.c"
+# if defined(CONFIG_CPU_FREQ) && defined(CONFIG_SMP)
+#  include "slim_freq_gov.c"
+# endif
 # include "hmbird_sched_proc_main.c"
 #endif
 
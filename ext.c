@@ -6,6 +6,8 @@
  * Copyright (c) 2022 Tejun Heo <tj@kernel.org>
  * Copyright (c) 2022 David Vernet <dvernet@meta.com>
  */
+#include "ext_policy.h"
+
 #define SCX_OP_IDX(op)		(offsetof(struct sched_ext_ops, op) / sizeof(void (*)(void)))
 
 enum scx_internal_consts {
@@ -13,6 +15,11 @@ enum scx_internal_consts {
 	SCX_DSP_DFL_MAX_BATCH	= 32,
 	SCX_DSP_MAX_LOOPS	= 32,
 	SCX_WATCHDOG_MAX_TIMEOUT = 30 * HZ,
+	SCX_MAX_CLUSTERS	= 4,
+	SCX_CONSUME_MAX_BATCH	= 16,
+	SCX_SWITCH_BATCH	= 32,	/* tasks switched per scx_tasks lock hold */
+	SCX_DSP_MAX_RETRIES	= 8,	/* deferred dispatches per CPU */
+	SCX_DSP_COALESCE_BATCH	= 16,	/* dispatches per coalesced lock hold */
 };
 
 enum scx_ops_enable_state {
@@ -71,9 +78,17 @@ enum scx_ops_state {
  * BPF scheduler, we need to be able to iterate tasks in every state to
  * guarantee system safety. Maintain a dedicated task list which contains every
  * task between its fork and eventual free.
+ *
+ * So that fork and exit don't serialize on a single lock, the list is sharded
+ * per CPU. A task is added to the shard of the CPU it's forked on and stays
+ * there, see scx_entity_ext->tasks_shard. scx_task_iter walks all shards.
  */
-static DEFINE_SPINLOCK(scx_tasks_lock);
-static LIST_HEAD(scx_tasks);
+struct scx_tasks_shard {
+	spinlock_t		lock;
+	struct list_head	tasks;
+};
+
+static DEFINE_PER_CPU_ALIGNED(struct scx_tasks_shard, scx_tasks_shards);
 
 /* ops enable/disable */
 static struct kthread_worker *scx_ops_helper;
@@ -91,7 +106,10 @@ static bool scx_warned_zero_slice;
 static DEFINE_STATIC_KEY_FALSE(scx_ops_enq_last);
 static DEFINE_STATIC_KEY_FALSE(scx_ops_enq_exiting);
 DEFINE_STATIC_KEY_FALSE(scx_ops_cpu_preempt);
+static DEFINE_STATIC_KEY_FALSE(scx_ops_prio_heur);
+static DEFINE_STATIC_KEY_FALSE(scx_ops_load_heur);
 static DEFINE_STATIC_KEY_FALSE(scx_builtin_idle_enabled);
+static DEFINE_STATIC_KEY_FALSE(scx_cap_select);
 
 struct static_key_false scx_has_op[SCX_NR_ONLINE_OPS] =
 	{ [0 ... SCX_NR_ONLINE_OPS-1] = STATIC_KEY_FALSE_INIT };
@@ -118,25 +136,55 @@ unsigned long scx_watchdog_timestamp = INITIAL_JIFFIES;
 
 static struct delayed_work scx_watchdog_work;
 
-/* idle tracking */
+/*
+ * Idle tracking. The idle masks are split per cluster, see scx_build_clusters(),
+ * so that idle transitions and wake-up CPU picks mostly touch the cache lines
+ * of their own cluster. scx_idle_summary has the bit of each cluster which may
+ * have idle CPUs set and is only written when a cluster runs out of or gains
+ * its first idle CPU.
+ */
 #ifdef CONFIG_SMP
-#ifdef CONFIG_CPUMASK_OFFSTACK
-#define CL_ALIGNED_IF_ONSTACK
-#else
-#define CL_ALIGNED_IF_ONSTACK __cacheline_aligned_in_smp
-#endif
+struct scx_idle_cluster {
+	struct cpumask		cpu;
+	struct cpumask		smt;
+} ____cacheline_aligned_in_smp;
 
-static struct {
-	cpumask_var_t cpu;
-	cpumask_var_t smt;
-} idle_masks CL_ALIGNED_IF_ONSTACK;
+static struct scx_idle_cluster scx_idle_clusters[SCX_MAX_CLUSTERS];
+static unsigned long __cacheline_aligned_in_smp scx_idle_summary;
 
-static bool __cacheline_aligned_in_smp scx_has_idle_cpus;
+/*
+ * For scx_bpf_get_idle_cpumask/smtmask(). Each acquisition gets its own slot
+ * until it's put, so that nested ones don't overwrite each other.
+ */
+#define SCX_IDLE_SNAP_SLOTS	4
+
+struct scx_idle_snaps {
+	struct cpumask		mask[SCX_IDLE_SNAP_SLOTS];
+	unsigned long		busy;		/* slots acquired and not put */
+};
+
+static DEFINE_PER_CPU(struct scx_idle_snaps, scx_idle_snaps);
 #endif	/* CONFIG_SMP */
 
 /* for %SCX_KICK_WAIT */
 static u64 __percpu *scx_kick_cpus_pnt_seqs;
 
+/*
+ * For %SCX_KICK_WAIT_ASYNC. A kicker sets its CPU in the target's
+ * scx_rq_remote->kick_waiters and then sets the target's kick_waiters_pending.
+ * The target checks the latter on every pick_next_task() and kicks the waiters
+ * back, see __scx_notify_kick_waiters().
+ */
+DEFINE_PER_CPU_SHARED_ALIGNED(struct scx_rq_remote, scx_rq_remote);
+
+/*
+ * rq->scx and p->scx, see init_sched_ext_class() and scx_pre_fork(). Both are
+ * cache line aligned so that CPUs don't false share each other's scx_rq and a
+ * task's hot fields don't straddle more lines than necessary.
+ */
+static struct kmem_cache *scx_rq_cachep;
+static struct kmem_cache *scx_entity_cachep;
+
 /*
  * Direct dispatch marker.
  *
@@ -146,37 +194,600 @@ static u64 __percpu *scx_kick_cpus_pnt_seqs;
  */
 static DEFINE_PER_CPU(struct task_struct *, direct_dispatch_task);
 
+/*
+ * SCX core private per-task state. It isn't visible to the BPF scheduler and
+ * is allocated together with @p->scx in scx_pre_fork(), see scx_ext().
+ */
+struct scx_entity_ext {
+	struct sched_ext_entity	scx;		/* must be the first field */
+
+	/* touched on every enqueue, dispatch and tick */
+	struct scx_dsq_bucket	*bucket;	/* index bucket while queued */
+	s64			dsq_seq;	/* FIFO order within the index */
+	u64			local_vtime;	/* see local_dsq_enqueue_vtime() */
+	s32			local_vtime_cpu;
+	u32			util;
+	u64			util_stamp;	/* see scx_task_util() */
+	u64			run_sum;	/* ran since woken up, see scx_task_slice() */
+	u64			runnable_ns;	/* local_clock() at wakeup */
+
+	/* once per wakeup, see scx_task_slice() */
+	u64			avg_run;	/* per wakeup */
+	u64			woken_at;
+	u64			avg_wake_gap;	/* between wakeups */
+
+	/* only with slim_walt_ctrl set, or on fork and exit */
+	struct slim_walt_task	ravg;
+	s32			tasks_shard;	/* see scx_tasks_shards */
+	bool			key;		/* see scx_set_key_task() */
+};
+
+static struct scx_entity_ext *scx_ext(const struct task_struct *p)
+{
+	return container_of(p->scx, struct scx_entity_ext, scx);
+}
+
+/*
+ * DSQ index. Consuming from a shared DSQ on a system where many tasks are
+ * affined to a subset of the clusters, or pinned, means scanning past every
+ * task which can't run on the consuming CPU. When dsq_index_ctrl is set, the
+ * non-local DSQs bucket their tasks by where they can run instead:
+ *
+ *   [0, SCX_DSQ_IDX_NR_CLS)	tasks allowed on exactly the clusters in the
+ *				bucket index bitmask
+ *   SCX_DSQ_IDX_PINNED + cpu	tasks which can only run on @cpu
+ *   SCX_DSQ_IDX_MISC(idx)	tasks allowed on a part of a cluster
+ *
+ * A CPU then only needs to look at the heads of the buckets which can contain
+ * tasks for it. Each bucket keeps its own FIFO and priq. FIFO order across
+ * buckets is kept with a per-index sequence number, head-queued tasks counting
+ * down and tail-queued ones up. Only the misc bucket may need to be scanned.
+ */
+struct scx_dsq_bucket {
+	struct list_head	fifo;
+	struct rb_root_cached	priq;
+	u32			nr;
+};
+
+struct scx_dsq_index {
+	struct rcu_head		rcu;
+	s64			head_seq;
+	s64			tail_seq;
+	u32			nr_buckets;
+	struct scx_dsq_bucket	buckets[];
+};
+
+#define SCX_DSQ_IDX_NR_CLS	(1 << SCX_MAX_CLUSTERS)
+#define SCX_DSQ_IDX_PINNED	SCX_DSQ_IDX_NR_CLS
+#define SCX_DSQ_IDX_MISC(idx)	((idx)->nr_buckets - 1)
+/* cluster buckets containing a given cluster, the pinned bucket and misc */
+#define SCX_DSQ_IDX_MAX_CAND	(SCX_DSQ_IDX_NR_CLS / 2 + 2)
+
+static DEFINE_STATIC_KEY_FALSE(scx_dsq_indexed);
+
+/*
+ * Non-local DSQs are all allocated by the SCX core and wrapped so that they
+ * can carry an index. @idx is only used while scx_dsq_indexed is enabled.
+ */
+struct scx_dsq_ext {
+	struct scx_dispatch_q	dsq;		/* must be the first field */
+	struct scx_dsq_index	*idx;
+} ____cacheline_aligned_in_smp;
+
 /* dispatch queues */
-static struct scx_dispatch_q __cacheline_aligned_in_smp scx_dsq_global;
+static struct scx_dsq_ext scx_dsq_global;
+
+static const struct rhashtable_params dsq_hash_params = {
+	.key_len		= 8,
+	.key_offset		= offsetof(struct scx_dispatch_q, id),
+	.head_offset		= offsetof(struct scx_dispatch_q, hash_node),
+};
 
+static struct rhashtable dsq_hash;
 static LLIST_HEAD(dsqs_to_free);
 
+/*
+ * Sharded global DSQ. When enabled, %SCX_DSQ_GLOBAL resolves to one DSQ per
+ * cluster so that CPUs of different clusters don't bounce a single queue's
+ * cache line and lock around. Each CPU consumes its own shard first and steals
+ * from the other shards in scx_cluster_steal[] order only when it's empty.
+ * scx_dsq_global is still consumed last to pick up error fallbacks.
+ */
+static struct scx_dsq_ext scx_gdsq_shards[SCX_MAX_CLUSTERS];
+static DEFINE_STATIC_KEY_FALSE(scx_gdsq_sharded);
+
+/*
+ * Per cluster key task DSQs. When enabled, key tasks dispatched to
+ * %SCX_DSQ_GLOBAL are queued here and consumed before any global DSQ. See
+ * hmbird_key.c.
+ */
+static struct scx_dsq_ext scx_key_dsqs[SCX_MAX_CLUSTERS];
+static DEFINE_STATIC_KEY_FALSE(scx_key_enabled);
+
+/*
+ * Per task_group DSQs. When enabled, tasks dispatched to %SCX_DSQ_GLOBAL are
+ * queued on the DSQ of their task_group instead and CPUs consume the groups in
+ * weighted vtime order, so that a busy background group can't flood the global
+ * DSQ and push the foreground groups out. Groups over their cpu.max quota
+ * aren't consumed until their next period. See scx_group_charge().
+ */
+static DEFINE_STATIC_KEY_FALSE(scx_group_dsq);
+
+#ifdef CONFIG_EXT_GROUP_SCHED
+#define SCX_GROUP_HW_ONE	(1U << 20)	/* hweight of the root group */
+
+struct scx_group {
+	struct scx_dsq_ext	dsq;		/* must be the first field */
+	struct task_group	*tg;
+	struct scx_group	*parent;
+	struct list_head	node;		/* on scx_group_list */
+
+	/* protected by scx_group_mutex, see scx_group_update_hweights() */
+	u32			weight;		/* cpu.weight */
+	u32			child_sum;
+
+	/* share of the machine of the subtree and of the group's own tasks */
+	u32			hweight;
+	u32			qweight;
+
+	atomic64_t		vtime;
+
+	/* cpu.max enforcement, see scx_group_charge_one() */
+	atomic64_t		usage;
+	u64			period_end;
+	bool			throttled;
+	struct hrtimer		unthrottle_timer;
+
+	struct rcu_head		rcu;
+};
+
+/* root_task_group, autogroups and anything else without a group of its own */
+static struct scx_group scx_root_group;
+
+/* RCU protected, parents are always before their children */
+static LIST_HEAD(scx_group_list);
+static DEFINE_XARRAY(scx_groups);		/* css id to scx_group */
+static DEFINE_MUTEX(scx_group_mutex);
+
+/* vtime of the last group picked, see find_group_dsq() */
+static u64 scx_group_vtime_floor;
+
+/* @p's rq must be locked */
+static struct scx_group *scx_task_group_of(const struct task_struct *p)
+{
+	struct task_group *tg = p->sched_task_group;
+	struct scx_group *g = NULL;
+
+	if (tg && tg->css.cgroup)
+		g = xa_load(&scx_groups, tg->css.id);
+	return g ?: &scx_root_group;
+}
+
+static bool scx_group_throttled(struct scx_group *g, u64 now)
+{
+	for (; g; g = g->parent) {
+		if (READ_ONCE(g->throttled) &&
+		    time_before64(now, READ_ONCE(g->period_end)))
+			return true;
+	}
+	return false;
+}
+
+/* returns @g's cpu.max quota and sets @period, %RUNTIME_INF if unlimited */
+static u64 scx_group_quota(struct scx_group *g, u64 *period)
+{
+#ifdef CONFIG_CFS_BANDWIDTH
+	struct cfs_bandwidth *cfs_b;
+	u64 quota;
+
+	if (!g->tg)
+		return RUNTIME_INF;
+
+	cfs_b = &g->tg->cfs_bandwidth;
+	quota = READ_ONCE(cfs_b->quota);
+	if (quota != RUNTIME_INF)
+		*period = ktime_to_ns(READ_ONCE(cfs_b->period));
+	return quota;
+#else
+	return RUNTIME_INF;
+#endif
+}
+
+/*
+ * Usage is accumulated over all CPUs and reset lazily by the first charge
+ * after the period ended. A group which used up its quota is throttled until
+ * then and unthrottle_timer makes sure that its tasks get picked up by an idle
+ * CPU once the period is over.
+ */
+static void scx_group_charge_one(struct scx_group *g, u64 delta, u64 now)
+{
+	u64 period, quota, end;
+
+	quota = scx_group_quota(g, &period);
+	if (quota == RUNTIME_INF)
+		return;
+
+	end = READ_ONCE(g->period_end);
+	if (!time_before64(now, end) &&
+	    cmpxchg64(&g->period_end, end, now + period) == end) {
+		atomic64_set(&g->usage, 0);
+		WRITE_ONCE(g->throttled, false);
+	}
+
+	if (atomic64_add_return(delta, &g->usage) >= quota &&
+	    !READ_ONCE(g->throttled)) {
+		s64 remaining = READ_ONCE(g->period_end) - now;
+
+		WRITE_ONCE(g->throttled, true);
+		hrtimer_start(&g->unthrottle_timer,
+			      ns_to_ktime(max_t(s64, remaining, 0)),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+/*
+ * Execution time of the group of the task running on a CPU which hasn't been
+ * folded into the group yet, protected by the CPU's rq lock. Only the running
+ * task's group can be pending, so @g can't go away under us.
+ */
+struct scx_group_batch {
+	struct scx_group	*g;
+	u64			delta;
+};
+
+static DEFINE_PER_CPU(struct scx_group_batch, scx_group_batch);
+
+#define SCX_GROUP_BATCH_NS	(500 * NSEC_PER_USEC)
+
+/**
+ * scx_group_flush - Fold the execution time batched on a CPU into its group
+ * @rq: locked rq whose batch to fold
+ *
+ * Advance the group's vtime by the batched time scaled by the group's share
+ * and charge it against the cpu.max quotas of the group and its ancestors.
+ * Called when the batch is big enough, on ticks and when the task stops
+ * running.
+ */
+static void scx_group_flush(struct rq *rq)
+{
+	struct scx_group_batch *gb = per_cpu_ptr(&scx_group_batch, cpu_of(rq));
+	struct scx_group *g = gb->g, *pos;
+	u64 delta = gb->delta, now;
+
+	lockdep_assert_rq_held(rq);
+
+	if (!g)
+		return;
+	gb->g = NULL;
+	gb->delta = 0;
+
+	atomic64_add(div_u64(delta * SCX_GROUP_HW_ONE, READ_ONCE(g->qweight)),
+		     &g->vtime);
+
+	now = sched_clock();
+	for (pos = g; pos; pos = pos->parent)
+		scx_group_charge_one(pos, delta, now);
+}
+
+/**
+ * scx_group_charge - Charge execution time to a task's group
+ * @rq: rq @p is running on, locked
+ * @p: task which ran
+ * @delta: execution time in ns
+ *
+ * Batch @delta on @rq's CPU, see scx_group_flush(), so that the shared group
+ * counters aren't bumped on every update. If folding the batch throttles @p,
+ * its slice is cut so that it goes back to the BPF scheduler.
+ */
+static void scx_group_charge(struct rq *rq, struct task_struct *p, u64 delta)
+{
+	struct scx_group_batch *gb = per_cpu_ptr(&scx_group_batch, cpu_of(rq));
+	struct scx_group *g;
+
+	if (!static_branch_unlikely(&scx_group_dsq))
+		return;
+
+	g = scx_task_group_of(p);
+	if (unlikely(gb->g != g)) {
+		scx_group_flush(rq);
+		gb->g = g;
+	}
+
+	gb->delta += delta;
+	if (gb->delta < SCX_GROUP_BATCH_NS)
+		return;
+
+	scx_group_flush(rq);
+	if (unlikely(scx_group_throttled(g, sched_clock())))
+		p->scx->slice = 0;
+}
+
+static struct scx_dispatch_q *find_group_dsq(struct task_struct *p)
+{
+	struct scx_group *g = scx_task_group_of(p);
+	u64 floor = READ_ONCE(scx_group_vtime_floor);
+
+	/* a group coming back from idle doesn't get to keep its vtime lead */
+	if (!READ_ONCE(g->dsq.dsq.nr) &&
+	    time_before64(atomic64_read(&g->vtime), floor))
+		atomic64_set(&g->vtime, floor);
+
+	return &g->dsq.dsq;
+}
+
+static s32 scx_group_nr_queued(void)
+{
+	struct scx_group *g;
+	s32 nr = 0;
+
+	list_for_each_entry_rcu(g, &scx_group_list, node)
+		nr += READ_ONCE(g->dsq.dsq.nr);
+	return nr;
+}
+#else	/* CONFIG_EXT_GROUP_SCHED */
+static void scx_group_flush(struct rq *rq) {}
+static void scx_group_charge(struct rq *rq, struct task_struct *p, u64 delta) {}
+static s32 scx_group_nr_queued(void) { return 0; }
+#endif	/* CONFIG_EXT_GROUP_SCHED */
+
+/* cluster topology, see scx_build_clusters() */
+static int scx_nr_clusters = 1;
+static DEFINE_PER_CPU_READ_MOSTLY(int, scx_cpu_cluster);
+static struct cpumask scx_cluster_cpus[SCX_MAX_CLUSTERS];
+static unsigned long scx_cluster_cap[SCX_MAX_CLUSTERS];
+static int scx_prime_cluster = -1;
+static u8 scx_cluster_steal[SCX_MAX_CLUSTERS][SCX_MAX_CLUSTERS - 1];
+
 /* dispatch buf */
 struct scx_dsp_buf_ent {
 	struct task_struct	*task;
 	u64			qseq;
 	u64			dsq_id;
 	u64			enq_flags;
+	u32			seq;	/* see flush_dispatch_buf_coalesced() */
 };
 
 static u32 scx_dsp_max_batch;
 static struct scx_dsp_buf_ent __percpu *scx_dsp_buf;
 
+/* a dispatch deferred by finish_dispatch(), holds a ref on @ent.task */
+struct scx_dsp_retry_ent {
+	struct scx_dsp_buf_ent	ent;
+	u64			parked_at;
+};
+
 struct scx_dsp_ctx {
 	struct rq		*rq;
 	struct rq_flags		*rf;
 	u32			buf_cursor;
 	u32			nr_tasks;
+	u32			nr_retries;
+	struct scx_dsp_retry_ent retries[SCX_DSP_MAX_RETRIES];
 };
 
 static DEFINE_PER_CPU(struct scx_dsp_ctx, scx_dsp_ctx);
 
+/*
+ * Event counters reported through /proc/hmbird_sched/hmbird_stats. Each CPU
+ * only bumps its own counters, without atomics, and readers sum them up. The
+ * sums are thus only approximate while they're changing, which is fine for
+ * statistics.
+ */
+enum scx_stat_idx {
+	SCX_STAT_ENQ,			/* enqueue_task_scx() */
+	SCX_STAT_DSP,			/* dispatch_enqueue() to a non-local DSQ */
+	SCX_STAT_DSP_LOCAL,		/* dispatch_enqueue() to a local DSQ */
+	SCX_STAT_CONSUME_LOCAL,		/* consumed a task already on this rq */
+	SCX_STAT_CONSUME_REMOTE,	/* consumed a task from another rq */
+	SCX_STAT_SELECT_HIT,		/* default select_cpu found an idle CPU */
+	SCX_STAT_SELECT_MISS,
+	SCX_STAT_TIMEOUT,		/* watchdog timeouts of tasks on this CPU */
+	SCX_STAT_NEAR_TIMEOUT,		/* tasks found waiting over half of it */
+	SCX_STAT_KICK,			/* scx_bpf_kick_cpu() calls */
+	SCX_STAT_KEY_DSP,		/* key tasks queued on a key DSQ */
+	SCX_STAT_KEY_BOOST,		/* key tasks run in a boost window */
+	SCX_NR_STATS,
+};
+
+/* slot 0 is scx_dsq_global, 1 + cluster the global DSQ shards */
+#define SCX_STAT_NR_GDSQ	(SCX_MAX_CLUSTERS + 1)
+
+struct scx_stats {
+	u64			cnt[SCX_NR_STATS];
+	u64			gdsq[SCX_STAT_NR_GDSQ];
+};
+
+static DEFINE_PER_CPU(struct scx_stats, scx_stats);
+
+/* bumped for a CPU from another one, e.g. by the watchdog */
+struct scx_stats_remote {
+	atomic64_t		cnt[SCX_NR_STATS];
+};
+
+static DEFINE_PER_CPU(struct scx_stats_remote, scx_stats_remote);
+
+static __always_inline void scx_stat_inc(enum scx_stat_idx idx)
+{
+	__this_cpu_inc(scx_stats.cnt[idx]);
+}
+
+static void scx_stat_inc_cpu(int cpu, enum scx_stat_idx idx)
+{
+	atomic64_inc(&per_cpu(scx_stats_remote, cpu).cnt[idx]);
+}
+
+static __always_inline void scx_stat_add(enum scx_stat_idx idx, u64 nr)
+{
+	__this_cpu_add(scx_stats.cnt[idx], nr);
+}
+
+/*
+ * @dsq is scx_dsq_global, one of scx_gdsq_shards[], a group DSQ or one of
+ * scx_key_dsqs[]
+ */
+static void scx_stat_inc_gdsq(struct scx_dispatch_q *dsq)
+{
+	struct scx_dsq_ext *ext = container_of(dsq, struct scx_dsq_ext, dsq);
+	int slot = 0;
+
+	if (ext >= scx_key_dsqs && ext < scx_key_dsqs + SCX_MAX_CLUSTERS) {
+		scx_stat_inc(SCX_STAT_KEY_DSP);
+		return;
+	}
+
+	/* group DSQs are counted as scx_dsq_global */
+	if (ext >= scx_gdsq_shards && ext < scx_gdsq_shards + SCX_MAX_CLUSTERS)
+		slot = 1 + (ext - scx_gdsq_shards);
+	__this_cpu_inc(scx_stats.gdsq[slot]);
+}
+
+static u64 scx_stat_cpu(int cpu, enum scx_stat_idx idx)
+{
+	return READ_ONCE(per_cpu(scx_stats, cpu).cnt[idx]) +
+		atomic64_read(&per_cpu(scx_stats_remote, cpu).cnt[idx]);
+}
+
+static u64 scx_stat_sum(enum scx_stat_idx idx)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += scx_stat_cpu(cpu, idx);
+	return sum;
+}
+
+static u64 scx_stat_gdsq_sum(int slot)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu(scx_stats, cpu).gdsq[slot]);
+	return sum;
+}
+
+/*
+ * Latency histograms reported through /proc/hmbird_sched/latency_hist, enabled
+ * by lat_hist_ctrl or for the duration of a run of ext_bench.c. Bucket N counts
+ * the samples in [2^(N-1), 2^N) ns, the last bucket everything longer. Updated
+ * like scx_stats.
+ */
+enum scx_lat_idx {
+	SCX_LAT_BALANCE,		/* balance_scx() */
+	SCX_LAT_DISPATCH,		/* ops.dispatch() */
+	SCX_LAT_SELECT,			/* select_task_rq_scx() */
+	SCX_LAT_RUNNABLE,		/* wakeup to set_next_task_scx() */
+	SCX_LAT_DSP_ENQ,		/* dispatch_enqueue() */
+	SCX_LAT_CONSUME,		/* consume_dispatch_q_n() of a non-empty DSQ */
+	SCX_LAT_FINISH_DSP,		/* finish_dispatch() */
+	SCX_LAT_KICK,			/* kick_cpus_irq_workfn() */
+	SCX_NR_LATS,
+};
+
+#define SCX_LAT_NR_BUCKETS	32
+
+static const char *scx_lat_names[SCX_NR_LATS] = {
+	[SCX_LAT_BALANCE]	= "balance",
+	[SCX_LAT_DISPATCH]	= "dispatch",
+	[SCX_LAT_SELECT]	= "select_cpu",
+	[SCX_LAT_RUNNABLE]	= "runnable",
+	[SCX_LAT_DSP_ENQ]	= "dispatch_enqueue",
+	[SCX_LAT_CONSUME]	= "consume",
+	[SCX_LAT_FINISH_DSP]	= "finish_dispatch",
+	[SCX_LAT_KICK]		= "kick",
+};
+
+struct scx_lat_hist {
+	u64			cnt[SCX_NR_LATS][SCX_LAT_NR_BUCKETS];
+	u64			sum[SCX_NR_LATS];	/* ns */
+};
+
+static DEFINE_PER_CPU(struct scx_lat_hist, scx_lat_hist);
+
+/*
+ * Reference counted as ext_bench turns the histograms on for its runs. The
+ * enable path holds a reference if lat_hist_ctrl was set, see scx_lat_hist_ops.
+ */
+static DEFINE_STATIC_KEY_FALSE(scx_lat_hist_enabled);
+static bool scx_lat_hist_ops;
+
+static __always_inline void scx_lat_record(enum scx_lat_idx idx, u64 delta)
+{
+	int bucket = min_t(int, fls64(delta), SCX_LAT_NR_BUCKETS - 1);
+
+	__this_cpu_inc(scx_lat_hist.cnt[idx][bucket]);
+	__this_cpu_add(scx_lat_hist.sum[idx], delta);
+}
+
+/* returns 0 if the histograms are disabled, see scx_lat_end() */
+static __always_inline u64 scx_lat_start(void)
+{
+	if (static_branch_unlikely(&scx_lat_hist_enabled))
+		return sched_clock();
+	return 0;
+}
+
+static __always_inline void scx_lat_end(enum scx_lat_idx idx, u64 start)
+{
+	if (start)
+		scx_lat_record(idx, sched_clock() - start);
+}
+
+/* scx_lat_end() for @nr operations done together, each taking an equal share */
+static __always_inline void scx_lat_end_nr(enum scx_lat_idx idx, u64 start,
+					   u32 nr)
+{
+	u64 delta;
+	int bucket;
+
+	if (!start || !nr)
+		return;
+
+	delta = sched_clock() - start;
+	bucket = min_t(int, fls64(div_u64(delta, nr)), SCX_LAT_NR_BUCKETS - 1);
+	__this_cpu_add(scx_lat_hist.cnt[idx][bucket], nr);
+	__this_cpu_add(scx_lat_hist.sum[idx], delta);
+}
+
+static u64 scx_lat_hist_sum(enum scx_lat_idx idx, int bucket)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu(scx_lat_hist, cpu).cnt[idx][bucket]);
+	return sum;
+}
+
+/* total ns recorded for @idx */
+static u64 scx_lat_hist_ns(enum scx_lat_idx idx)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu(scx_lat_hist, cpu).sum[idx]);
+	return sum;
+}
+
+/* racy against the updaters, a few samples may survive */
+static void scx_lat_hist_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&scx_lat_hist, cpu), 0,
+		       sizeof(struct scx_lat_hist));
+}
+
 void scx_bpf_dispatch(struct task_struct *p, u64 dsq_id, u64 slice,
 		      u64 enq_flags);
 void scx_bpf_kick_cpu(s32 cpu, u64 flags);
 
 struct scx_task_iter {
 	struct sched_ext_entity		cursor;
+	int				shard;		/* CPU of the locked shard */
 	struct task_struct		*locked;
 	struct rq			*rq;
 	struct rq_flags			rf;
@@ -284,36 +895,142 @@ do {										\
 	__ret;									\
 })
 
-//#include "./slim_walt.c"
+#include "./slim_walt.c"
+#include "./hmbird_trace.c"
 
-/* @mask is constant, always inline to cull unnecessary branches */
-static __always_inline bool scx_kf_allowed(u32 mask)
+/* called with @p's rq locked when @p starts (!@ran) or stops (@ran) running */
+static void scx_update_task_util(struct task_struct *p, bool ran)
 {
-	if (unlikely(!(current->scx->kf_mask & mask))) {
-		scx_ops_error("kfunc with mask 0x%x called from an operation only allowing 0x%x",
-			      mask, current->scx->kf_mask);
-		return false;
-	}
+	struct scx_entity_ext *ext = scx_ext(p);
+	u64 now = local_clock();
 
-	if (unlikely((mask & (SCX_KF_INIT | SCX_KF_SLEEPABLE)) &&
-		     in_interrupt())) {
-		scx_ops_error("sleepable kfunc called from non-sleepable context");
-		return false;
-	}
+	if (now > ext->util_stamp)
+		ext->util = scx_policy_util_decay(ext->util,
+						  now - ext->util_stamp, ran);
+	ext->util_stamp = now;
+}
 
-	/*
-	 * Enforce nesting boundaries. e.g. A kfunc which can be called from
-	 * DISPATCH must not be called if we're running DEQUEUE which is nested
-	 * inside ops.dispatch(). We don't need to check the SCX_KF_SLEEPABLE
-	 * boundary thanks to the above in_interrupt() check.
-	 */
-	if (unlikely(highest_bit(mask) == SCX_KF_CPU_RELEASE &&
-		     (current->scx->kf_mask & higher_bits(SCX_KF_CPU_RELEASE)))) {
-		scx_ops_error("cpu_release kfunc called from a nested operation");
-		return false;
-	}
+/**
+ * scx_task_util - Estimate the utilization of a task
+ * @p: task of interest
+ *
+ * Returns @p's slim_walt demand if enabled. Otherwise, a PELT-like geometric
+ * average of the time @p spent running, decayed up to now. Both are in
+ * %SCHED_CAPACITY_SCALE. Can be called without @p's rq lock in which case the
+ * result may be slightly stale.
+ */
+static u32 scx_task_util(const struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	u64 stamp = READ_ONCE(ext->util_stamp), now = local_clock();
+	u32 util = READ_ONCE(ext->util);
 
-	if (unlikely(highest_bit(mask) == SCX_KF_DISPATCH &&
+	if (static_branch_unlikely(&slim_walt_enabled))
+		return slim_walt_task_util(p);
+
+	return now > stamp ? scx_policy_util_decay(util, now - stamp, false) : util;
+}
+
+/*
+ * Adaptive slices, enabled by slice_adapt_ctrl. Instead of refilling every
+ * slice to %SCX_SLICE_DFL, tasks which sleep more than they run get enough to
+ * finish their usual burst and CPU bound ones the maximum, which cuts context
+ * switches for throughput work. The slice is further divided by the number of
+ * tasks waiting on the local DSQ so that they don't wait behind a long slice.
+ * The result is bounded by slice_min_us and slice_max_us.
+ */
+static DEFINE_STATIC_KEY_FALSE(scx_slice_adapt);
+
+static void scx_slice_bounds(u64 *min, u64 *max)
+{
+	*min = (u64)max(READ_ONCE(slice_min_us), 1) * NSEC_PER_USEC;
+	*max = max_t(u64, (u64)max(READ_ONCE(slice_max_us), 1) * NSEC_PER_USEC,
+		     *min);
+}
+
+/* called with @p's rq locked when @p wakes up */
+static void scx_slice_task_woken(struct rq *rq, struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	u64 now = rq_clock(rq);
+
+	if (ext->woken_at && now > ext->woken_at)
+		ext->avg_wake_gap = scx_policy_ewma(ext->avg_wake_gap,
+						    now - ext->woken_at);
+	ext->woken_at = now;
+}
+
+/* called with @p's rq locked when @p goes to sleep */
+static void scx_slice_task_slept(struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+
+	ext->avg_run = scx_policy_ewma(ext->avg_run, ext->run_sum);
+	ext->run_sum = 0;
+}
+
+/* slice for @p without accounting for local DSQ pressure */
+static u64 scx_task_slice_base(const struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	u64 min, max;
+
+	if (!static_branch_unlikely(&scx_slice_adapt))
+		return SCX_SLICE_DFL;
+
+	scx_slice_bounds(&min, &max);
+	return scx_policy_slice_base(ext->avg_run, ext->run_sum,
+				     ext->avg_wake_gap, min, max);
+}
+
+/**
+ * scx_task_slice - Determine the slice to refill a task with
+ * @rq: rq @p is being queued on, locked
+ * @p: task to refill the slice of
+ *
+ * Returns %SCX_SLICE_DFL unless adaptive slices are enabled.
+ */
+static u64 scx_task_slice(struct rq *rq, const struct task_struct *p)
+{
+	u64 slice = scx_task_slice_base(p), min, max;
+	u32 nr;
+
+	if (!static_branch_unlikely(&scx_slice_adapt))
+		return slice;
+
+	nr = READ_ONCE(rq->scx->local_dsq.nr);
+	scx_slice_bounds(&min, &max);
+	return scx_policy_slice_share(slice, nr, min);
+}
+
+/* @mask is constant, always inline to cull unnecessary branches */
+static __always_inline bool scx_kf_allowed(u32 mask)
+{
+	if (unlikely(!(current->scx->kf_mask & mask))) {
+		scx_ops_error("kfunc with mask 0x%x called from an operation only allowing 0x%x",
+			      mask, current->scx->kf_mask);
+		return false;
+	}
+
+	if (unlikely((mask & (SCX_KF_INIT | SCX_KF_SLEEPABLE)) &&
+		     in_interrupt())) {
+		scx_ops_error("sleepable kfunc called from non-sleepable context");
+		return false;
+	}
+
+	/*
+	 * Enforce nesting boundaries. e.g. A kfunc which can be called from
+	 * DISPATCH must not be called if we're running DEQUEUE which is nested
+	 * inside ops.dispatch(). We don't need to check the SCX_KF_SLEEPABLE
+	 * boundary thanks to the above in_interrupt() check.
+	 */
+	if (unlikely(highest_bit(mask) == SCX_KF_CPU_RELEASE &&
+		     (current->scx->kf_mask & higher_bits(SCX_KF_CPU_RELEASE)))) {
+		scx_ops_error("cpu_release kfunc called from a nested operation");
+		return false;
+	}
+
+	if (unlikely(highest_bit(mask) == SCX_KF_DISPATCH &&
 		     (current->scx->kf_mask & higher_bits(SCX_KF_DISPATCH)))) {
 		scx_ops_error("dispatch kfunc called from a nested operation");
 		return false;
@@ -338,80 +1055,133 @@ static __always_inline bool scx_kf_allowed_on_arg_tasks(u32 mask,
 	return true;
 }
 
+static struct scx_tasks_shard *scx_task_iter_shard(struct scx_task_iter *iter)
+{
+	return per_cpu_ptr(&scx_tasks_shards, iter->shard);
+}
+
 /**
  * scx_task_iter_init - Initialize a task iterator
  * @iter: iterator to init
  *
- * Initialize @iter. Must be called with scx_tasks_lock held. Once initialized,
- * @iter must eventually be exited with scx_task_iter_exit().
+ * Initialize @iter and lock the first scx_tasks shard with IRQs disabled. Once
+ * initialized, @iter must eventually be exited with scx_task_iter_exit().
  *
- * scx_tasks_lock may be released between this and the first next() call or
- * between any two next() calls. If scx_tasks_lock is released between two
- * next() calls, the caller is responsible for ensuring that the task being
- * iterated remains accessible either through RCU read lock or obtaining a
- * reference count.
+ * The shard lock may be released with scx_task_iter_unlock() and reacquired
+ * with scx_task_iter_relock() between this and the first next() call or
+ * between any two next() calls. If the lock is released between two next()
+ * calls, the caller is responsible for ensuring that the task being iterated
+ * remains accessible either through RCU read lock or obtaining a reference
+ * count.
  *
  * All tasks which existed when the iteration started are guaranteed to be
  * visited as long as they still exist.
  */
 static void scx_task_iter_init(struct scx_task_iter *iter)
 {
-	lockdep_assert_held(&scx_tasks_lock);
-
 	iter->cursor = (struct sched_ext_entity){ .flags = SCX_TASK_CURSOR };
-	list_add(&iter->cursor.tasks_node, &scx_tasks);
+	iter->shard = cpumask_first(cpu_possible_mask);
 	iter->locked = NULL;
+
+	spin_lock_irq(&scx_task_iter_shard(iter)->lock);
+	list_add(&iter->cursor.tasks_node, &scx_task_iter_shard(iter)->tasks);
+}
+
+/**
+ * scx_task_iter_rq_unlock - Unlock the rq locked by a task iterator
+ * @iter: iterator to unlock
+ *
+ * If @iter holds a task's rq lock from scx_task_iter_next_filtered_locked(),
+ * release it. The iteration can continue.
+ */
+static void scx_task_iter_rq_unlock(struct scx_task_iter *iter)
+{
+	if (iter->locked) {
+		task_rq_unlock(iter->rq, iter->locked, &iter->rf);
+		iter->locked = NULL;
+	}
+}
+
+/**
+ * scx_task_iter_unlock - Unlock the rq and shard locks held by a task iterator
+ * @iter: iterator to unlock
+ *
+ * Release the locks held by @iter and re-enable IRQs so that a long walk can
+ * let others run. The iteration continues after scx_task_iter_relock().
+ */
+static void scx_task_iter_unlock(struct scx_task_iter *iter)
+{
+	scx_task_iter_rq_unlock(iter);
+	spin_unlock_irq(&scx_task_iter_shard(iter)->lock);
+}
+
+static void scx_task_iter_relock(struct scx_task_iter *iter)
+{
+	spin_lock_irq(&scx_task_iter_shard(iter)->lock);
 }
 
 /**
  * scx_task_iter_exit - Exit a task iterator
  * @iter: iterator to exit
  *
- * Exit a previously initialized @iter. Must be called with scx_tasks_lock held.
- * If the iterator holds a task's rq lock, that rq lock is released. See
+ * Exit a previously initialized @iter which must be locked. The rq lock held by
+ * the iterator, if any, and the shard lock are released. See
  * scx_task_iter_init() for details.
  */
 static void scx_task_iter_exit(struct scx_task_iter *iter)
 {
 	struct list_head *cursor = &iter->cursor.tasks_node;
 
-	lockdep_assert_held(&scx_tasks_lock);
+	lockdep_assert_held(&scx_task_iter_shard(iter)->lock);
 
-	if (iter->locked) {
-		task_rq_unlock(iter->rq, iter->locked, &iter->rf);
-		iter->locked = NULL;
-	}
+	scx_task_iter_rq_unlock(iter);
 
-	if (list_empty(cursor))
-		return;
+	if (!list_empty(cursor))
+		list_del_init(cursor);
 
-	list_del_init(cursor);
+	spin_unlock_irq(&scx_task_iter_shard(iter)->lock);
 }
 
 /**
  * scx_task_iter_next - Next task
  * @iter: iterator to walk
  *
- * Visit the next task. See scx_task_iter_init() for details.
+ * Visit the next task, moving on to the next shard at the end of the current
+ * one. See scx_task_iter_init() for details.
  */
 static struct task_struct *scx_task_iter_next(struct scx_task_iter *iter)
 {
 	struct list_head *cursor = &iter->cursor.tasks_node;
 	struct sched_ext_entity *pos;
 
-	lockdep_assert_held(&scx_tasks_lock);
+	for (;;) {
+		struct scx_tasks_shard *shard = scx_task_iter_shard(iter);
+		int next;
 
-	list_for_each_entry(pos, cursor, tasks_node) {
-		if (&pos->tasks_node == &scx_tasks)
-			return NULL;
-		if (!(pos->flags & SCX_TASK_CURSOR)) {
-			list_move(cursor, &pos->tasks_node);
-			return pos->task;
+		lockdep_assert_held(&shard->lock);
+
+		list_for_each_entry(pos, cursor, tasks_node) {
+			if (&pos->tasks_node == &shard->tasks)
+				break;
+			if (!(pos->flags & SCX_TASK_CURSOR)) {
+				list_move(cursor, &pos->tasks_node);
+				return pos->task;
+			}
 		}
-	}
 
-	/* can't happen, should always terminate at scx_tasks above */
-	BUG();
+		next = cpumask_next(iter->shard, cpu_possible_mask);
+		if (next >= nr_cpu_ids)
+			return NULL;
+
+		/* IRQs stay disabled while switching shards */
+		list_del_init(cursor);
+		spin_unlock(&shard->lock);
+
+		iter->shard = next;
+		shard = scx_task_iter_shard(iter);
+		spin_lock(&shard->lock);
+		list_add(cursor, &shard->tasks);
+	}
 }
 
 /**
@@ -444,10 +1214,7 @@ scx_task_iter_next_filtered_locked(struct scx_task_iter *iter)
 {
 	struct task_struct *p;
 
-	if (iter->locked) {
-		task_rq_unlock(iter->rq, iter->locked, &iter->rf);
-		iter->locked = NULL;
-	}
+	scx_task_iter_rq_unlock(iter);
 
 	p = scx_task_iter_next_filtered(iter);
 	if (!p)
@@ -575,6 +1342,96 @@ static void touch_core_sched_dispatch(struct rq *rq, struct task_struct *p)
 #endif
 }
 
+/*
+ * Vtime ordered local DSQs, enabled per CPU by the local_vtime_ctrl CPU
+ * bitmask. Tasks queued on such a local DSQ other than at the head are kept on
+ * its priq, ordered by a vtime which the SCX core maintains in
+ * scx_entity_ext->local_vtime. This is separate from @p->scx->dsq_vtime which
+ * belongs to the BPF scheduler, and overrides its ordering for local DSQs. The
+ * vtime advances by execution time scaled by the inverse of @p's weight, and
+ * is relative to scx_local_min_vtime of the CPU, which tracks the vtime of the
+ * tasks starting to run there.
+ */
+static DEFINE_STATIC_KEY_FALSE(scx_local_vtime_enabled);
+static DEFINE_PER_CPU_READ_MOSTLY(bool, scx_local_vtime);
+static DEFINE_PER_CPU(u64, scx_local_min_vtime);
+
+static bool local_dsq_vtime_ordered(struct scx_rq *scx_rq)
+{
+	return static_branch_unlikely(&scx_local_vtime_enabled) &&
+		per_cpu(scx_local_vtime, cpu_of(scx_rq->rq));
+}
+
+static bool scx_local_vtime_less(struct rb_node *node_a,
+				 const struct rb_node *node_b)
+{
+	const struct sched_ext_entity *a =
+		container_of(node_a, struct sched_ext_entity, dsq_node.priq);
+	const struct sched_ext_entity *b =
+		container_of(node_b, struct sched_ext_entity, dsq_node.priq);
+
+	return scx_policy_vtime_before(scx_ext(a->task)->local_vtime,
+				       scx_ext(b->task)->local_vtime);
+}
+
+static void local_dsq_enqueue_vtime(struct scx_rq *scx_rq,
+				    struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	int cpu = cpu_of(scx_rq->rq);
+	u64 min = per_cpu(scx_local_min_vtime, cpu);
+
+	/* carry @p's lag over from the CPU its vtime is relative to */
+	if (ext->local_vtime_cpu != cpu) {
+		if (ext->local_vtime_cpu >= 0)
+			ext->local_vtime += min -
+				READ_ONCE(per_cpu(scx_local_min_vtime,
+						  ext->local_vtime_cpu));
+		else
+			ext->local_vtime = min;
+		ext->local_vtime_cpu = cpu;
+	}
+
+	/* sleepers can't bank more than a slice */
+	if (time_before64(ext->local_vtime, min - SCX_SLICE_DFL))
+		ext->local_vtime = min - SCX_SLICE_DFL;
+
+	p->scx->dsq_flags |= SCX_TASK_DSQ_ON_PRIQ;
+	rb_add_cached(&p->scx->dsq_node.priq, &scx_rq->local_dsq.priq,
+		      scx_local_vtime_less);
+}
+
+/* @p is starting to run on @rq */
+static void local_dsq_vtime_running(struct rq *rq, struct task_struct *p)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	u64 *min = this_cpu_ptr(&scx_local_min_vtime);
+
+	if (ext->local_vtime_cpu == cpu_of(rq) &&
+	    time_after64(ext->local_vtime, *min))
+		WRITE_ONCE(*min, ext->local_vtime);
+}
+
+/*
+ * Latch local_vtime_ctrl, bit N of which selects CPU N. -1 selects all CPUs.
+ * Returns whether any CPU is selected.
+ */
+static bool scx_local_vtime_setup(void)
+{
+	int mask = READ_ONCE(local_vtime_ctrl);
+	bool any = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		bool on = mask == -1 ||
+			(cpu < BITS_PER_TYPE(mask) && (mask & (1U << cpu)));
+
+		per_cpu(scx_local_vtime, cpu) = on;
+		any |= on;
+	}
+	return any;
+}
+
 static void update_curr_scx(struct rq *rq)
 {
 	struct task_struct *curr = rq->curr;
@@ -589,6 +1446,12 @@ static void update_curr_scx(struct rq *rq)
 	curr->se.sum_exec_runtime += delta_exec;
 	account_group_exec_runtime(curr, delta_exec);
 	cgroup_account_cputime(curr, delta_exec);
+	scx_group_charge(rq, curr, delta_exec);
+	if (static_branch_unlikely(&scx_slice_adapt))
+		scx_ext(curr)->run_sum += delta_exec;
+	if (static_branch_unlikely(&scx_local_vtime_enabled))
+		scx_ext(curr)->local_vtime +=
+			div_u64(delta_exec * 100, max_t(u32, curr->scx->weight, 1));
 
 	if (curr->scx->slice != SCX_SLICE_INF) {
 		curr->scx->slice -= min(curr->scx->slice, delta_exec);
@@ -597,6 +1460,107 @@ static void update_curr_scx(struct rq *rq)
 	}
 }
 
+/*
+ * Shadow tick. task_tick_scx() only notices slice expiry at HZ granularity,
+ * which lets short slices overrun by up to a tick. When highres_tick_ctrl is
+ * set, a per-CPU hrtimer is armed for the remaining slice of the task being
+ * switched to and reschedules at expiry. The periodic tick is still needed for
+ * the rest of task_tick_scx(), the group charges and the window based load.
+ *
+ * The timer is pinned to its rq's CPU. Like hrtick_start(), arming it for a
+ * remote rq is bounced to that CPU through @csd.
+ */
+struct scx_shadow_tick {
+	struct hrtimer		timer;
+	struct rq		*rq;
+	call_single_data_t	csd;
+};
+
+static DEFINE_PER_CPU(struct scx_shadow_tick, scx_shadow_tick);
+static DEFINE_STATIC_KEY_FALSE(scx_shadow_tick_enabled);
+
+static enum hrtimer_restart scx_shadow_tick_fn(struct hrtimer *timer)
+{
+	struct scx_shadow_tick *st = container_of(timer, struct scx_shadow_tick,
+						  timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	struct rq *rq = st->rq;
+	struct task_struct *curr;
+	struct rq_flags rf;
+
+	rq_lock(rq, &rf);
+	update_rq_clock(rq);
+
+	curr = rq->curr;
+	if (curr->sched_class != &ext_sched_class)
+		goto out_unlock;
+
+	update_curr_scx(rq);
+
+	if (unlikely(READ_ONCE(highres_tick_ctrl_dbg)))
+		hmbird_trace(HMBIRD_TRACE_SHADOW_TICK, curr, 0,
+			     min_t(u64, curr->scx->slice, U32_MAX));
+
+	/* the slice may have been extended since the timer was armed */
+	if (!curr->scx->slice) {
+		resched_curr(rq);
+	} else if (curr->scx->slice != SCX_SLICE_INF) {
+		hrtimer_forward_now(timer, ns_to_ktime(curr->scx->slice));
+		ret = HRTIMER_RESTART;
+	}
+out_unlock:
+	rq_unlock(rq, &rf);
+	return ret;
+}
+
+/* @st->rq is locked and its CPU is the local one */
+static void __scx_shadow_tick_start(struct scx_shadow_tick *st, u64 slice)
+{
+	/* like hrtick_start(), don't bother with shorter delays */
+	hrtimer_start(&st->timer, ns_to_ktime(max_t(u64, slice,
+						    10 * NSEC_PER_USEC)),
+		      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+/* arm the shadow tick of a remote rq for whatever it's running by now */
+static void scx_shadow_tick_csd_fn(void *arg)
+{
+	struct scx_shadow_tick *st = arg;
+	struct rq *rq = st->rq;
+	struct task_struct *curr;
+	struct rq_flags rf;
+
+	rq_lock(rq, &rf);
+	curr = rq->curr;
+	if (curr->sched_class == &ext_sched_class &&
+	    curr->scx->slice != SCX_SLICE_INF)
+		__scx_shadow_tick_start(st, curr->scx->slice);
+	rq_unlock(rq, &rf);
+}
+
+/* arm the shadow tick for @p which is being switched to on @rq */
+static void scx_shadow_tick_start(struct rq *rq, struct task_struct *p)
+{
+	struct scx_shadow_tick *st = per_cpu_ptr(&scx_shadow_tick, cpu_of(rq));
+
+	if (!static_branch_unlikely(&scx_shadow_tick_enabled) ||
+	    p->scx->slice == SCX_SLICE_INF || !cpu_active(cpu_of(rq)) ||
+	    !hrtimer_is_hres_active(&st->timer))
+		return;
+
+	if (rq == this_rq())
+		__scx_shadow_tick_start(st, p->scx->slice);
+	else
+		smp_call_function_single_async(cpu_of(rq), &st->csd);
+}
+
+static void scx_shadow_tick_stop(struct rq *rq)
+{
+	if (static_branch_unlikely(&scx_shadow_tick_enabled))
+		hrtimer_try_to_cancel(&per_cpu_ptr(&scx_shadow_tick,
+						   cpu_of(rq))->timer);
+}
+
 static bool scx_dsq_priq_less(struct rb_node *node_a,
 			      const struct rb_node *node_b)
 {
@@ -605,41 +1569,122 @@ static bool scx_dsq_priq_less(struct rb_node *node_a,
 	const struct sched_ext_entity *b =
 		container_of(node_b, struct sched_ext_entity, dsq_node.priq);
 
-	return time_before64(a->dsq_vtime, b->dsq_vtime);
+	return scx_policy_vtime_before(a->dsq_vtime, b->dsq_vtime);
 }
 
-static void dispatch_enqueue(struct scx_dispatch_q *dsq, struct task_struct *p,
-			     u64 enq_flags)
+/*
+ * Returns @dsq's index if @dsq is a non-local DSQ which should be indexed, NULL
+ * otherwise.
+ */
+static struct scx_dsq_index *dsq_index(struct scx_dispatch_q *dsq)
+{
+	if (!static_branch_unlikely(&scx_dsq_indexed) || dsq->id == SCX_DSQ_LOCAL)
+		return NULL;
+	return container_of(dsq, struct scx_dsq_ext, dsq)->idx;
+}
+
+static u32 dsq_index_bucket_of(struct scx_dsq_index *idx, struct task_struct *p)
+{
+	const struct cpumask *allowed = p->cpus_ptr;
+	u32 cls = 0;
+	int i;
+
+	if (p->nr_cpus_allowed == 1)
+		return SCX_DSQ_IDX_PINNED + cpumask_first(allowed);
+
+	for (i = 0; i < scx_nr_clusters; i++) {
+		if (cpumask_subset(&scx_cluster_cpus[i], allowed))
+			cls |= 1 << i;
+		else if (cpumask_intersects(&scx_cluster_cpus[i], allowed))
+			return SCX_DSQ_IDX_MISC(idx);
+	}
+
+	return cls ?: SCX_DSQ_IDX_MISC(idx);
+}
+
+static void dsq_index_enqueue(struct scx_dsq_index *idx, struct task_struct *p,
+			      u64 enq_flags)
+{
+	struct scx_entity_ext *ext = scx_ext(p);
+	struct scx_dsq_bucket *b = &idx->buckets[dsq_index_bucket_of(idx, p)];
+
+	switch (scx_policy_dsq_pos(enq_flags & (SCX_ENQ_HEAD | SCX_ENQ_PREEMPT),
+				   enq_flags & SCX_ENQ_DSQ_PRIQ, false)) {
+	case SCX_POS_PRIQ:
+		p->scx->dsq_flags |= SCX_TASK_DSQ_ON_PRIQ;
+		rb_add_cached(&p->scx->dsq_node.priq, &b->priq,
+			      scx_dsq_priq_less);
+		break;
+	case SCX_POS_HEAD:
+		ext->dsq_seq = idx->head_seq--;
+		list_add(&p->scx->dsq_node.fifo, &b->fifo);
+		break;
+	default:
+		ext->dsq_seq = idx->tail_seq++;
+		list_add_tail(&p->scx->dsq_node.fifo, &b->fifo);
+		break;
+	}
+	b->nr++;
+	ext->bucket = b;
+}
+
+/* lock non-local @dsq for dispatching, returns the DSQ which got locked */
+static struct scx_dispatch_q *dispatch_lock_dsq(struct scx_dispatch_q *dsq)
+{
+	raw_spin_lock(&dsq->lock);
+	if (unlikely(dsq->id == SCX_DSQ_INVALID)) {
+		scx_ops_error("attempting to dispatch to a destroyed dsq");
+		/* fall back to the global dsq */
+		raw_spin_unlock(&dsq->lock);
+		dsq = &scx_dsq_global.dsq;
+		raw_spin_lock(&dsq->lock);
+	}
+	return dsq;
+}
+
+/* dispatch_enqueue() with non-local @dsq locked by dispatch_lock_dsq() */
+static void __dispatch_enqueue(struct scx_dispatch_q *dsq,
+			       struct task_struct *p, u64 enq_flags)
 {
 	bool is_local = dsq->id == SCX_DSQ_LOCAL;
+	struct scx_rq *scx_rq = is_local ?
+		container_of(dsq, struct scx_rq, local_dsq) : NULL;
+	enum scx_policy_dsq_pos pos;
+	struct scx_dsq_index *idx;
 
 	WARN_ON_ONCE(p->scx->dsq || !list_empty(&p->scx->dsq_node.fifo));
 	WARN_ON_ONCE((p->scx->dsq_flags & SCX_TASK_DSQ_ON_PRIQ) ||
 		     !RB_EMPTY_NODE(&p->scx->dsq_node.priq));
 
-	if (!is_local) {
-		raw_spin_lock(&dsq->lock);
-		if (unlikely(dsq->id == SCX_DSQ_INVALID)) {
-			scx_ops_error("attempting to dispatch to a destroyed dsq");
-			/* fall back to the global dsq */
-			raw_spin_unlock(&dsq->lock);
-			dsq = &scx_dsq_global;
-			raw_spin_lock(&dsq->lock);
-		}
+	idx = dsq_index(dsq);
+	if (idx) {
+		dsq_index_enqueue(idx, p, enq_flags);
+		goto queued;
 	}
 
-	if (enq_flags & SCX_ENQ_DSQ_PRIQ) {
+	pos = scx_policy_dsq_pos(enq_flags & (SCX_ENQ_HEAD | SCX_ENQ_PREEMPT),
+				 enq_flags & SCX_ENQ_DSQ_PRIQ,
+				 scx_rq && local_dsq_vtime_ordered(scx_rq));
+	switch (pos) {
+	case SCX_POS_VTIME:
+		local_dsq_enqueue_vtime(scx_rq, p);
+		break;
+	case SCX_POS_PRIQ:
 		p->scx->dsq_flags |= SCX_TASK_DSQ_ON_PRIQ;
 		rb_add_cached(&p->scx->dsq_node.priq, &dsq->priq,
 			      scx_dsq_priq_less);
-	} else {
-		if (enq_flags & (SCX_ENQ_HEAD | SCX_ENQ_PREEMPT))
-			list_add(&p->scx->dsq_node.fifo, &dsq->fifo);
-		else
-			list_add_tail(&p->scx->dsq_node.fifo, &dsq->fifo);
+		break;
+	case SCX_POS_HEAD:
+		list_add(&p->scx->dsq_node.fifo, &dsq->fifo);
+		break;
+	default:
+		list_add_tail(&p->scx->dsq_node.fifo, &dsq->fifo);
+		break;
 	}
+queued:
 	dsq->nr++;
 	p->scx->dsq = dsq;
+	hmbird_trace(HMBIRD_TRACE_DISPATCH, p, dsq->id, 0);
 
 	/*
 	 * We're transitioning out of QUEUEING or DISPATCHING. store_release to
@@ -648,6 +1693,14 @@ static void dispatch_enqueue(struct scx_dispatch_q *dsq, struct task_struct *p,
 	if (enq_flags & SCX_ENQ_CLEAR_OPSS)
 		atomic64_set_release(&p->scx->ops_state, SCX_OPSS_NONE);
 
+	if (is_local) {
+		scx_stat_inc(SCX_STAT_DSP_LOCAL);
+	} else {
+		scx_stat_inc(SCX_STAT_DSP);
+		if (dsq->id == SCX_DSQ_GLOBAL)
+			scx_stat_inc_gdsq(dsq);
+	}
+
 	if (is_local) {
 		struct scx_rq *scx = container_of(dsq, struct scx_rq, local_dsq);
 		struct rq *rq = scx->rq;
@@ -662,22 +1715,43 @@ static void dispatch_enqueue(struct scx_dispatch_q *dsq, struct task_struct *p,
 		if (preempt || sched_class_above(&ext_sched_class,
 						 rq->curr->sched_class))
 			resched_curr(rq);
+	}
+}
+
+static void dispatch_enqueue(struct scx_dispatch_q *dsq, struct task_struct *p,
+			     u64 enq_flags)
+{
+	u64 start = scx_lat_start();
+
+	if (dsq->id == SCX_DSQ_LOCAL) {
+		__dispatch_enqueue(dsq, p, enq_flags);
 	} else {
+		dsq = dispatch_lock_dsq(dsq);
+		__dispatch_enqueue(dsq, p, enq_flags);
 		raw_spin_unlock(&dsq->lock);
 	}
+
+	scx_lat_end(SCX_LAT_DSP_ENQ, start);
 }
 
 static void task_unlink_from_dsq(struct task_struct *p,
 				 struct scx_dispatch_q *dsq)
 {
+	struct scx_entity_ext *ext = scx_ext(p);
+	struct scx_dsq_bucket *b = ext->bucket;
+
 	if (p->scx->dsq_flags & SCX_TASK_DSQ_ON_PRIQ) {
-		rb_erase_cached(&p->scx->dsq_node.priq, &dsq->priq);
+		rb_erase_cached(&p->scx->dsq_node.priq, b ? &b->priq : &dsq->priq);
 		RB_CLEAR_NODE(&p->scx->dsq_node.priq);
 		p->scx->dsq_flags &= ~SCX_TASK_DSQ_ON_PRIQ;
 	} else {
 		list_del_init(&p->scx->dsq_node.fifo);
 	}
 
+	if (b) {
+		b->nr--;
+		ext->bucket = NULL;
+	}
 }
 
 static bool task_linked_on_dsq(struct task_struct *p)
@@ -732,32 +1806,146 @@ static void dispatch_dequeue(struct scx_rq *scx_rq, struct task_struct *p)
 		raw_spin_unlock(&dsq->lock);
 }
 
-static struct scx_dispatch_q *find_non_local_dsq(u64 dsq_id)
+static int scx_cpu_cluster_id(s32 cpu)
 {
-	lockdep_assert(rcu_read_lock_any_held());
-
-	return &scx_dsq_global;
+	return per_cpu(scx_cpu_cluster, cpu);
 }
 
-static struct scx_dispatch_q *find_dsq_for_dispatch(struct rq *rq, u64 dsq_id,
-						    struct task_struct *p)
+/**
+ * scx_build_clusters - Build the cluster map used by the SCX core
+ *
+ * CPUs are grouped into clusters in CPU ID order. If cpu_cluster_masks is set,
+ * each set bit marks the first CPU of a new cluster (e.g. 0x89 for a 3-4-1
+ * layout on 8 CPUs). Otherwise, a new cluster starts whenever the CPU capacity
+ * changes, which matches how asymmetric SoCs enumerate their cores. Also
+ * finds the prime cluster and computes the per-cluster steal order according
+ * to gdsq_steal_order.
+ *
+ * Called from scx_ops_enable() with cpus_read_lock() held and before any task
+ * is on SCX, so the readers never see the map changing.
+ */
+static void scx_build_clusters(void)
 {
-	struct scx_dispatch_q *dsq;
+	unsigned int masks = READ_ONCE(cpu_cluster_masks);
+	int order = READ_ONCE(gdsq_steal_order);
+	unsigned long prev_cap = ULONG_MAX;
+	int cpu, cl = -1, i;
 
-	if (dsq_id == SCX_DSQ_LOCAL)
-		return &rq->scx->local_dsq;
+	for (i = 0; i < SCX_MAX_CLUSTERS; i++)
+		cpumask_clear(&scx_cluster_cpus[i]);
 
-	dsq = find_non_local_dsq(dsq_id);
-	if (unlikely(!dsq)) {
-		scx_ops_error("non-existent DSQ 0x%llx for %s[%d]",
-			      dsq_id, p->comm, p->pid);
-		return &scx_dsq_global;
+	for_each_possible_cpu(cpu) {
+		unsigned long cap = arch_scale_cpu_capacity(cpu);
+		bool new_cluster;
+
+		if (masks)
+			new_cluster = cl < 0 ||
+				(cpu < BITS_PER_TYPE(masks) && (masks & (1U << cpu)));
+		else
+			new_cluster = cap != prev_cap;
+
+		if (new_cluster && cl < SCX_MAX_CLUSTERS - 1) {
+			cl++;
+			scx_cluster_cap[cl] = cap;
+		}
+		prev_cap = cap;
+
+		per_cpu(scx_cpu_cluster, cpu) = cl;
+		cpumask_set_cpu(cpu, &scx_cluster_cpus[cl]);
+	}
+	scx_nr_clusters = cl + 1;
+
+	/* a lone top capacity CPU above at least two other clusters is prime */
+	scx_prime_cluster = -1;
+	if (scx_nr_clusters > 2) {
+		int top = 0;
+
+		for (i = 1; i < scx_nr_clusters; i++)
+			if (scx_cluster_cap[i] > scx_cluster_cap[top])
+				top = i;
+		if (cpumask_weight(&scx_cluster_cpus[top]) == 1)
+			scx_prime_cluster = top;
 	}
 
-	return dsq;
+	for (i = 0; i < scx_nr_clusters; i++)
+		scx_policy_build_steal(scx_cluster_cap, scx_nr_clusters, order,
+				       i, scx_cluster_steal[i]);
 }
 
-static void direct_dispatch(struct task_struct *ddsp_task, struct task_struct *p,
+#include "./hmbird_park.c"
+#include "./hmbird_key.c"
+#include "./hmbird_shm.c"
+
+/**
+ * find_global_dsq - Find the global DSQ to queue a task for @cpu on
+ * @cpu: CPU the task is associated with
+ *
+ * Returns @cpu's cluster shard if the global DSQ is sharded, scx_dsq_global
+ * otherwise.
+ */
+static struct scx_dispatch_q *find_global_dsq(s32 cpu)
+{
+	if (static_branch_unlikely(&scx_gdsq_sharded))
+		return &scx_gdsq_shards[scx_cpu_cluster_id(cpu)].dsq;
+	return &scx_dsq_global.dsq;
+}
+
+/*
+ * Find the DSQ to queue @p on for %SCX_DSQ_GLOBAL. That's a key DSQ if @p is a
+ * key task, or @p's group DSQ if enabled, unless the BPF scheduler is being
+ * disabled, in which case only the global DSQs are guaranteed to be consumed.
+ */
+static struct scx_dispatch_q *find_task_global_dsq(struct task_struct *p,
+						   s32 cpu)
+{
+	if (scx_key_task(p) && !scx_ops_disabling())
+		return find_key_dsq(cpu);
+#ifdef CONFIG_EXT_GROUP_SCHED
+	if (static_branch_unlikely(&scx_group_dsq) && !scx_ops_disabling())
+		return find_group_dsq(p);
+#endif
+	return find_global_dsq(cpu);
+}
+
+static struct scx_dispatch_q *find_non_local_dsq(u64 dsq_id)
+{
+	lockdep_assert(rcu_read_lock_any_held());
+
+	if (dsq_id == SCX_DSQ_GLOBAL)
+		return &scx_dsq_global.dsq;
+	else
+		return rhashtable_lookup_fast(&dsq_hash, &dsq_id,
+					      dsq_hash_params);
+}
+
+static struct scx_dispatch_q *find_dsq_for_dispatch(struct rq *rq, u64 dsq_id,
+						    struct task_struct *p)
+{
+	struct scx_dispatch_q *dsq;
+
+	if (dsq_id == SCX_DSQ_LOCAL)
+		return &rq->scx->local_dsq;
+
+	/*
+	 * Dispatches racing scx_ops_bypass() go to the global DSQ which is
+	 * still consumed while bypassing.
+	 */
+	if (unlikely(scx_ops_disabling()))
+		return find_global_dsq(task_cpu(p));
+	if (dsq_id == SCX_DSQ_GLOBAL)
+		return find_task_global_dsq(p, task_cpu(p));
+
+	dsq = find_non_local_dsq(dsq_id);
+	if (unlikely(!dsq)) {
+		scx_ops_error("non-existent DSQ 0x%llx for %s[%d]",
+			      dsq_id, p->comm, p->pid);
+		return &scx_dsq_global.dsq;
+	}
+
+	return dsq;
+}
+
+static void direct_dispatch(struct task_struct *ddsp_task, struct task_struct *p,
 			    u64 dsq_id, u64 enq_flags)
 {
 	struct scx_dispatch_q *dsq;
@@ -823,6 +2011,10 @@ static void do_enqueue_task(struct rq *rq, struct task_struct *p, u64 enq_flags,
 	if (sticky_cpu == cpu_of(rq))
 		goto local_norefill;
 
+	/* the BPF scheduler is being bypassed, see scx_ops_bypass() */
+	if (unlikely(scx_ops_disabling()))
+		goto local;
+
 	/*
 	 * If !rq->online, we already told the BPF scheduler that the CPU is
 	 * offline. We're just trying to on/offline the CPU. Don't bother the
@@ -876,15 +2068,15 @@ local:
 	 * higher priority it becomes from scx_prio_less()'s POV.
 	 */
 	touch_core_sched(rq, p);
-	p->scx->slice = SCX_SLICE_DFL;
+	p->scx->slice = scx_task_slice(rq, p);
 local_norefill:
 	dispatch_enqueue(&rq->scx->local_dsq, p, enq_flags);
 	return;
 
 global:
 	touch_core_sched(rq, p);	/* see the comment in local: */
-	p->scx->slice = SCX_SLICE_DFL;
-	dispatch_enqueue(&scx_dsq_global, p, enq_flags);
+	p->scx->slice = scx_task_slice(rq, p);
+	dispatch_enqueue(find_task_global_dsq(p, cpu_of(rq)), p, enq_flags);
 }
 
 static bool watchdog_task_watched(const struct task_struct *p)
@@ -892,30 +2084,73 @@ static bool watchdog_task_watched(const struct task_struct *p)
 	return !list_empty(&p->scx->watchdog_node);
 }
 
+/*
+ * Each rq's watchdog_list is sorted by runnable_at so that the watchdog only
+ * needs to look at the head. The head's runnable_at is mirrored here for
+ * scx_watchdog_workfn() to skip the rqs without stalls without locking them.
+ * @runnable_at is only meaningful while @busy is set.
+ */
+struct scx_watchdog_head {
+	unsigned long		runnable_at;
+	bool			busy;
+	unsigned long		near_at;	/* last near miss, watchdog only */
+};
+
+static DEFINE_PER_CPU(struct scx_watchdog_head, scx_watchdog_head);
+
+static void watchdog_update_head(struct rq *rq)
+{
+	struct scx_watchdog_head *wh = per_cpu_ptr(&scx_watchdog_head, cpu_of(rq));
+	struct sched_ext_entity *first =
+		list_first_entry_or_null(&rq->scx->watchdog_list,
+					 struct sched_ext_entity, watchdog_node);
+
+	if (first)
+		WRITE_ONCE(wh->runnable_at, first->runnable_at);
+	WRITE_ONCE(wh->busy, first);
+}
+
 static void watchdog_watch_task(struct rq *rq, struct task_struct *p)
 {
+	struct list_head *pos = &rq->scx->watchdog_list;
+	struct sched_ext_entity *entity;
+
 	lockdep_assert_rq_held(rq);
-	if (p->scx->flags & SCX_TASK_WATCHDOG_RESET)
+	if (p->scx->flags & SCX_TASK_WATCHDOG_RESET) {
 		p->scx->runnable_at = jiffies;
+		scx_ext(p)->runnable_ns = local_clock();
+	}
 	p->scx->flags &= ~SCX_TASK_WATCHDOG_RESET;
-	list_add_tail(&p->scx->watchdog_node, &rq->scx->watchdog_list);
+
+	/*
+	 * Freshly runnable tasks go to the tail. Tasks which are requeued or
+	 * migrated keep their runnable_at and walk back past the newer ones.
+	 */
+	list_for_each_entry_reverse(entity, &rq->scx->watchdog_list,
+				    watchdog_node) {
+		if (!time_after(entity->runnable_at, p->scx->runnable_at))
+			break;
+		pos = &entity->watchdog_node;
+	}
+	list_add_tail(&p->scx->watchdog_node, pos);
+	watchdog_update_head(rq);
 }
 
 static void watchdog_unwatch_task(struct task_struct *p, bool reset_timeout)
 {
 	list_del_init(&p->scx->watchdog_node);
+	watchdog_update_head(task_rq(p));
 	if (reset_timeout)
 		p->scx->flags |= SCX_TASK_WATCHDOG_RESET;
 }
 
-atomic_t scx_active_tasks = ATOMIC_INIT(0);
-u64 scx_total_dispatches;
-
 static void enqueue_task_scx(struct rq *rq, struct task_struct *p, int enq_flags)
 {
-	atomic_inc(&scx_active_tasks);
 	int sticky_cpu = p->scx->sticky_cpu;
 
+	scx_stat_inc(SCX_STAT_ENQ);
+	hmbird_trace(HMBIRD_TRACE_ENQUEUE, p, 0, enq_flags);
+
 	enq_flags |= rq->scx->extra_enq_flags;
 
 	if (sticky_cpu >= 0)
@@ -943,8 +2178,12 @@ static void enqueue_task_scx(struct rq *rq, struct task_struct *p, int enq_flags
 	if (SCX_HAS_OP(runnable))
 		SCX_CALL_OP_TASK(SCX_KF_REST, runnable, p, enq_flags);
 
-	if (enq_flags & SCX_ENQ_WAKEUP)
+	if (enq_flags & SCX_ENQ_WAKEUP) {
 		touch_core_sched(rq, p);
+		scx_update_task_ravg(p, rq, TASK_WAKE);
+		if (static_branch_unlikely(&scx_slice_adapt))
+			scx_slice_task_woken(rq, p);
+	}
 
 	do_enqueue_task(rq, p, enq_flags, sticky_cpu);
 }
@@ -997,7 +2236,6 @@ static void ops_dequeue(struct task_struct *p, u64 deq_flags)
 
 static void dequeue_task_scx(struct rq *rq, struct task_struct *p, int deq_flags)
 {
-	atomic_dec(&scx_active_tasks);
 	struct scx_rq *scx_rq = rq->scx;
 
 	if (!(p->scx->flags & SCX_TASK_QUEUED)) {
@@ -1024,16 +2262,19 @@ static void dequeue_task_scx(struct rq *rq, struct task_struct *p, int deq_flags
 		SCX_CALL_OP_TASK(SCX_KF_REST, stopping, p, false);
 	}
 
-	//if(task_current(rq, p))
-	//	scx_update_task_ravg(p, rq, PUT_PREV_TASK, rq->clock);
+	if (task_current(rq, p))
+		scx_update_task_ravg(p, rq, PUT_PREV_TASK);
 
 	if (SCX_HAS_OP(quiescent))
 		SCX_CALL_OP_TASK(SCX_KF_REST, quiescent, p, deq_flags);
 
-	if (deq_flags & SCX_DEQ_SLEEP)
+	if (deq_flags & SCX_DEQ_SLEEP) {
 		p->scx->flags |= SCX_TASK_DEQD_FOR_SLEEP;
-	else
+		if (static_branch_unlikely(&scx_slice_adapt))
+			scx_slice_task_slept(p);
+	} else {
 		p->scx->flags &= ~SCX_TASK_DEQD_FOR_SLEEP;
+	}
 
 	p->scx->flags &= ~SCX_TASK_QUEUED;
 	BUG_ON(!scx_rq->nr_running);
@@ -1198,81 +2439,431 @@ static bool task_can_run_on_rq(struct task_struct *p, struct rq *rq)
 		cpumask_test_cpu(cpu_of(rq), p->cpus_ptr);
 }
 
-static bool consume_dispatch_q(struct rq *rq, struct rq_flags *rf,
-			       struct scx_dispatch_q *dsq)
+static bool task_can_consume(struct task_struct *p, struct rq *rq)
+{
+	if (hmbird_park_keep_off(p, cpu_of(rq)))
+		return false;
+	return rq == task_rq(p) || task_can_run_on_rq(p, rq);
+}
+
+static struct task_struct *first_consumable_fifo(struct list_head *fifo,
+						 struct rq *rq)
+{
+	struct sched_ext_entity *entity;
+
+	list_for_each_entry(entity, fifo, dsq_node.fifo)
+		if (task_can_consume(entity->task, rq))
+			return entity->task;
+	return NULL;
+}
+
+static struct task_struct *first_consumable_priq(struct rb_root_cached *priq,
+						 struct rq *rq)
 {
-	struct scx_rq *scx_rq = rq->scx;
 	struct sched_ext_entity *entity;
-	struct task_struct *p;
 	struct rb_node *rb_node;
-	struct rq *task_rq;
-	bool moved = false;
-retry:
-	if (list_empty(&dsq->fifo) && !rb_first_cached(&dsq->priq))
-		return false;
 
-	raw_spin_lock(&dsq->lock);
+	for (rb_node = rb_first_cached(priq); rb_node; rb_node = rb_next(rb_node)) {
+		entity = container_of(rb_node, struct sched_ext_entity, dsq_node.priq);
+		if (task_can_consume(entity->task, rq))
+			return entity->task;
+	}
+	return NULL;
+}
 
-	list_for_each_entry(entity, &dsq->fifo, dsq_node.fifo) {
-		p = entity->task;
-		task_rq = task_rq(p);
-		if (rq == task_rq)
-			goto this_rq;
-		if (task_can_run_on_rq(p, rq))
-			goto remote_rq;
+/**
+ * dsq_index_pick - Pick the first task in @idx which can be consumed by @rq
+ * @idx: DSQ index to pick from, its DSQ locked
+ * @rq: rq to consume into
+ *
+ * Equivalent to scanning the FIFO and then the priq of an unindexed DSQ, but
+ * only looks at the buckets which can contain tasks for @rq. The cluster and
+ * pinned buckets contain only tasks allowed on @rq's CPU, so the first task in
+ * them is consumable unless it's migration disabled.
+ */
+static struct task_struct *dsq_index_pick(struct scx_dsq_index *idx,
+					  struct rq *rq)
+{
+	u32 cand[SCX_DSQ_IDX_MAX_CAND], nr_cand = 0, cls, i;
+	u32 self = 1 << scx_cpu_cluster_id(cpu_of(rq));
+	struct task_struct *best = NULL, *p;
+
+	for (cls = self; cls < (1U << scx_nr_clusters); cls++)
+		if (cls & self)
+			cand[nr_cand++] = cls;
+	cand[nr_cand++] = SCX_DSQ_IDX_PINNED + cpu_of(rq);
+	cand[nr_cand++] = SCX_DSQ_IDX_MISC(idx);
+
+	for (i = 0; i < nr_cand; i++) {
+		struct scx_dsq_bucket *b = &idx->buckets[cand[i]];
+
+		if (!b->nr)
+			continue;
+		p = first_consumable_fifo(&b->fifo, rq);
+		if (p && (!best || scx_ext(p)->dsq_seq < scx_ext(best)->dsq_seq))
+			best = p;
 	}
+	if (best)
+		return best;
+
+	for (i = 0; i < nr_cand; i++) {
+		struct scx_dsq_bucket *b = &idx->buckets[cand[i]];
+
+		if (!b->nr)
+			continue;
+		p = first_consumable_priq(&b->priq, rq);
+		if (p && (!best || time_before64(p->scx->dsq_vtime,
+						 best->scx->dsq_vtime)))
+			best = p;
+	}
+	return best;
+}
 
-	for (rb_node = rb_first_cached(&dsq->priq); rb_node;
-	     rb_node = rb_next(rb_node)) {
-		entity = container_of(rb_node, struct sched_ext_entity, dsq_node.priq);
-		p = entity->task;
-		task_rq = task_rq(p);
-		if (rq == task_rq)
-			goto this_rq;
-		if (task_can_run_on_rq(p, rq))
-			goto remote_rq;
+static struct task_struct *dsq_first_consumable(struct scx_dispatch_q *dsq,
+						 struct rq *rq)
+{
+	struct scx_dsq_index *idx = dsq_index(dsq);
+
+	if (idx)
+		return dsq_index_pick(idx, rq);
+	return first_consumable_fifo(&dsq->fifo, rq) ?:
+		first_consumable_priq(&dsq->priq, rq);
+}
+
+/*
+ * Task at @pos in locked @dsq, see scx_bpf_dsq_peek(). FIFO tasks come before
+ * priq tasks. An indexed DSQ is walked bucket by bucket.
+ */
+static struct task_struct *dsq_nth_task(struct scx_dispatch_q *dsq, u32 pos)
+{
+	struct scx_dsq_index *idx = dsq_index(dsq);
+	u32 nr = idx ? idx->nr_buckets : 1, i;
+	struct sched_ext_entity *entity;
+	struct rb_node *rb_node;
+
+	for (i = 0; i < nr; i++) {
+		struct list_head *fifo = idx ? &idx->buckets[i].fifo : &dsq->fifo;
+
+		list_for_each_entry(entity, fifo, dsq_node.fifo)
+			if (!pos--)
+				return entity->task;
 	}
 
-	raw_spin_unlock(&dsq->lock);
-	return false;
+	for (i = 0; i < nr; i++) {
+		struct rb_root_cached *priq = idx ? &idx->buckets[i].priq :
+						    &dsq->priq;
 
-this_rq:
-	/* @dsq is locked and @p is on this rq */
-	WARN_ON_ONCE(p->scx->holding_cpu >= 0);
-	task_unlink_from_dsq(p, dsq);
-	list_add_tail(&p->scx->dsq_node.fifo, &scx_rq->local_dsq.fifo);
-	dsq->nr--;
+		for (rb_node = rb_first_cached(priq); rb_node;
+		     rb_node = rb_next(rb_node))
+			if (!pos--)
+				return container_of(rb_node, struct sched_ext_entity,
+						    dsq_node.priq)->task;
+	}
+	return NULL;
+}
+
+/* put @p, which is on @rq and was unlinked from locked @dsq, on @rq's local DSQ */
+static void consume_local_task(struct rq *rq, struct scx_dispatch_q *dsq,
+			       struct task_struct *p)
+{
+	struct scx_rq *scx_rq = rq->scx;
+
+	if (local_dsq_vtime_ordered(scx_rq))
+		local_dsq_enqueue_vtime(scx_rq, p);
+	else
+		list_add_tail(&p->scx->dsq_node.fifo, &scx_rq->local_dsq.fifo);
 	scx_rq->local_dsq.nr++;
 	p->scx->dsq = &scx_rq->local_dsq;
+	hmbird_trace(HMBIRD_TRACE_CONSUME, p, dsq->id, cpu_of(rq));
+}
+
+/* see consume_dispatch_q_n() */
+static u32 __consume_dispatch_q_n(struct rq *rq, struct rq_flags *rf,
+				  struct scx_dispatch_q *dsq, u32 max)
+{
+	struct task_struct *batch[SCX_CONSUME_MAX_BATCH];
+	struct rq *src_rq;
+	u32 nr_consumed, nr_batch, i;
+
+	max = clamp_t(u32, max, 1, SCX_CONSUME_MAX_BATCH);
+retry:
+	if (!READ_ONCE(dsq->nr))
+		return 0;
+
+	nr_consumed = nr_batch = 0;
+	src_rq = NULL;
+
+	raw_spin_lock(&dsq->lock);
+
+	while (nr_consumed + nr_batch < max) {
+		struct task_struct *p = dsq_first_consumable(dsq, rq);
+		struct rq *task_rq;
+
+		if (!p)
+			break;
+
+		task_rq = task_rq(p);
+		if (task_rq != rq && src_rq && task_rq != src_rq)
+			break;
+
+		WARN_ON_ONCE(p->scx->holding_cpu >= 0);
+		task_unlink_from_dsq(p, dsq);
+		dsq->nr--;
+
+		if (task_rq == rq) {
+			/* @dsq is locked and @p is on this rq */
+			consume_local_task(rq, dsq, p);
+			nr_consumed++;
+		} else {
+			/* @p is now protected by its holding_cpu, see below */
+			p->scx->holding_cpu = raw_smp_processor_id();
+			batch[nr_batch++] = p;
+			src_rq = task_rq;
+		}
+	}
+
 	raw_spin_unlock(&dsq->lock);
-	return true;
 
-remote_rq:
+	scx_stat_add(SCX_STAT_CONSUME_LOCAL, nr_consumed);
+	if (!nr_batch)
+		return nr_consumed;
+
 #ifdef CONFIG_SMP
 	/*
-	 * @dsq is locked and @p is on a remote rq. @p is currently protected by
-	 * @dsq->lock. We want to pull @p to @rq but may deadlock if we grab
-	 * @task_rq while holding @dsq and @rq locks. As dequeue can't drop the
-	 * rq lock or fail, do a little dancing from our side. See
-	 * move_task_to_local_dsq().
+	 * The tasks in @batch are on @src_rq. We want to pull them to @rq but
+	 * may deadlock if we grab @src_rq while holding @dsq and @rq locks. As
+	 * dequeue can't drop the rq lock or fail, do a little dancing from our
+	 * side. See move_task_to_local_dsq().
 	 */
+	rq_unpin_lock(rq, rf);
+	double_lock_balance(rq, src_rq);
+	rq_repin_lock(rq, rf);
+
+	for (i = 0; i < nr_batch; i++) {
+		if (move_task_to_local_dsq(rq, batch[i], 0)) {
+			scx_stat_inc(SCX_STAT_CONSUME_REMOTE);
+			hmbird_trace(HMBIRD_TRACE_CONSUME, batch[i], dsq->id,
+				     cpu_of(src_rq));
+			nr_consumed++;
+		}
+	}
+
+	double_unlock_balance(rq, src_rq);
+#endif /* CONFIG_SMP */
+	if (likely(nr_consumed))
+		return nr_consumed;
+	goto retry;
+}
+
+/**
+ * consume_dispatch_q_n - Consume tasks from a DSQ into @rq's local DSQ
+ * @rq: rq to consume into, currently locked
+ * @rf: rq_flags to use when unlocking @rq
+ * @dsq: non-local DSQ to consume from
+ * @max: maximum number of tasks to consume
+ *
+ * Consume up to @max tasks in @dsq order. Tasks which are already on @rq are
+ * moved onto the local DSQ directly. Tasks on a remote rq are detached from
+ * @dsq together and migrated in a single double_lock_balance() round-trip,
+ * which is why consumption stops at the first task on a second remote rq.
+ *
+ * Returns the number of tasks consumed.
+ */
+static u32 consume_dispatch_q_n(struct rq *rq, struct rq_flags *rf,
+				struct scx_dispatch_q *dsq, u32 max)
+{
+	u64 start;
+	u32 nr;
+
+	if (!READ_ONCE(dsq->nr))
+		return 0;
+
+	start = scx_lat_start();
+	nr = __consume_dispatch_q_n(rq, rf, dsq, max);
+	scx_lat_end(SCX_LAT_CONSUME, start);
+	return nr;
+}
+
+/**
+ * consume_task - Consume a specific task into @rq's local DSQ
+ * @rq: rq to consume into, currently locked
+ * @rf: rq_flags to use when unlocking @rq
+ * @dsq_id: ID of the non-local DSQ @p is expected to be on
+ * @p: task to consume
+ *
+ * The DSQs %SCX_DSQ_GLOBAL maps to, the shards and the group DSQs, all carry
+ * its ID, so @p's current DSQ is looked at rather than looking up @dsq_id.
+ * Returns %true if @p has been consumed.
+ */
+static bool consume_task(struct rq *rq, struct rq_flags *rf, u64 dsq_id,
+			 struct task_struct *p)
+{
+	struct scx_dispatch_q *dsq = READ_ONCE(p->scx->dsq);
+	struct rq *src_rq;
+	bool consumed = false;
+
+	if (!dsq || dsq_id == SCX_DSQ_LOCAL || dsq->id != dsq_id)
+		return false;
+
+	/* DSQs are RCU freed, see destroy_dsq() */
+	raw_spin_lock(&dsq->lock);
+
+	if (p->scx->dsq != dsq || !task_can_consume(p, rq)) {
+		raw_spin_unlock(&dsq->lock);
+		return false;
+	}
+
 	WARN_ON_ONCE(p->scx->holding_cpu >= 0);
 	task_unlink_from_dsq(p, dsq);
 	dsq->nr--;
+	src_rq = task_rq(p);
+
+	if (src_rq == rq) {
+		consume_local_task(rq, dsq, p);
+		raw_spin_unlock(&dsq->lock);
+		scx_stat_inc(SCX_STAT_CONSUME_LOCAL);
+		return true;
+	}
+
+	/* @p is now protected by its holding_cpu, see consume_dispatch_q_n() */
 	p->scx->holding_cpu = raw_smp_processor_id();
 	raw_spin_unlock(&dsq->lock);
 
+#ifdef CONFIG_SMP
 	rq_unpin_lock(rq, rf);
-	double_lock_balance(rq, task_rq);
+	double_lock_balance(rq, src_rq);
 	rq_repin_lock(rq, rf);
 
-	moved = move_task_to_local_dsq(rq, p, 0);
+	consumed = move_task_to_local_dsq(rq, p, 0);
+	if (consumed) {
+		scx_stat_inc(SCX_STAT_CONSUME_REMOTE);
+		hmbird_trace(HMBIRD_TRACE_CONSUME, p, dsq_id, cpu_of(src_rq));
+	}
 
-	double_unlock_balance(rq, task_rq);
+	double_unlock_balance(rq, src_rq);
 #endif /* CONFIG_SMP */
-	if (likely(moved))
-		return true;
-	goto retry;
+	return consumed;
+}
+
+#ifdef CONFIG_EXT_GROUP_SCHED
+/*
+ * Consume from the non-empty, unthrottled group with the lowest vtime. If
+ * nothing in it can run on @rq, try the other groups in list order. Throttling
+ * is ignored while disabling so that all tasks can get off SCX.
+ */
+static u32 consume_group_dsqs(struct rq *rq, struct rq_flags *rf, u32 max)
+{
+	bool bypass = scx_ops_disabling();
+	struct scx_group *g, *best = NULL;
+	u64 now = sched_clock(), vtime;
+	u32 nr;
+
+	list_for_each_entry_rcu(g, &scx_group_list, node) {
+		if (!READ_ONCE(g->dsq.dsq.nr) ||
+		    (!bypass && scx_group_throttled(g, now)))
+			continue;
+		if (!best || time_before64(atomic64_read(&g->vtime),
+					   atomic64_read(&best->vtime)))
+			best = g;
+	}
+
+	if (!best)
+		return 0;
+
+	vtime = atomic64_read(&best->vtime);
+	if (time_after64(vtime, READ_ONCE(scx_group_vtime_floor)))
+		WRITE_ONCE(scx_group_vtime_floor, vtime);
+
+	nr = consume_dispatch_q_n(rq, rf, &best->dsq.dsq, max);
+	if (nr)
+		return nr;
+
+	list_for_each_entry_rcu(g, &scx_group_list, node) {
+		if (g == best || !READ_ONCE(g->dsq.dsq.nr) ||
+		    (!bypass && scx_group_throttled(g, now)))
+			continue;
+		nr = consume_dispatch_q_n(rq, rf, &g->dsq.dsq, max);
+		if (nr)
+			return nr;
+	}
+
+	return 0;
+}
+#else	/* CONFIG_EXT_GROUP_SCHED */
+static u32 consume_group_dsqs(struct rq *rq, struct rq_flags *rf, u32 max)
+{
+	return 0;
+}
+#endif	/* CONFIG_EXT_GROUP_SCHED */
+
+/* consume from @rq's cluster key DSQ, then the others in steal order */
+static u32 consume_key_dsqs(struct rq *rq, struct rq_flags *rf, u32 max)
+{
+	int cl = scx_cpu_cluster_id(cpu_of(rq)), i;
+	u32 nr;
+
+	nr = consume_dispatch_q_n(rq, rf, &scx_key_dsqs[cl].dsq, max);
+	for (i = 0; !nr && i < scx_nr_clusters - 1; i++)
+		nr = consume_dispatch_q_n(rq, rf,
+					  &scx_key_dsqs[scx_cluster_steal[cl][i]].dsq,
+					  max);
+	return nr;
+}
+
+/**
+ * consume_global_dsq_n - Consume tasks from the global DSQ
+ * @rq: rq to consume into, currently locked
+ * @rf: rq_flags to use when unlocking @rq
+ * @max: maximum number of tasks to consume
+ *
+ * Key DSQs come first, then group DSQs if enabled. If the global DSQ is sharded, try @rq's
+ * own cluster shard next and then steal from the remote shards in
+ * scx_cluster_steal[] order. The emptiness
+ * test at the top of consume_dispatch_q_n() is lockless, so checking remote
+ * shards only read-shares their cache lines.
+ *
+ * Returns the number of tasks consumed.
+ */
+static u32 consume_global_dsq_n(struct rq *rq, struct rq_flags *rf, u32 max)
+{
+	u32 nr;
+	int cl, i;
+
+	if (static_branch_unlikely(&scx_key_enabled)) {
+		nr = consume_key_dsqs(rq, rf, max);
+		if (nr)
+			return nr;
+	}
+
+	if (static_branch_unlikely(&scx_group_dsq)) {
+		nr = consume_group_dsqs(rq, rf, max);
+		if (nr)
+			return nr;
+	}
+
+	if (!static_branch_unlikely(&scx_gdsq_sharded))
+		return consume_dispatch_q_n(rq, rf, &scx_dsq_global.dsq, max);
+
+	cl = scx_cpu_cluster_id(cpu_of(rq));
+	nr = consume_dispatch_q_n(rq, rf, &scx_gdsq_shards[cl].dsq, max);
+	if (nr)
+		return nr;
+
+	for (i = 0; i < scx_nr_clusters - 1; i++) {
+		int victim = scx_cluster_steal[cl][i];
+
+		nr = consume_dispatch_q_n(rq, rf, &scx_gdsq_shards[victim].dsq,
+					  max);
+		if (nr)
+			return nr;
+	}
+
+	return consume_dispatch_q_n(rq, rf, &scx_dsq_global.dsq, max);
+}
+
+static bool consume_global_dsq(struct rq *rq, struct rq_flags *rf)
+{
+	return consume_global_dsq_n(rq, rf, 1);
 }
 
 enum dispatch_to_local_dsq_ret {
@@ -1396,51 +2987,95 @@ dispatch_to_local_dsq(struct rq *rq, struct rq_flags *rf, u64 dsq_id,
 	return DTL_INVALID;
 }
 
+/*
+ * HMBird scheduling heuristics, opted into by the BPF scheduler through
+ * %SCX_OPS_HMBIRD_PRIO and %SCX_OPS_HMBIRD_LOAD. Both are false otherwise so
+ * that the paths depending on them reduce to the default behavior.
+ */
+static bool scx_task_high_prio(const struct task_struct *p)
+{
+	if (!static_branch_unlikely(&scx_ops_prio_heur))
+		return false;
+	return p->prio < READ_ONCE(prio_heur_thresh) ||
+		p->policy == SCHED_FIFO || p->policy == SCHED_RR;
+}
+
+/* @rq has more than @ratio runnable tasks per online CPU */
+static bool scx_rq_overloaded(struct rq *rq, int ratio)
+{
+	if (!static_branch_unlikely(&scx_ops_load_heur))
+		return false;
+	return rq->nr_running > num_online_cpus() * ratio;
+}
+
 /**
- * finish_dispatch - Asynchronously finish dispatching a task
- * @rq: current rq which is locked
- * @rf: rq_flags to use when unlocking @rq
- * @p: task to finish dispatching
- * @qseq_at_dispatch: qseq when @p started getting dispatched
+ * defer_dispatch - Park a dispatch to be retried on the next balance
+ * @p: task being dispatched
+ * @qseq: qseq at scx_bpf_dispatch()
  * @dsq_id: destination DSQ ID
  * @enq_flags: %SCX_ENQ_*
+ * @parked_at: when the dispatch was first deferred, 0 if it wasn't
  *
- * Dispatching to local DSQs may need to wait for queueing to complete or
- * require rq lock dancing. As we don't wanna do either while inside
- * ops.dispatch() to avoid locking order inversion, we split dispatching into
- * two parts. scx_bpf_dispatch() which is called by ops.dispatch() records the
- * task and its qseq. Once ops.dispatch() returns, this function is called to
- * finish up.
+ * Enabled by dsp_retry_ctrl. Each dispatch may be retried for up to
+ * dsp_retry_budget_us after it was first deferred. A reference on @p is held
+ * while parked as the retry happens outside the RCU read-side critical
+ * section @p was dispatched in. The CPU is kicked so that the next balance
+ * comes around even if it goes idle.
  *
- * There is no guarantee that @p is still valid for dispatching or even that it
- * was valid in the first place. Make sure that the task is still owned by the
- * BPF scheduler and claim the ownership before dispatching.
+ * Returns %true if the dispatch was deferred.
  */
-static void finish_dispatch(struct rq *rq, struct rq_flags *rf,
-			    struct task_struct *p, u64 qseq_at_dispatch,
-			    u64 dsq_id, u64 enq_flags)
+static bool defer_dispatch(struct task_struct *p, u64 qseq, u64 dsq_id,
+			   u64 enq_flags, u64 parked_at)
 {
-	struct scx_dispatch_q *dsq;
-	u64 opss;
-	u64 dispatch_start_time = sched_clock();
-	int retry_count = 0;
-	bool high_priority_task = false;
+	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
+	struct scx_dsp_retry_ent *rent;
+	u64 now;
 
-	touch_core_sched_dispatch(rq, p);
-	
-	if (p && (p->prio < DEFAULT_PRIO || p->policy == SCHED_FIFO || p->policy == SCHED_RR))
-		high_priority_task = true;
+	if (!READ_ONCE(dsp_retry_ctrl) ||
+	    dspc->nr_retries >= SCX_DSP_MAX_RETRIES)
+		return false;
+
+	now = sched_clock();
+	if (!parked_at)
+		parked_at = now;
+	else if (now - parked_at > (u64)READ_ONCE(dsp_retry_budget_us) * NSEC_PER_USEC)
+		return false;
+
+	rent = &dspc->retries[dspc->nr_retries++];
+	get_task_struct(p);
+	rent->ent = (struct scx_dsp_buf_ent){ .task = p, .qseq = qseq,
+					      .dsq_id = dsq_id,
+					      .enq_flags = enq_flags };
+	rent->parked_at = parked_at;
+
+	/*
+	 * Our rq is locked and any resched set now is cleared once the current
+	 * pick finishes. Kick ourselves through the irq work like a contended
+	 * scx_bpf_kick_cpu() would but without accounting it as a BPF kick.
+	 */
+	cpumask_set_cpu(cpu_of(this_rq()), this_rq()->scx->cpus_to_kick);
+	irq_work_queue(&this_rq()->scx->kick_cpus_irq_work);
+	return true;
+}
+
+/**
+ * claim_dispatch - Claim a task dispatched by scx_bpf_dispatch()
+ * @p: task to claim
+ * @qseq_at_dispatch: qseq when @p started getting dispatched
+ * @dsq_id: destination DSQ ID
+ * @enq_flags: %SCX_ENQ_*
+ * @parked_at: see defer_dispatch()
+ *
+ * Make sure that @p is still owned by the BPF scheduler and transition it to
+ * %SCX_OPSS_DISPATCHING. Returns %true if @p is now ours to dispatch, %false
+ * if someone else got to it or the dispatch was deferred.
+ */
+static bool claim_dispatch(struct task_struct *p, u64 qseq_at_dispatch,
+			   u64 dsq_id, u64 enq_flags, u64 parked_at)
+{
+	u64 opss;
 
 retry:
-	retry_count++;
-	if (unlikely(retry_count > 10)) {
-		if (high_priority_task) {
-			dsq_id = SCX_DSQ_GLOBAL;
-			goto force_dispatch;
-		}
-		return;
-	}
-	
 	/*
 	 * No need for _acquire here. @p is accessed only after a successful
 	 * try_cmpxchg to DISPATCHING.
@@ -1451,20 +3086,15 @@ retry:
 	case SCX_OPSS_DISPATCHING:
 	case SCX_OPSS_NONE:
 		/* someone else already got to it */
-		return;
+		return false;
 	case SCX_OPSS_QUEUED:
 		/*
 		 * If qseq doesn't match, @p has gone through at least one
 		 * dispatch/dequeue and re-enqueue cycle between
 		 * scx_bpf_dispatch() and here and we have no claim on it.
 		 */
-		if ((opss & SCX_OPSS_QSEQ_MASK) != qseq_at_dispatch) {
-			if (high_priority_task && retry_count <= 3) {
-				cpu_relax();
-				goto retry;
-			}
-			return;
-		}
+		if ((opss & SCX_OPSS_QSEQ_MASK) != qseq_at_dispatch)
+			return false;
 
 		/*
 		 * While we know @p is accessible, we don't yet have a claim on
@@ -1480,71 +3110,475 @@ retry:
 	case SCX_OPSS_QUEUEING:
 		/*
 		 * do_enqueue_task() is in the process of transferring the task
-		 * to the BPF scheduler while holding @p's rq lock. As we aren't
-		 * holding any kernel or BPF resource that the enqueue path may
-		 * depend upon, it's safe to wait.
+		 * to the BPF scheduler while holding @p's rq lock. Rather than
+		 * waiting with our rq lock held, try again on the next balance.
+		 * If that's not possible or the retry budget ran out, it's
+		 * safe to wait as we aren't holding any kernel or BPF resource
+		 * that the enqueue path may depend upon.
 		 */
-		if (high_priority_task) {
-			int wait_loops = 0;
-			while ((atomic64_read(&p->scx->ops_state) & SCX_OPSS_STATE_MASK) == SCX_OPSS_QUEUEING && wait_loops++ < 100) {
-				cpu_relax();
-			}
-		} else {
-			wait_ops_state(p, opss);
-		}
+		if (defer_dispatch(p, qseq_at_dispatch, dsq_id, enq_flags,
+				   parked_at))
+			return false;
+		wait_ops_state(p, opss);
 		goto retry;
 	}
 
 	BUG_ON(!(p->scx->flags & SCX_TASK_QUEUED));
+	return true;
+}
+
+/*
+ * Queue a claimed @p on the non-local DSQ @dsq_id, also used when a local
+ * dispatch turned out to be invalid. See scx_policy_fallback_head().
+ */
+static void dispatch_enqueue_fallback(struct task_struct *p, u64 dsq_id,
+				      u64 enq_flags, bool high_prio)
+{
+	struct scx_dispatch_q *dsq;
+
+	dsq = find_dsq_for_dispatch(cpu_rq(raw_smp_processor_id()), dsq_id, p);
+	if (scx_policy_fallback_head(high_prio))
+		enq_flags |= SCX_ENQ_HEAD;
+	dispatch_enqueue(dsq, p, enq_flags | SCX_ENQ_CLEAR_OPSS);
+}
+
+/**
+ * finish_dispatch - Asynchronously finish dispatching a task
+ * @rq: current rq which is locked
+ * @rf: rq_flags to use when unlocking @rq
+ * @p: task to finish dispatching
+ * @qseq_at_dispatch: qseq when @p started getting dispatched
+ * @dsq_id: destination DSQ ID
+ * @enq_flags: %SCX_ENQ_*
+ * @parked_at: see defer_dispatch()
+ *
+ * Dispatching to local DSQs may need to wait for queueing to complete or
+ * require rq lock dancing. As we don't wanna do either while inside
+ * ops.dispatch() to avoid locking order inversion, we split dispatching into
+ * two parts. scx_bpf_dispatch() which is called by ops.dispatch() records the
+ * task and its qseq. Once ops.dispatch() returns, this function is called to
+ * finish up.
+ *
+ * There is no guarantee that @p is still valid for dispatching or even that it
+ * was valid in the first place. Make sure that the task is still owned by the
+ * BPF scheduler and claim the ownership before dispatching.
+ */
+static void finish_dispatch(struct rq *rq, struct rq_flags *rf,
+			    struct task_struct *p, u64 qseq_at_dispatch,
+			    u64 dsq_id, u64 enq_flags, u64 parked_at)
+{
+	u64 dispatch_start_time = 0, start = scx_lat_start();
+	bool high_priority_task = scx_task_high_prio(p);
+
+	touch_core_sched_dispatch(rq, p);
+
+	if (high_priority_task)
+		dispatch_start_time = sched_clock();
+
+	if (!claim_dispatch(p, qseq_at_dispatch, dsq_id, enq_flags, parked_at))
+		goto out;
 
-force_dispatch:
 	switch (dispatch_to_local_dsq(rq, rf, dsq_id, p, enq_flags)) {
 	case DTL_DISPATCHED:
 		if (high_priority_task) {
 			u64 dispatch_latency = sched_clock() - dispatch_start_time;
-			if (dispatch_latency > 50000) {
-				trace_printk("High priority task dispatch latency: %llu ns\n", dispatch_latency);
-			}
+			if (dispatch_latency > 50000)
+				hmbird_trace(HMBIRD_TRACE_HIGH_PRIO_DSP, p, dsq_id,
+					     min_t(u64, dispatch_latency, U32_MAX));
 		}
 		break;
 	case DTL_LOST:
-		if (high_priority_task) {
-			dsq_id = SCX_DSQ_GLOBAL;
-			dsq = find_dsq_for_dispatch(cpu_rq(raw_smp_processor_id()), dsq_id, p);
-			dispatch_enqueue(dsq, p, enq_flags | SCX_ENQ_CLEAR_OPSS | SCX_ENQ_HEAD);
-		}
 		break;
 	case DTL_INVALID:
 		dsq_id = SCX_DSQ_GLOBAL;
 		fallthrough;
 	case DTL_NOT_LOCAL:
-		dsq = find_dsq_for_dispatch(cpu_rq(raw_smp_processor_id()),
-					    dsq_id, p);
-		if (high_priority_task) {
-			dispatch_enqueue(dsq, p, enq_flags | SCX_ENQ_CLEAR_OPSS | SCX_ENQ_HEAD);
+		dispatch_enqueue_fallback(p, dsq_id, enq_flags,
+					  high_priority_task);
+		break;
+	}
+out:
+	scx_lat_end(SCX_LAT_FINISH_DSP, start);
+}
+
+/**
+ * drain_dispatch_retries - Retry the dispatches deferred on this CPU
+ * @rq: current rq which is locked
+ * @rf: rq_flags to use when unlocking @rq
+ *
+ * Called from balance_one(). The retries may be deferred again. Freeing a task
+ * can't be done under the raw rq lock, so the refs which may be the last ones
+ * are dropped after unlocking @rq.
+ */
+static void drain_dispatch_retries(struct rq *rq, struct rq_flags *rf)
+{
+	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
+	struct scx_dsp_retry_ent retries[SCX_DSP_MAX_RETRIES];
+	struct task_struct *last[SCX_DSP_MAX_RETRIES];
+	u32 nr = dspc->nr_retries, nr_last = 0, u;
+
+	if (likely(!nr))
+		return;
+
+	memcpy(retries, dspc->retries, nr * sizeof(retries[0]));
+	dspc->nr_retries = 0;
+
+	for (u = 0; u < nr; u++) {
+		struct scx_dsp_buf_ent *ent = &retries[u].ent;
+
+		finish_dispatch(rq, rf, ent->task, ent->qseq, ent->dsq_id,
+				ent->enq_flags, retries[u].parked_at);
+		if (!refcount_dec_not_one(&ent->task->usage))
+			last[nr_last++] = ent->task;
+	}
+
+	if (likely(!nr_last))
+		return;
+
+	rq_unpin_lock(rq, rf);
+	raw_spin_rq_unlock(rq);
+
+	for (u = 0; u < nr_last; u++)
+		put_task_struct(last[u]);
+
+	raw_spin_rq_lock(rq);
+	rq_repin_lock(rq, rf);
+}
+
+/* drop the deferred dispatches of all CPUs, no task may be on SCX */
+static void clear_dispatch_retries(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct scx_dsp_ctx *dspc = per_cpu_ptr(&scx_dsp_ctx, cpu);
+		u32 u;
+
+		for (u = 0; u < dspc->nr_retries; u++)
+			put_task_struct(dspc->retries[u].ent.task);
+		dspc->nr_retries = 0;
+	}
+}
+
+#ifdef CONFIG_SMP
+/*
+ * Move @nr tasks, which were claimed by flush_dispatch_local_batch() and are
+ * all on @src_rq, to @dst_rq's local DSQ with one round of rq lock dancing. See
+ * dispatch_to_local_dsq() for the single task version.
+ */
+static void dispatch_to_local_dsq_batch(struct rq *rq, struct rq_flags *rf,
+					struct rq *src_rq, struct rq *dst_rq,
+					struct task_struct **tasks,
+					u64 *enq_flags, u32 nr, u64 start)
+{
+	struct rq *locked_dst_rq = dst_rq;
+	bool relock = rq != src_rq || rq != dst_rq;
+	bool resched = false;
+	u32 i;
+
+	if (relock)
+		dispatch_to_local_dsq_lock(rq, rf, src_rq, locked_dst_rq);
+
+	/* see dispatch_to_local_dsq() */
+	if (unlikely(!test_rq_online(dst_rq)))
+		dst_rq = src_rq;
+
+	for (i = 0; i < nr; i++) {
+		struct task_struct *p = tasks[i];
+		bool dsp;
+
+		if (src_rq == dst_rq) {
+			dsp = p->scx->holding_cpu == raw_smp_processor_id();
+			if (likely(dsp)) {
+				p->scx->holding_cpu = -1;
+				dispatch_enqueue(&dst_rq->scx->local_dsq, p,
+						 enq_flags[i]);
+			}
 		} else {
-			dispatch_enqueue(dsq, p, enq_flags | SCX_ENQ_CLEAR_OPSS);
+			dsp = move_task_to_local_dsq(dst_rq, p, enq_flags[i]);
 		}
-		break;
+
+		if (!dsp)
+			continue;
+		if (p->sched_class > dst_rq->curr->sched_class)
+			resched = true;
+		if (start && scx_task_high_prio(p)) {
+			u64 dispatch_latency = sched_clock() - start;
+			if (dispatch_latency > 50000)
+				hmbird_trace(HMBIRD_TRACE_HIGH_PRIO_DSP, p,
+					     SCX_DSQ_LOCAL_ON | cpu_of(dst_rq),
+					     min_t(u64, dispatch_latency, U32_MAX));
+		}
+	}
+
+	/* if the destination CPU is idle, wake it up */
+	if (resched)
+		resched_curr(dst_rq);
+
+	if (relock)
+		dispatch_to_local_dsq_unlock(rq, rf, src_rq, locked_dst_rq);
+}
+
+/*
+ * Dispatch @nr buffered entries which all target the same local DSQ. Tasks are
+ * claimed and handed over through holding_cpu as in dispatch_to_local_dsq(),
+ * then moved in runs which share the source rq.
+ */
+static void flush_dispatch_local_batch(struct rq *rq, struct rq_flags *rf,
+				       struct scx_dsp_buf_ent *ents, u32 nr)
+{
+	struct task_struct *tasks[SCX_DSP_COALESCE_BATCH];
+	u64 enq_flags[SCX_DSP_COALESCE_BATCH];
+	u64 dsq_id = ents[0].dsq_id, start = 0, lat_start;
+	struct rq *src_rq = NULL, *dst_rq = rq, *p_rq;
+	u32 u, n = 0;
+
+	if (dsq_id != SCX_DSQ_LOCAL) {
+		s32 cpu = dsq_id & SCX_DSQ_LOCAL_CPU_MASK;
+
+		/* let finish_dispatch() report and handle it */
+		if (!ops_cpu_valid(cpu)) {
+			for (u = 0; u < nr; u++)
+				finish_dispatch(rq, rf, ents[u].task, ents[u].qseq,
+						dsq_id, ents[u].enq_flags, 0);
+			return;
+		}
+		dst_rq = cpu_rq(cpu);
+	}
+
+	lat_start = scx_lat_start();
+	if (static_branch_unlikely(&scx_ops_prio_heur))
+		start = sched_clock();
+
+	for (u = 0; u < nr; u++) {
+		struct scx_dsp_buf_ent *ent = &ents[u];
+		struct task_struct *p = ent->task;
+
+		touch_core_sched_dispatch(rq, p);
+
+		if (!claim_dispatch(p, ent->qseq, dsq_id, ent->enq_flags, 0))
+			continue;
+
+		if (!cpumask_test_cpu(cpu_of(dst_rq), p->cpus_ptr)) {
+			scx_ops_error("SCX_DSQ_LOCAL[_ON] verdict target cpu %d not allowed for %s[%d]",
+				      cpu_of(dst_rq), p->comm, p->pid);
+			dispatch_enqueue_fallback(p, SCX_DSQ_GLOBAL,
+						  ent->enq_flags,
+						  scx_task_high_prio(p));
+			continue;
+		}
+
+		p_rq = task_rq(p);
+
+		/*
+		 * Release DISPATCHING before flushing the previous run. A
+		 * dequeue of @p may be spinning on it with the rq lock held that
+		 * the flush is about to take. store_release ensures that
+		 * dequeue sees holding_cpu.
+		 */
+		p->scx->holding_cpu = raw_smp_processor_id();
+		atomic64_set_release(&p->scx->ops_state, SCX_OPSS_NONE);
+
+		if (n && (p_rq != src_rq || n == SCX_DSP_COALESCE_BATCH)) {
+			dispatch_to_local_dsq_batch(rq, rf, src_rq, dst_rq,
+						    tasks, enq_flags, n, start);
+			n = 0;
+		}
+
+		src_rq = p_rq;
+		tasks[n] = p;
+		enq_flags[n++] = ent->enq_flags;
+	}
+
+	if (n)
+		dispatch_to_local_dsq_batch(rq, rf, src_rq, dst_rq, tasks,
+					    enq_flags, n, start);
+
+	scx_lat_end_nr(SCX_LAT_FINISH_DSP, lat_start, nr);
+}
+
+/* enqueue claimed tasks, locking each run of the same DSQ once */
+static void dispatch_enqueue_batch(struct scx_dispatch_q **dsqs,
+				   struct task_struct **tasks, u64 *enq_flags,
+				   u32 nr)
+{
+	struct scx_dispatch_q *want = NULL, *dsq = NULL;
+	u32 i;
+
+	for (i = 0; i < nr; i++) {
+		if (dsqs[i] != want) {
+			if (dsq)
+				raw_spin_unlock(&dsq->lock);
+			want = dsqs[i];
+			dsq = dispatch_lock_dsq(want);
+		}
+		__dispatch_enqueue(dsq, tasks[i], enq_flags[i]);
 	}
+
+	if (dsq)
+		raw_spin_unlock(&dsq->lock);
 }
 
+/*
+ * Dispatch @nr buffered entries which all target the same non-local DSQ ID.
+ * %SCX_DSQ_GLOBAL may still resolve to different shards or group DSQs per task,
+ * which dispatch_enqueue_batch() takes care of. Claims are taken before the
+ * DSQ lock is, as a QUEUEING task's enqueue path may need the lock.
+ *
+ * Up to %SCX_DSP_COALESCE_BATCH tasks stay DISPATCHING while the following
+ * claims are taken, which may wait on a QUEUEING task. That's safe as no lock
+ * is taken while waiting and QUEUEING is only held by do_enqueue_task() with
+ * the task's rq lock, which runs ops.enqueue() to completion without waiting
+ * on any ops_state. A dequeue spinning on one of our DISPATCHING tasks holds
+ * a different rq lock which the QUEUEING side doesn't need.
+ */
+static void flush_dispatch_dsq_batch(struct rq *rq, struct scx_dsp_buf_ent *ents,
+				     u32 nr)
+{
+	struct scx_dispatch_q *dsqs[SCX_DSP_COALESCE_BATCH];
+	struct task_struct *tasks[SCX_DSP_COALESCE_BATCH];
+	u64 enq_flags[SCX_DSP_COALESCE_BATCH];
+	u64 lat_start = scx_lat_start();
+	u32 u, n = 0;
+
+	for (u = 0; u < nr; u++) {
+		struct scx_dsp_buf_ent *ent = &ents[u];
+		struct task_struct *p = ent->task;
+
+		touch_core_sched_dispatch(rq, p);
+
+		if (!claim_dispatch(p, ent->qseq, ent->dsq_id, ent->enq_flags, 0))
+			continue;
+
+		dsqs[n] = find_dsq_for_dispatch(rq, ent->dsq_id, p);
+		tasks[n] = p;
+		enq_flags[n] = ent->enq_flags | SCX_ENQ_CLEAR_OPSS;
+		if (scx_policy_fallback_head(scx_task_high_prio(p)))
+			enq_flags[n] |= SCX_ENQ_HEAD;
+
+		if (++n == SCX_DSP_COALESCE_BATCH) {
+			dispatch_enqueue_batch(dsqs, tasks, enq_flags, n);
+			n = 0;
+		}
+	}
+
+	dispatch_enqueue_batch(dsqs, tasks, enq_flags, n);
+
+	scx_lat_end_nr(SCX_LAT_FINISH_DSP, lat_start, nr);
+}
+
+static int scx_dsp_buf_ent_cmp(const void *a, const void *b)
+{
+	const struct scx_dsp_buf_ent *ea = a, *eb = b;
+
+	if (ea->dsq_id != eb->dsq_id)
+		return ea->dsq_id < eb->dsq_id ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : 1;
+}
+
+/*
+ * Enabled by dsp_coalesce_ctrl. Instead of locking the destination of every
+ * buffered dispatch separately, sort the buffer by destination DSQ ID, keeping
+ * the dispatch order for each destination, and lock each destination DSQ or
+ * remote rq once per run of up to %SCX_DSP_COALESCE_BATCH tasks. If the BPF
+ * scheduler dispatched a task more than once, which dispatch wins may differ
+ * from the plain flush. That's already racy and thus fine.
+ */
+static void flush_dispatch_buf_coalesced(struct rq *rq, struct rq_flags *rf,
+					 u32 nr)
+{
+	struct scx_dsp_buf_ent *buf = this_cpu_ptr(scx_dsp_buf);
+	u32 u, end;
+
+	for (u = 0; u < nr; u++)
+		buf[u].seq = u;
+	sort(buf, nr, sizeof(buf[0]), scx_dsp_buf_ent_cmp, NULL);
+
+	for (u = 0; u < nr; u = end) {
+		u64 dsq_id = buf[u].dsq_id;
+
+		for (end = u + 1; end < nr && buf[end].dsq_id == dsq_id; end++)
+			;
+
+		if (dsq_id == SCX_DSQ_LOCAL ||
+		    (dsq_id & SCX_DSQ_LOCAL_ON) == SCX_DSQ_LOCAL_ON)
+			flush_dispatch_local_batch(rq, rf, &buf[u], end - u);
+		else
+			flush_dispatch_dsq_batch(rq, &buf[u], end - u);
+	}
+}
+#else	/* CONFIG_SMP */
+static void flush_dispatch_buf_coalesced(struct rq *rq, struct rq_flags *rf,
+					 u32 nr) {}
+#endif	/* CONFIG_SMP */
+
 static void flush_dispatch_buf(struct rq *rq, struct rq_flags *rf)
 {
 	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
 	u32 u;
 
+	if (IS_ENABLED(CONFIG_SMP) && READ_ONCE(dsp_coalesce_ctrl) &&
+	    dspc->buf_cursor > 1) {
+		flush_dispatch_buf_coalesced(rq, rf, dspc->buf_cursor);
+		goto out;
+	}
+
 	for (u = 0; u < dspc->buf_cursor; u++) {
 		struct scx_dsp_buf_ent *ent = &this_cpu_ptr(scx_dsp_buf)[u];
 
 		finish_dispatch(rq, rf, ent->task, ent->qseq, ent->dsq_id,
-				ent->enq_flags);
+				ent->enq_flags, 0);
 	}
-
+out:
 	dspc->nr_tasks += dspc->buf_cursor;
 	dspc->buf_cursor = 0;
 }
 
+/*
+ * @rq's CPU is isolated, see hmbird_park.c. Move the tasks on its local DSQ
+ * which can run on an unparked CPU to the global DSQ, a batch per balance, and
+ * kick idle unparked CPUs to pick them up.
+ */
+static void scx_push_isolated(struct rq *rq)
+{
+	struct task_struct *batch[SCX_CONSUME_MAX_BATCH];
+	struct scx_rq *scx_rq = rq->scx;
+	struct sched_ext_entity *entity;
+	struct rb_node *rb_node;
+	u32 nr = 0, i;
+
+	list_for_each_entry(entity, &scx_rq->local_dsq.fifo, dsq_node.fifo) {
+		if (nr == SCX_CONSUME_MAX_BATCH)
+			break;
+		if (hmbird_park_keep_off(entity->task, cpu_of(rq)) &&
+		    !is_migration_disabled(entity->task))
+			batch[nr++] = entity->task;
+	}
+
+	for (rb_node = rb_first_cached(&scx_rq->local_dsq.priq);
+	     rb_node && nr < SCX_CONSUME_MAX_BATCH; rb_node = rb_next(rb_node)) {
+		entity = container_of(rb_node, struct sched_ext_entity,
+				      dsq_node.priq);
+		if (hmbird_park_keep_off(entity->task, cpu_of(rq)) &&
+		    !is_migration_disabled(entity->task))
+			batch[nr++] = entity->task;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct task_struct *p = batch[i];
+		s32 cpu;
+
+		dispatch_dequeue(scx_rq, p);
+		dispatch_enqueue(find_task_global_dsq(p, cpu_of(rq)), p, 0);
+
+		if (static_branch_likely(&scx_builtin_idle_enabled)) {
+			cpu = scx_pick_idle_cpu(p->cpus_ptr, cpu_of(rq));
+			if (cpu >= 0)
+				scx_bpf_kick_cpu(cpu, 0);
+		}
+	}
+}
+
 static int balance_one(struct rq *rq, struct task_struct *prev,
 		       struct rq_flags *rf, bool local)
 {
@@ -1552,17 +3586,14 @@ static int balance_one(struct rq *rq, struct task_struct *prev,
 	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
 	bool prev_on_scx = prev->sched_class == &ext_sched_class;
 	int nr_loops = SCX_DSP_MAX_LOOPS;
-	u64 balance_start_time = sched_clock();
-	bool high_load_cpu = false;
-	bool prev_high_priority = false;
+	u64 balance_start_time = scx_lat_start();
+	bool high_load_cpu = scx_rq_overloaded(rq, READ_ONCE(high_load_ratio));
+	bool prev_high_priority = prev_on_scx &&
+		(scx_task_high_prio(prev) || scx_key_boosted(prev));
 
 	lockdep_assert_rq_held(rq);
 
-	if (rq->nr_running > num_online_cpus() * 2)
-		high_load_cpu = true;
-
-	if (prev_on_scx && prev && (prev->prio < DEFAULT_PRIO || prev->policy == SCHED_FIFO || prev->policy == SCHED_RR))
-		prev_high_priority = true;
+	drain_dispatch_retries(rq, rf);
 
 	if (static_branch_unlikely(&scx_ops_cpu_preempt) &&
 	    unlikely(rq->scx->cpu_released)) {
@@ -1599,37 +3630,36 @@ static int balance_one(struct rq *rq, struct task_struct *prev,
 		 */
 		if ((prev->scx->flags & SCX_TASK_QUEUED) &&
 		    prev->scx->slice && !scx_ops_disabling()) {
-			if (local) {
-				if (prev_high_priority || (!high_load_cpu && prev->scx->slice > (SCX_SLICE_DFL >> 2))) {
-					prev->scx->flags |= SCX_TASK_BAL_KEEP;
-					return 1;
-				} else if (high_load_cpu && prev->scx->slice < (SCX_SLICE_DFL >> 3)) {
-					/* Force preemption for low slice tasks on high load CPU */
-				} else {
-					prev->scx->flags |= SCX_TASK_BAL_KEEP;
-					return 1;
-				}
-			} else {
+			u64 full = scx_task_slice_base(prev);
+
+			if (!local)
+				return 1;
+			if (scx_policy_keep_prev(prev->scx->slice, full,
+						 prev_high_priority, high_load_cpu)) {
+				prev->scx->flags |= SCX_TASK_BAL_KEEP;
 				return 1;
 			}
 		}
 	}
 
+	if (unlikely(hmbird_cpu_isolated(cpu_of(rq))) && scx_rq->local_dsq.nr)
+		scx_push_isolated(rq);
+
 	/* if there already are tasks to run, nothing to do */
 	if (scx_rq->local_dsq.nr) {
 		if (high_load_cpu && scx_rq->local_dsq.nr > 4) {
 			/* Try to balance load by consuming from global queue */
-			if (consume_dispatch_q(rq, rf, &scx_dsq_global)) {
+			if (consume_global_dsq(rq, rf)) {
 				/* Successfully got task from global queue */
 			}
 		}
 		return 1;
 	}
 
-	if (consume_dispatch_q(rq, rf, &scx_dsq_global))
+	if (consume_global_dsq(rq, rf))
 		return 1;
 
-	if (!SCX_HAS_OP(dispatch))
+	if (!SCX_HAS_OP(dispatch) || scx_ops_disabling())
 		return 0;
 
 	dspc->rq = rq;
@@ -1643,16 +3673,19 @@ static int balance_one(struct rq *rq, struct task_struct *prev,
 	 * looping behavior to simplify its implementation.
 	 */
 	do {
+		u64 dsp_start = scx_lat_start();
+
 		dspc->nr_tasks = 0;
 
 		SCX_CALL_OP(SCX_KF_DISPATCH, dispatch, cpu_of(rq),
 			    prev_on_scx ? prev : NULL);
+		scx_lat_end(SCX_LAT_DISPATCH, dsp_start);
 
 		flush_dispatch_buf(rq, rf);
 
 		if (scx_rq->local_dsq.nr)
 			return 1;
-		if (consume_dispatch_q(rq, rf, &scx_dsq_global))
+		if (consume_global_dsq(rq, rf))
 			return 1;
 
 		/*
@@ -1665,10 +3698,12 @@ static int balance_one(struct rq *rq, struct task_struct *prev,
 		 * scx_bpf_kick_cpu() for deferred kicking.
 		 */
 		if (unlikely(!--nr_loops)) {
-			u64 balance_duration = sched_clock() - balance_start_time;
-			if (balance_duration > 100000) {
-				trace_printk("Long balance duration: %llu ns on CPU %d\n", balance_duration, cpu_of(rq));
-			}
+			/* only timed while collecting latency histograms */
+			u64 balance_duration = balance_start_time ?
+				sched_clock() - balance_start_time : 0;
+			if (balance_duration > 100000)
+				hmbird_trace(HMBIRD_TRACE_LONG_BALANCE, NULL, 0,
+					     min_t(u64, balance_duration, U32_MAX));
 			scx_bpf_kick_cpu(cpu_of(rq), 0);
 			break;
 		}
@@ -1685,6 +3720,7 @@ static int balance_one(struct rq *rq, struct task_struct *prev,
 static int balance_scx(struct rq *rq, struct task_struct *prev,
 		       struct rq_flags *rf)
 {
+	u64 start = scx_lat_start();
 	int ret;
 
 	ret = balance_one(rq, prev, rf, true);
@@ -1720,24 +3756,26 @@ static int balance_scx(struct rq *rq, struct task_struct *prev,
 		}
 	}
 #endif
+	scx_lat_end(SCX_LAT_BALANCE, start);
 	return ret;
 }
 
 static void set_next_task_scx(struct rq *rq, struct task_struct *p, bool first)
 {
 	u64 now = rq_clock_task(rq);
-	bool high_priority_task = false;
-	bool interactive_task = false;
+	bool high_priority_task = scx_task_high_prio(p);
+	bool key_boosted = scx_key_boosted(p);
+	bool interactive_task = false, can_stop_tick;
+	struct scx_policy_pick pick;
 	u64 wait_time = 0;
 
-	if (p && (p->prio < DEFAULT_PRIO || p->policy == SCHED_FIFO || p->policy == SCHED_RR))
-		high_priority_task = true;
+	if (static_branch_unlikely(&scx_ops_prio_heur)) {
+		if (p->se.exec_start && now > p->se.exec_start)
+			wait_time = now - p->se.exec_start;
 
-	if (p && p->se.exec_start && now > p->se.exec_start)
-		wait_time = now - p->se.exec_start;
-
-	if (p && p->mm && wait_time > 0 && wait_time < 10000000)
-		interactive_task = true;
+		interactive_task = scx_policy_interactive(wait_time, p->mm,
+				(u64)READ_ONCE(interactive_wait_us) * NSEC_PER_USEC);
+	}
 
 	if (p->scx->flags & SCX_TASK_QUEUED) {
 		/*
@@ -1749,50 +3787,66 @@ static void set_next_task_scx(struct rq *rq, struct task_struct *p, bool first)
 	}
 
 	p->se.exec_start = now;
+	scx_update_task_util(p, false);
+	if (static_branch_unlikely(&scx_local_vtime_enabled))
+		local_dsq_vtime_running(rq, p);
+
+	if (scx_ext(p)->runnable_ns) {
+		/*
+		 * @p may have been stamped on another CPU. local_clock() is
+		 * only roughly in sync across CPUs, skip the sample if it went
+		 * backwards.
+		 */
+		u64 stamp = scx_ext(p)->runnable_ns, clk = local_clock();
+
+		if (clk > stamp) {
+			if (static_branch_unlikely(&scx_lat_hist_enabled))
+				scx_lat_record(SCX_LAT_RUNNABLE, clk - stamp);
+			hmbird_park_check_wait(clk - stamp);
+		}
+		scx_ext(p)->runnable_ns = 0;
+	}
 
 	/* see dequeue_task_scx() on why we skip when !QUEUED */
 	if (SCX_HAS_OP(running) && (p->scx->flags & SCX_TASK_QUEUED))
 		SCX_CALL_OP_TASK(SCX_KF_REST, running, p);
 
-	if (high_priority_task && wait_time > 50000000) {
-		trace_printk("High priority task %d waited %llu ns\n", p->pid, wait_time);
-	}
+	if (high_priority_task && wait_time > 50000000)
+		hmbird_trace(HMBIRD_TRACE_HIGH_PRIO_WAIT, p, 0,
+			     min_t(u64, wait_time, U32_MAX));
 
-	if (interactive_task && p->scx->slice < SCX_SLICE_DFL) {
-		p->scx->slice = min_t(u64, p->scx->slice + (SCX_SLICE_DFL >> 2), SCX_SLICE_DFL);
-	}
+	if (key_boosted)
+		scx_stat_inc(SCX_STAT_KEY_BOOST);
 
-	if (high_priority_task && p->scx->slice < (SCX_SLICE_DFL >> 1)) {
-		p->scx->slice = SCX_SLICE_DFL;
-	}
+	pick = (struct scx_policy_pick) {
+		.interactive	= interactive_task,
+		.high_prio	= high_priority_task,
+		.key_boosted	= key_boosted,
+		.overloaded	= scx_rq_overloaded(rq, READ_ONCE(busy_load_ratio)),
+	};
+	p->scx->slice = scx_policy_pick_slice(p->scx->slice, &pick,
+					      SCX_SLICE_DFL, SCX_SLICE_INF);
 
-	//if(p->scx->flags & SCX_TASK_QUEUED)
-	//	scx_update_task_ravg(p, rq, PICK_NEXT_TASK, rq->clock);
+	if (p->scx->flags & SCX_TASK_QUEUED)
+		scx_update_task_ravg(p, rq, PICK_NEXT_TASK);
 
 	watchdog_unwatch_task(p, true);
 
+	scx_shadow_tick_start(rq, p);
+
 	/*
 	 * @p is getting newly scheduled or got kicked after someone updated its
 	 * slice. Refresh whether tick can be stopped. See can_stop_tick_scx().
 	 */
-	if ((p->scx->slice == SCX_SLICE_INF) !=
-	    (bool)(rq->scx->flags & SCX_RQ_CAN_STOP_TICK)) {
-		if (p->scx->slice == SCX_SLICE_INF) {
+	can_stop_tick = p->scx->slice == SCX_SLICE_INF;
+	if (can_stop_tick != (bool)(rq->scx->flags & SCX_RQ_CAN_STOP_TICK)) {
+		if (can_stop_tick)
 			rq->scx->flags |= SCX_RQ_CAN_STOP_TICK;
-			if (high_priority_task) {
-				/* High priority tasks with infinite slice get special handling */
-				sched_update_tick_dependency(rq);
-			}
-		} else {
+		else
 			rq->scx->flags &= ~SCX_RQ_CAN_STOP_TICK;
-		}
 
 		sched_update_tick_dependency(rq);
 	}
-
-	if (rq->nr_running > num_online_cpus() && !high_priority_task && p->scx->slice > (SCX_SLICE_DFL >> 1)) {
-		p->scx->slice = p->scx->slice >> 1;
-	}
 }
 
 static void put_prev_task_scx(struct rq *rq, struct task_struct *p)
@@ -1829,13 +3883,16 @@ static void put_prev_task_scx(struct rq *rq, struct task_struct *p)
 #endif
 
 	update_curr_scx(rq);
+	scx_group_flush(rq);
+	scx_update_task_util(p, true);
+	scx_shadow_tick_stop(rq);
 
 	/* see dequeue_task_scx() on why we skip when !QUEUED */
 	if (SCX_HAS_OP(stopping) && (p->scx->flags & SCX_TASK_QUEUED))
 		SCX_CALL_OP_TASK(SCX_KF_REST, stopping, p, true);
 
-	//if(p->scx->flags & SCX_TASK_QUEUED)
-	//	scx_update_task_ravg(p, rq, PUT_PREV_TASK, rq->clock);
+	if (p->scx->flags & SCX_TASK_QUEUED)
+		scx_update_task_ravg(p, rq, PUT_PREV_TASK);
 
 
 	/*
@@ -1872,7 +3929,7 @@ static void put_prev_task_scx(struct rq *rq, struct task_struct *p)
 		 * can find the task unless it wants to trigger a separate
 		 * follow-up scheduling event.
 		 */
-		if (list_empty(&rq->scx->local_dsq.fifo))
+		if (!rq->scx->local_dsq.nr)
 			do_enqueue_task(rq, p, SCX_ENQ_LAST | SCX_ENQ_LOCAL, -1);
 		else
 			do_enqueue_task(rq, p, 0, -1);
@@ -1918,7 +3975,7 @@ static struct task_struct *pick_next_task_scx(struct rq *rq)
 					p->comm, p->pid);
 			scx_warned_zero_slice = true;
 		}
-		p->scx->slice = SCX_SLICE_DFL;
+		p->scx->slice = scx_task_slice(rq, p);
 	}
 
 	set_next_task_scx(rq, p, true);
@@ -2058,44 +4115,203 @@ void __scx_notify_pick_next_task(struct rq *rq, struct task_struct *task,
 
 #ifdef CONFIG_SMP
 
+static struct scx_idle_cluster *scx_idle_cluster_of(s32 cpu)
+{
+	return &scx_idle_clusters[scx_cpu_cluster_id(cpu)];
+}
+
+/*
+ * The summary bit of a cluster is set after setting a CPU's idle bit and
+ * cleared before re-testing the cluster's idle mask. With the barriers in
+ * between, either the setter sees the cleared summary bit or the clearer sees
+ * the new idle CPU, and no idle CPU gets hidden behind a clear summary bit.
+ */
+static void scx_idle_summary_set(int cl)
+{
+	smp_mb__after_atomic();
+	if (!test_bit(cl, &scx_idle_summary))
+		set_bit(cl, &scx_idle_summary);
+}
+
+static void scx_idle_summary_clear(int cl)
+{
+	if (!test_bit(cl, &scx_idle_summary))
+		return;
+
+	clear_bit(cl, &scx_idle_summary);
+	smp_mb__after_atomic();
+	if (!cpumask_empty(&scx_idle_clusters[cl].cpu))
+		set_bit(cl, &scx_idle_summary);
+}
+
 static bool test_and_clear_cpu_idle(int cpu)
 {
-	if (cpumask_test_and_clear_cpu(cpu, idle_masks.cpu)) {
-		if (cpumask_empty(idle_masks.cpu))
-			scx_has_idle_cpus = false;
-		return true;
-	} else {
+	int cl = scx_cpu_cluster_id(cpu);
+	struct scx_idle_cluster *ic = &scx_idle_clusters[cl];
+
+	/* test first so that claim attempts on busy CPUs stay read-only */
+	if (!cpumask_test_cpu(cpu, &ic->cpu) ||
+	    !cpumask_test_and_clear_cpu(cpu, &ic->cpu))
 		return false;
-	}
+
+	if (cpumask_empty(&ic->cpu))
+		scx_idle_summary_clear(cl);
+	return true;
 }
 
-static s32 scx_pick_idle_cpu(const struct cpumask *cpus_allowed)
+/*
+ * Claim an idle CPU of cluster @cl which is in @cpus_allowed. If @core, only
+ * CPUs whose whole physical core is idle are considered. Each candidate is
+ * tried once, starting from @start and wrapping around, so that concurrent
+ * pickers starting from different CPUs spread out instead of fighting over the
+ * same bit.
+ */
+static s32 scx_idle_claim(int cl, const struct cpumask *cpus_allowed,
+			  s32 start, bool core)
 {
-	int cpu;
+	struct scx_idle_cluster *ic = &scx_idle_clusters[cl];
+	s32 cpu;
 
-	do {
-		cpu = cpumask_any_and_distribute(idle_masks.smt, cpus_allowed);
-		if (cpu < nr_cpu_ids) {
+	for_each_cpu_wrap(cpu, core ? &ic->smt : &ic->cpu, start) {
+		if (!cpumask_test_cpu(cpu, cpus_allowed) || hmbird_cpu_parked(cpu))
+			continue;
+
+		if (core) {
 			const struct cpumask *sbm = topology_sibling_cpumask(cpu);
 
 			/*
-			 * If offline, @cpu is not its own sibling and we can
-			 * get caught in an infinite loop as @cpu is never
-			 * cleared from idle_masks.smt. Clear @cpu directly in
-			 * such cases.
+			 * If offline, @cpu is not its own sibling and would
+			 * never be cleared from the smt mask. Clear @cpu
+			 * directly in such cases.
 			 */
 			if (likely(cpumask_test_cpu(cpu, sbm)))
-				cpumask_andnot(idle_masks.smt, idle_masks.smt, sbm);
+				cpumask_andnot(&ic->smt, &ic->smt, sbm);
 			else
-				cpumask_andnot(idle_masks.smt, idle_masks.smt, cpumask_of(cpu));
-		} else {
-			cpu = cpumask_any_and_distribute(idle_masks.cpu, cpus_allowed);
-			if (cpu >= nr_cpu_ids)
-				return -EBUSY;
+				cpumask_clear_cpu(cpu, &ic->smt);
 		}
-	} while (!test_and_clear_cpu_idle(cpu));
 
-	return cpu;
+		if (test_and_clear_cpu_idle(cpu))
+			return cpu;
+	}
+
+	return -EBUSY;
+}
+
+/**
+ * scx_pick_idle_cpu_from - Pick and claim an idle CPU starting from a cluster
+ * @cpus_allowed: allowed cpumask
+ * @near_cpu: CPU to search around within each cluster
+ * @first: cluster to look in first
+ * @skip: bitmask of clusters to ignore
+ *
+ * Look in @first and then in the other clusters in scx_cluster_steal[] order,
+ * skipping clusters without idle CPUs according to scx_idle_summary. Whole idle
+ * cores are preferred over idle SMT siblings.
+ */
+static s32 scx_pick_idle_cpu_from(const struct cpumask *cpus_allowed,
+				  s32 near_cpu, int first, unsigned long skip)
+{
+	unsigned long summary = READ_ONCE(scx_idle_summary) & ~skip &
+				~hmbird_parked_clusters();
+	int order[SCX_MAX_CLUSTERS], nr = 0, i, pass;
+	s32 cpu;
+
+	if (!summary)
+		return -EBUSY;
+
+	order[nr++] = first;
+	for (i = 0; i < scx_nr_clusters - 1; i++)
+		order[nr++] = scx_cluster_steal[first][i];
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nr; i++) {
+			if (!test_bit(order[i], &summary))
+				continue;
+			cpu = scx_idle_claim(order[i], cpus_allowed, near_cpu,
+					     pass == 0);
+			if (cpu >= 0)
+				return cpu;
+		}
+	}
+
+	return -EBUSY;
+}
+
+static s32 scx_pick_idle_cpu(const struct cpumask *cpus_allowed, s32 near_cpu)
+{
+	return scx_pick_idle_cpu_from(cpus_allowed, near_cpu,
+				      scx_cpu_cluster_id(near_cpu), 0);
+}
+
+/*
+ * Find the cluster @p should preferably run in. @p stays in @prev_cpu's
+ * cluster unless its utilization exceeds misfit_ds% of the cluster's capacity,
+ * in which case it's upmigrated to the smallest cluster it fits in or the
+ * biggest one if none. The prime cluster is only for tasks whose utilization
+ * exceeds cpu7_tl% of its capacity and is added to @skip otherwise.
+ */
+static int scx_fit_cluster(struct task_struct *p, s32 prev_cpu,
+			   unsigned long *skip)
+{
+	return scx_policy_fit_cluster(scx_task_util(p),
+				      scx_cpu_cluster_id(prev_cpu),
+				      scx_cluster_cap, scx_nr_clusters,
+				      scx_prime_cluster, READ_ONCE(misfit_ds),
+				      READ_ONCE(cpu7_tl), skip);
+}
+
+/*
+ * Capacity aware variant of scx_select_cpu_dfl() for asymmetric systems,
+ * enabled by cap_select_ctrl. Idle CPUs in the cluster picked by
+ * scx_fit_cluster() are preferred, then the nearest clusters. If nothing is
+ * idle, misfit tasks are still moved to a busy CPU of the fitting cluster.
+ */
+static s32 scx_select_cpu_cap(struct task_struct *p, s32 prev_cpu,
+			      u64 wake_flags)
+{
+	unsigned long skip = 0;
+	int target;
+	s32 cpu;
+
+	if (p->nr_cpus_allowed == 1) {
+		if (test_and_clear_cpu_idle(prev_cpu))
+			p->scx->flags |= SCX_TASK_ENQ_LOCAL;
+		return prev_cpu;
+	}
+
+	target = scx_key_boosted(p) ? scx_key_cluster :
+				      scx_fit_cluster(p, prev_cpu, &skip);
+
+	if ((wake_flags & SCX_WAKE_SYNC) && READ_ONCE(scx_idle_summary) &&
+	    !(current->flags & PF_EXITING)) {
+		cpu = smp_processor_id();
+		if (scx_cpu_cluster_id(cpu) == target &&
+		    cpumask_test_cpu(cpu, p->cpus_ptr)) {
+			p->scx->flags |= SCX_TASK_ENQ_LOCAL;
+			return cpu;
+		}
+	}
+
+	if (scx_cpu_cluster_id(prev_cpu) == target &&
+	    test_and_clear_cpu_idle(prev_cpu)) {
+		p->scx->flags |= SCX_TASK_ENQ_LOCAL;
+		return prev_cpu;
+	}
+
+	cpu = scx_pick_idle_cpu_from(p->cpus_ptr, prev_cpu, target, skip);
+	if (cpu >= 0) {
+		p->scx->flags |= SCX_TASK_ENQ_LOCAL;
+		return cpu;
+	}
+
+	if (target != scx_cpu_cluster_id(prev_cpu)) {
+		cpu = cpumask_any_and_distribute(&scx_cluster_cpus[target],
+						 p->cpus_ptr);
+		if (cpu < nr_cpu_ids)
+			return cpu;
+	}
+
+	return prev_cpu;
 }
 
 static s32 scx_select_cpu_dfl(struct task_struct *p, s32 prev_cpu, u64 wake_flags)
@@ -2107,12 +4323,25 @@ static s32 scx_select_cpu_dfl(struct task_struct *p, s32 prev_cpu, u64 wake_flag
 		return prev_cpu;
 	}
 
+	if (static_branch_unlikely(&scx_cap_select))
+		return scx_select_cpu_cap(p, prev_cpu, wake_flags);
+
+	/* while frames are in flight, key tasks go to the key cluster first */
+	if (scx_key_boosted(p) && p->nr_cpus_allowed > 1) {
+		cpu = scx_pick_idle_cpu_from(p->cpus_ptr, prev_cpu,
+					     scx_key_cluster, 0);
+		if (cpu >= 0) {
+			p->scx->flags |= SCX_TASK_ENQ_LOCAL;
+			return cpu;
+		}
+	}
+
 	/*
 	 * If WAKE_SYNC and the machine isn't fully saturated, wake up @p to the
 	 * local DSQ of the waker.
 	 */
 	if ((wake_flags & SCX_WAKE_SYNC) && p->nr_cpus_allowed > 1 &&
-	    scx_has_idle_cpus && !(current->flags & PF_EXITING)) {
+	    READ_ONCE(scx_idle_summary) && !(current->flags & PF_EXITING)) {
 		cpu = smp_processor_id();
 		if (cpumask_test_cpu(cpu, p->cpus_ptr)) {
 			p->scx->flags |= SCX_TASK_ENQ_LOCAL;
@@ -2129,7 +4358,7 @@ static s32 scx_select_cpu_dfl(struct task_struct *p, s32 prev_cpu, u64 wake_flag
 	if (p->nr_cpus_allowed == 1)
 		return prev_cpu;
 
-	cpu = scx_pick_idle_cpu(p->cpus_ptr);
+	cpu = scx_pick_idle_cpu(p->cpus_ptr, prev_cpu);
 	if (cpu >= 0) {
 		p->scx->flags |= SCX_TASK_ENQ_LOCAL;
 		return cpu;
@@ -2140,20 +4369,34 @@ static s32 scx_select_cpu_dfl(struct task_struct *p, s32 prev_cpu, u64 wake_flag
 
 static int select_task_rq_scx(struct task_struct *p, int prev_cpu, int wake_flags)
 {
-	if (SCX_HAS_OP(select_cpu)) {
-		s32 cpu;
+	u64 start = scx_lat_start();
+	s32 cpu;
 
+	if (unlikely(scx_ops_disabling())) {
+		/* bypassing, see scx_ops_bypass() */
+		if (static_branch_likely(&scx_builtin_idle_enabled))
+			cpu = scx_select_cpu_dfl(p, prev_cpu, wake_flags);
+		else
+			cpu = prev_cpu;
+	} else if (SCX_HAS_OP(select_cpu)) {
 		cpu = SCX_CALL_OP_TASK_RET(SCX_KF_REST, select_cpu, p, prev_cpu,
 					   wake_flags);
-		if (ops_cpu_valid(cpu)) {
-			return cpu;
-		} else {
+		if (!ops_cpu_valid(cpu)) {
 			scx_ops_error("select_cpu returned invalid cpu %d", cpu);
-			return prev_cpu;
+			cpu = prev_cpu;
 		}
 	} else {
-		return scx_select_cpu_dfl(p, prev_cpu, wake_flags);
+		cpu = scx_select_cpu_dfl(p, prev_cpu, wake_flags);
+
+		if (p->scx->flags & SCX_TASK_ENQ_LOCAL)
+			scx_stat_inc(SCX_STAT_SELECT_HIT);
+		else
+			scx_stat_inc(SCX_STAT_SELECT_MISS);
 	}
+
+	scx_lat_end(SCX_LAT_SELECT, start);
+	hmbird_trace(HMBIRD_TRACE_SELECT_CPU, p, 0, cpu);
+	return cpu;
 }
 
 static void set_cpus_allowed_scx(struct task_struct *p, struct affinity_context *ctx)
@@ -2175,16 +4418,23 @@ static void set_cpus_allowed_scx(struct task_struct *p, struct affinity_context
 
 static void reset_idle_masks(void)
 {
+	int cl;
+
 	/* consider all cpus idle, should converge to the actual state quickly */
-	cpumask_setall(idle_masks.cpu);
-	cpumask_setall(idle_masks.smt);
-	scx_has_idle_cpus = true;
+	for (cl = 0; cl < SCX_MAX_CLUSTERS; cl++) {
+		cpumask_copy(&scx_idle_clusters[cl].cpu, &scx_cluster_cpus[cl]);
+		cpumask_copy(&scx_idle_clusters[cl].smt, &scx_cluster_cpus[cl]);
+	}
+	WRITE_ONCE(scx_idle_summary, (1UL << scx_nr_clusters) - 1);
 }
 
 void __scx_update_idle(struct rq *rq, bool idle)
 {
 	int cpu = cpu_of(rq);
+	int cl = scx_cpu_cluster_id(cpu);
+	struct scx_idle_cluster *ic = &scx_idle_clusters[cl];
 	struct cpumask *sib_mask = topology_sibling_cpumask(cpu);
+	int sib;
 
 	if (SCX_HAS_OP(update_idle)) {
 		SCX_CALL_OP(SCX_KF_REST, update_idle, cpu_of(rq), idle);
@@ -2193,33 +4443,71 @@ void __scx_update_idle(struct rq *rq, bool idle)
 	}
 
 	if (idle) {
-		cpumask_set_cpu(cpu, idle_masks.cpu);
-		if (!scx_has_idle_cpus)
-			scx_has_idle_cpus = true;
+		cpumask_set_cpu(cpu, &ic->cpu);
+		scx_idle_summary_set(cl);
 
 		/*
-		 * idle_masks.smt handling is racy but that's fine as it's only
+		 * The smt mask handling is racy but that's fine as it's only
 		 * for optimization and self-correcting.
 		 */
-		for_each_cpu(cpu, sib_mask) {
-			if (!cpumask_test_cpu(cpu, idle_masks.cpu))
+		for_each_cpu(sib, sib_mask) {
+			if (!cpumask_test_cpu(sib, &scx_idle_cluster_of(sib)->cpu))
 				return;
 		}
-		cpumask_or(idle_masks.smt, idle_masks.smt, sib_mask);
+		for_each_cpu(sib, sib_mask)
+			cpumask_set_cpu(sib, &scx_idle_cluster_of(sib)->smt);
 	} else {
-		cpumask_clear_cpu(cpu, idle_masks.cpu);
-		if (scx_has_idle_cpus && cpumask_empty(idle_masks.cpu))
-			scx_has_idle_cpus = false;
+		cpumask_clear_cpu(cpu, &ic->cpu);
+		if (cpumask_empty(&ic->cpu))
+			scx_idle_summary_clear(cl);
 
-		cpumask_andnot(idle_masks.smt, idle_masks.smt, sib_mask);
+		for_each_cpu(sib, sib_mask)
+			cpumask_clear_cpu(sib, &scx_idle_cluster_of(sib)->smt);
 	}
 }
 
+/*
+ * Assemble the idle masks of all clusters into a free per-CPU snapshot slot.
+ * BPF programs run with migration disabled, so the slot stays ours until it's
+ * released with scx_idle_snapshot_put(). If all the slots are taken by nested
+ * acquisitions, the empty mask is returned.
+ */
+static const struct cpumask *scx_idle_snapshot(bool smt)
+{
+	struct scx_idle_snaps *snaps = raw_cpu_ptr(&scx_idle_snaps);
+	struct cpumask *snap;
+	int cl, slot;
+
+	for (slot = 0; slot < SCX_IDLE_SNAP_SLOTS; slot++)
+		if (!test_and_set_bit(slot, &snaps->busy))
+			break;
+	if (slot == SCX_IDLE_SNAP_SLOTS)
+		return cpu_none_mask;
+
+	snap = &snaps->mask[slot];
+	cpumask_clear(snap);
+	for (cl = 0; cl < scx_nr_clusters; cl++)
+		cpumask_or(snap, snap, smt ? &scx_idle_clusters[cl].smt :
+					     &scx_idle_clusters[cl].cpu);
+	if (static_branch_unlikely(&hmbird_park_enabled))
+		cpumask_andnot(snap, snap, &hmbird_parked_cpus);
+	return snap;
+}
+
+static void scx_idle_snapshot_put(const struct cpumask *mask)
+{
+	struct scx_idle_snaps *snaps = raw_cpu_ptr(&scx_idle_snaps);
+
+	if (mask >= &snaps->mask[0] && mask < &snaps->mask[SCX_IDLE_SNAP_SLOTS])
+		clear_bit(mask - snaps->mask, &snaps->busy);
+}
+
 #else /* !CONFIG_SMP */
 
 static bool test_and_clear_cpu_idle(int cpu) { return false; }
-static s32 scx_pick_idle_cpu(const struct cpumask *cpus_allowed) { return -EBUSY; }
+static s32 scx_pick_idle_cpu(const struct cpumask *cpus_allowed, s32 near_cpu) { return -EBUSY; }
 static void reset_idle_masks(void) {}
+static void scx_idle_snapshot_put(const struct cpumask *mask) {}
 
 #endif /* CONFIG_SMP */
 
@@ -2231,7 +4519,11 @@ static bool check_rq_for_timeouts(struct rq *rq)
 	bool timed_out = false;
 
 	rq_lock_irqsave(rq, &rf);
-	list_for_each_entry(entity, &rq->scx->watchdog_list, watchdog_node) {
+
+	/* watchdog_list is sorted, only the oldest task can have timed out */
+	entity = list_first_entry_or_null(&rq->scx->watchdog_list,
+					  struct sched_ext_entity, watchdog_node);
+	if (entity) {
 		unsigned long last_runnable;
 
 		p = entity->task;
@@ -2241,12 +4533,12 @@ static bool check_rq_for_timeouts(struct rq *rq)
 					last_runnable + scx_watchdog_timeout))) {
 			u32 dur_ms = jiffies_to_msecs(jiffies - last_runnable);
 
+			scx_stat_inc_cpu(cpu_of(rq), SCX_STAT_TIMEOUT);
 			scx_ops_error_type(SCX_EXIT_ERROR_STALL,
 					   "%s[%d] failed to run for %u.%03us",
 					   p->comm, p->pid,
 					   dur_ms / 1000, dur_ms % 1000);
 			timed_out = true;
-			break;
 		}
 	}
 	rq_unlock_irqrestore(rq, &rf);
@@ -2254,6 +4546,31 @@ static bool check_rq_for_timeouts(struct rq *rq)
 	return timed_out;
 }
 
+/*
+ * Lockless test of watchdog_list's head. Returns %true if @cpu's rq needs to
+ * be checked under its lock. Tasks found waiting for over half the timeout
+ * are counted as near misses, once each. The head is only known by its
+ * runnable_at, so tasks which became runnable in the same jiffy count once.
+ */
+static bool watchdog_head_stale(int cpu)
+{
+	struct scx_watchdog_head *wh = per_cpu_ptr(&scx_watchdog_head, cpu);
+	unsigned long runnable_at = READ_ONCE(wh->runnable_at);
+
+	if (!READ_ONCE(wh->busy))
+		return false;
+
+	if (time_after(jiffies, runnable_at + scx_watchdog_timeout))
+		return true;
+
+	if (time_after(jiffies, runnable_at + scx_watchdog_timeout / 2) &&
+	    wh->near_at != runnable_at) {
+		wh->near_at = runnable_at;
+		scx_stat_inc_cpu(cpu, SCX_STAT_NEAR_TIMEOUT);
+	}
+	return false;
+}
+
 static void scx_watchdog_workfn(struct work_struct *work)
 {
 	int cpu;
@@ -2261,6 +4578,8 @@ static void scx_watchdog_workfn(struct work_struct *work)
 	scx_watchdog_timestamp = jiffies;
 
 	for_each_online_cpu(cpu) {
+		if (!watchdog_head_stale(cpu))
+			continue;
 		if (unlikely(check_rq_for_timeouts(cpu_rq(cpu))))
 			break;
 
@@ -2273,7 +4592,8 @@ static void scx_watchdog_workfn(struct work_struct *work)
 static void task_tick_scx(struct rq *rq, struct task_struct *curr, int queued)
 {
 	update_curr_scx(rq);
-	//scx_update_task_ravg(curr, rq, TASK_UPDATE, rq->clock);
+	scx_group_flush(rq);
+	scx_update_task_ravg(curr, rq, TASK_UPDATE);
 	/*
 	 * While disabling, always resched and refresh core-sched timestamp as
 	 * we can't trust the slice management or ops.core_sched_before().
@@ -2396,11 +4716,30 @@ static void refresh_scx_weight(struct task_struct *p)
 
 void scx_pre_fork(struct task_struct *p)
 {
-	p->scx = kmalloc(sizeof(struct sched_ext_entity), GFP_KERNEL);
-	if (!p->scx) {
+	struct scx_entity_ext *ext;
+
+	ext = kmem_cache_alloc(scx_entity_cachep, GFP_KERNEL);
+	if (!ext) {
+		p->scx = NULL;
 		goto lock;
 	}
 
+	ext->bucket = NULL;
+	ext->dsq_seq = 0;
+	ext->util_stamp = 0;
+	ext->util = 0;
+	memset(&ext->ravg, 0, sizeof(ext->ravg));
+	ext->runnable_ns = 0;
+	ext->run_sum = 0;
+	ext->avg_run = 0;
+	ext->woken_at = 0;
+	ext->avg_wake_gap = 0;
+	ext->local_vtime = 0;
+	ext->local_vtime_cpu = -1;
+	ext->tasks_shard = 0;
+	ext->key = false;
+	p->scx = &ext->scx;
+
 	p->scx->dsq = NULL;
 	INIT_LIST_HEAD(&p->scx->dsq_node.fifo);
 	RB_CLEAR_NODE(&p->scx->dsq_node.priq);
@@ -2438,6 +4777,9 @@ int scx_fork(struct task_struct *p)
 
 void scx_post_fork(struct task_struct *p)
 {
+	struct scx_tasks_shard *shard;
+	int cpu;
+
 	if (scx_enabled()) {
 		struct rq_flags rf;
 		struct rq *rq;
@@ -2456,9 +4798,13 @@ void scx_post_fork(struct task_struct *p)
 		task_rq_unlock(rq, p, &rf);
 	}
 
-	spin_lock_irq(&scx_tasks_lock);
-	list_add_tail(&p->scx->tasks_node, &scx_tasks);
-	spin_unlock_irq(&scx_tasks_lock);
+	/* any shard works, the local one is most likely cache hot */
+	cpu = raw_smp_processor_id();
+	shard = per_cpu_ptr(&scx_tasks_shards, cpu);
+	spin_lock_irq(&shard->lock);
+	scx_ext(p)->tasks_shard = cpu;
+	list_add_tail(&p->scx->tasks_node, &shard->tasks);
+	spin_unlock_irq(&shard->lock);
 
 	percpu_up_read(&scx_fork_rwsem);
 }
@@ -2472,11 +4818,15 @@ void scx_cancel_fork(struct task_struct *p)
 
 void sched_ext_free(struct task_struct *p)
 {
+	struct scx_tasks_shard *shard =
+		per_cpu_ptr(&scx_tasks_shards, scx_ext(p)->tasks_shard);
 	unsigned long flags;
 
-	spin_lock_irqsave(&scx_tasks_lock, flags);
+	spin_lock_irqsave(&shard->lock, flags);
 	list_del_init(&p->scx->tasks_node);
-	spin_unlock_irqrestore(&scx_tasks_lock, flags);
+	spin_unlock_irqrestore(&shard->lock, flags);
+
+	scx_set_key_task(p, false);
 
 	/*
 	 * @p is off scx_tasks and wholly ours. scx_ops_enable()'s PREPPED ->
@@ -2577,55 +4927,349 @@ DEFINE_SCHED_CLASS(ext) = {
 	.switched_to		= switched_to_scx,
 	.prio_changed		= prio_changed_scx,
 
-	.update_curr		= update_curr_scx,
+	.update_curr		= update_curr_scx,
+
+#ifdef CONFIG_UCLAMP_TASK
+	.uclamp_enabled		= 0,
+#endif
+};
+
+static void init_dsq(struct scx_dispatch_q *dsq, u64 dsq_id)
+{
+	memset(dsq, 0, sizeof(*dsq));
+
+	raw_spin_lock_init(&dsq->lock);
+	INIT_LIST_HEAD(&dsq->fifo);
+	dsq->id = dsq_id;
+}
+
+static struct scx_dsq_index *alloc_dsq_index(int node)
+{
+	u32 nr_buckets = SCX_DSQ_IDX_PINNED + nr_cpu_ids + 1;
+	struct scx_dsq_index *idx;
+	u32 i;
+
+	idx = kzalloc_node(struct_size(idx, buckets, nr_buckets), GFP_KERNEL,
+			   node);
+	if (!idx)
+		return NULL;
+
+	idx->tail_seq = 1;
+	idx->nr_buckets = nr_buckets;
+	for (i = 0; i < nr_buckets; i++) {
+		INIT_LIST_HEAD(&idx->buckets[i].fifo);
+		idx->buckets[i].priq = RB_ROOT_CACHED;
+	}
+	return idx;
+}
+
+static struct scx_dispatch_q *create_dsq(u64 dsq_id, int node)
+{
+	struct scx_dsq_ext *ext;
+	int ret;
+
+	if (dsq_id & SCX_DSQ_FLAG_BUILTIN)
+		return ERR_PTR(-EINVAL);
+
+	ext = kmalloc_node(sizeof(*ext), GFP_KERNEL, node);
+	if (!ext)
+		return ERR_PTR(-ENOMEM);
+
+	init_dsq(&ext->dsq, dsq_id);
+
+	ext->idx = NULL;
+	if (static_branch_unlikely(&scx_dsq_indexed)) {
+		ext->idx = alloc_dsq_index(node);
+		if (!ext->idx) {
+			kfree(ext);
+			return ERR_PTR(-ENOMEM);
+		}
+	}
+
+	ret = rhashtable_insert_fast(&dsq_hash, &ext->dsq.hash_node,
+				     dsq_hash_params);
+	if (ret) {
+		kfree(ext->idx);
+		kfree(ext);
+		return ERR_PTR(ret);
+	}
+	return &ext->dsq;
+}
+
+static void free_dsq_irq_workfn(struct irq_work *irq_work)
+{
+	struct llist_node *to_free = llist_del_all(&dsqs_to_free);
+	struct scx_dispatch_q *dsq, *tmp_dsq;
+
+	llist_for_each_entry_safe(dsq, tmp_dsq, to_free, free_node) {
+		struct scx_dsq_ext *ext = container_of(dsq, struct scx_dsq_ext, dsq);
+
+		if (ext->idx)
+			kfree_rcu(ext->idx, rcu);
+		kfree_rcu(dsq, rcu);
+	}
+}
+
+static DEFINE_IRQ_WORK(free_dsq_irq_work, free_dsq_irq_workfn);
+
+static void destroy_dsq(u64 dsq_id)
+{
+	struct scx_dispatch_q *dsq;
+	unsigned long flags;
+
+	rcu_read_lock();
+
+	dsq = rhashtable_lookup_fast(&dsq_hash, &dsq_id, dsq_hash_params);
+	if (!dsq)
+		goto out_unlock_rcu;
+
+	raw_spin_lock_irqsave(&dsq->lock, flags);
+
+	if (dsq->nr) {
+		scx_ops_error("attempting to destroy in-use dsq 0x%016llx (nr=%u)",
+			      dsq->id, dsq->nr);
+		goto out_unlock_dsq;
+	}
+
+	if (rhashtable_remove_fast(&dsq_hash, &dsq->hash_node, dsq_hash_params))
+		goto out_unlock_dsq;
+
+	/*
+	 * Mark dead by invalidating ->id to prevent dispatch_enqueue() from
+	 * queueing more tasks. As this function can be called from anywhere,
+	 * freeing is bounced through an irq work to avoid nesting RCU
+	 * operations inside scheduler locks.
+	 */
+	dsq->id = SCX_DSQ_INVALID;
+	llist_add(&dsq->free_node, &dsqs_to_free);
+	irq_work_queue(&free_dsq_irq_work);
+
+out_unlock_dsq:
+	raw_spin_unlock_irqrestore(&dsq->lock, flags);
+out_unlock_rcu:
+	rcu_read_unlock();
+}
+
+#ifdef CONFIG_EXT_GROUP_SCHED
+/*
+ * cgroup support. Each task_group gets a scx_group when it comes online,
+ * whether SCX is enabled or not, so that the hierarchy and the cpu.weight
+ * values are known when group DSQs get enabled. cpu.max is read straight from
+ * the task_group's CFS bandwidth settings.
+ */
+
+/*
+ * Split each parent's share between its children and its own tasks, which
+ * compete as a child of the default weight, like CFS does. This uses the
+ * configured weights whether the siblings are active or not, the vtime floor
+ * in find_group_dsq() keeps idle groups from banking their share.
+ */
+static void scx_group_update_hweights(void)
+{
+	struct scx_group *g;
+
+	lockdep_assert_held(&scx_group_mutex);
+
+	list_for_each_entry(g, &scx_group_list, node)
+		g->child_sum = CGROUP_WEIGHT_DFL;
+	list_for_each_entry(g, &scx_group_list, node)
+		if (g->parent)
+			g->parent->child_sum += g->weight;
+
+	list_for_each_entry(g, &scx_group_list, node) {
+		u64 hw = SCX_GROUP_HW_ONE;
+
+		if (g->parent)
+			hw = div_u64((u64)g->parent->hweight * g->weight,
+				     g->parent->child_sum);
+		hw = max_t(u64, hw, 1);
+		WRITE_ONCE(g->hweight, hw);
+		WRITE_ONCE(g->qweight,
+			   max_t(u64, div_u64(hw * CGROUP_WEIGHT_DFL, g->child_sum), 1));
+	}
+}
+
+static enum hrtimer_restart scx_group_unthrottle_timerfn(struct hrtimer *timer)
+{
+	struct scx_group *g = container_of(timer, struct scx_group,
+					   unthrottle_timer);
+	s64 remaining = READ_ONCE(g->period_end) - sched_clock();
+	int cpu;
+
+	/* the period is in sched_clock(), which may drift from the hrtimer's */
+	if (remaining > 0) {
+		hrtimer_forward_now(timer, ns_to_ktime(remaining));
+		return HRTIMER_RESTART;
+	}
+
+	WRITE_ONCE(g->throttled, false);
+
+	/* busy CPUs will get to @g on their own, make sure an idle one does */
+	if (READ_ONCE(g->dsq.dsq.nr)) {
+		for_each_online_cpu(cpu) {
+			if (idle_cpu(cpu)) {
+				resched_cpu(cpu);
+				break;
+			}
+		}
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+static int scx_group_init_one(struct scx_group *g, struct task_group *tg)
+{
+	init_dsq(&g->dsq.dsq, SCX_DSQ_GLOBAL);
+	g->dsq.idx = alloc_dsq_index(NUMA_NO_NODE);
+	if (!g->dsq.idx)
+		return -ENOMEM;
+
+	g->tg = tg;
+	g->weight = CGROUP_WEIGHT_DFL;
+	atomic64_set(&g->vtime, READ_ONCE(scx_group_vtime_floor));
+	hrtimer_init(&g->unthrottle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	g->unthrottle_timer.function = scx_group_unthrottle_timerfn;
+	return 0;
+}
+
+int scx_tg_online(struct task_group *tg)
+{
+	struct scx_group *g;
+	int ret;
+
+	/* the root is scx_root_group */
+	if (!tg->parent)
+		return 0;
+
+	g = kzalloc(sizeof(*g), GFP_KERNEL);
+	if (!g)
+		return -ENOMEM;
+
+	ret = scx_group_init_one(g, tg);
+	if (ret)
+		goto err_free;
+
+	mutex_lock(&scx_group_mutex);
+	ret = xa_err(xa_store(&scx_groups, tg->css.id, g, GFP_KERNEL));
+	if (!ret) {
+		g->parent = xa_load(&scx_groups, tg->parent->css.id) ?:
+			&scx_root_group;
+		list_add_tail_rcu(&g->node, &scx_group_list);
+		scx_group_update_hweights();
+	}
+	mutex_unlock(&scx_group_mutex);
+
+	if (ret)
+		goto err_free;
+	return 0;
+
+err_free:
+	kfree(g->dsq.idx);
+	kfree(g);
+	return ret;
+}
+
+void scx_tg_offline(struct task_group *tg)
+{
+	struct scx_group *g;
+
+	mutex_lock(&scx_group_mutex);
+	g = xa_erase(&scx_groups, tg->css.id);
+	if (g) {
+		list_del_rcu(&g->node);
+		scx_group_update_hweights();
+	}
+	mutex_unlock(&scx_group_mutex);
+
+	if (!g)
+		return;
+
+	/* an offline cgroup has no tasks and thus can't be charged anymore */
+	hrtimer_cancel(&g->unthrottle_timer);
+	WARN_ON_ONCE(READ_ONCE(g->dsq.dsq.nr));
+	kfree_rcu(g->dsq.idx, rcu);
+	kfree_rcu(g, rcu);
+}
 
-#ifdef CONFIG_UCLAMP_TASK
-	.uclamp_enabled		= 0,
-#endif
-};
+int scx_cgroup_can_attach(struct cgroup_taskset *tset)
+{
+	return 0;
+}
 
-static void init_dsq(struct scx_dispatch_q *dsq, u64 dsq_id)
+/*
+ * sched_move_task() dequeues and re-enqueues queued tasks around the
+ * task_group switch, which moves them to the new group's DSQ. Nothing to do.
+ */
+void scx_move_task(struct task_struct *p)
 {
-	memset(dsq, 0, sizeof(*dsq));
+}
 
-	raw_spin_lock_init(&dsq->lock);
-	INIT_LIST_HEAD(&dsq->fifo);
-	dsq->id = dsq_id;
+void scx_cgroup_finish_attach(void)
+{
 }
 
-static struct scx_dispatch_q *create_dsq(u64 dsq_id, int node)
+void scx_cgroup_cancel_attach(struct cgroup_taskset *tset)
 {
-	struct scx_dispatch_q *dsq;
+}
 
-	if (dsq_id & SCX_DSQ_FLAG_BUILTIN)
-		return ERR_PTR(-EINVAL);
+void scx_group_set_weight(struct task_group *tg, unsigned long weight)
+{
+	struct scx_group *g;
 
-	dsq = kmalloc_node(sizeof(*dsq), GFP_ATOMIC, node);
-	if (!dsq)
-		return ERR_PTR(-ENOMEM);
+	mutex_lock(&scx_group_mutex);
+	g = xa_load(&scx_groups, tg->css.id);
+	if (g && g->weight != weight) {
+		g->weight = clamp_t(unsigned long, weight, CGROUP_WEIGHT_MIN,
+				    CGROUP_WEIGHT_MAX);
+		scx_group_update_hweights();
+	}
+	mutex_unlock(&scx_group_mutex);
+}
 
-	init_dsq(dsq, dsq_id);
+static void scx_cgroup_exit(void)
+{
+	struct scx_group *g;
 
-	return dsq;
+	mutex_lock(&scx_group_mutex);
+	list_for_each_entry(g, &scx_group_list, node)
+		hrtimer_cancel(&g->unthrottle_timer);
+	mutex_unlock(&scx_group_mutex);
 }
 
-static void free_dsq_irq_workfn(struct irq_work *irq_work)
+/* no task is on SCX yet, start all groups afresh */
+static int scx_cgroup_init(void)
 {
-	struct llist_node *to_free = llist_del_all(&dsqs_to_free);
-	struct scx_dispatch_q *dsq, *tmp_dsq;
+	struct scx_group *g;
+	int cpu;
 
-	llist_for_each_entry_safe(dsq, tmp_dsq, to_free, free_node)
-		kfree_rcu(dsq, rcu);
+	for_each_possible_cpu(cpu)
+		per_cpu(scx_group_batch, cpu) = (struct scx_group_batch){};
+
+	mutex_lock(&scx_group_mutex);
+	WRITE_ONCE(scx_group_vtime_floor, 0);
+	list_for_each_entry(g, &scx_group_list, node) {
+		atomic64_set(&g->vtime, 0);
+		atomic64_set(&g->usage, 0);
+		g->period_end = 0;
+		g->throttled = false;
+	}
+	mutex_unlock(&scx_group_mutex);
+	return 0;
 }
 
-static DEFINE_IRQ_WORK(free_dsq_irq_work, free_dsq_irq_workfn);
-
-static void destroy_dsq(u64 dsq_id)
+static void __init scx_group_init_root(void)
 {
+	BUG_ON(scx_group_init_one(&scx_root_group, NULL));
+	scx_root_group.hweight = SCX_GROUP_HW_ONE;
+	scx_root_group.qweight = SCX_GROUP_HW_ONE;
+	list_add_tail(&scx_root_group.node, &scx_group_list);
 }
-
+#else	/* CONFIG_EXT_GROUP_SCHED */
 static void scx_cgroup_exit(void) {}
 static int scx_cgroup_init(void) { return 0; }
+static void scx_group_init_root(void) {}
+#endif	/* CONFIG_EXT_GROUP_SCHED */
+
 static void scx_cgroup_config_knobs(void) {}
 
 /*
@@ -2641,23 +5285,61 @@ bool task_on_scx(struct task_struct *p)
 	return p->policy == SCHED_EXT;
 }
 
-static void scx_ops_fallback_enqueue(struct task_struct *p, u64 enq_flags)
+/**
+ * scx_ops_bypass - Take the BPF scheduler out of the picture
+ *
+ * Called once %SCX_OPS_DISABLING is set. From then on, do_enqueue_task() puts
+ * every task on the local DSQ of its CPU in FIFO order, balance_one() no longer
+ * calls ops.dispatch() and select_task_rq_scx() no longer calls
+ * ops.select_cpu(). Tasks which are already runnable may be sitting on DSQs
+ * only the BPF scheduler knows about. Cycle them through dequeue/enqueue so
+ * that they land on their local DSQs too.
+ *
+ * The runnable tasks of a CPU are on its watchdog_list, so only runnable
+ * tasks are visited and only with their own rq locked rather than walking all
+ * tasks with IRQs disabled.
+ */
+static void scx_ops_bypass(void)
 {
-	if (enq_flags & SCX_ENQ_LAST)
-		scx_bpf_dispatch(p, SCX_DSQ_LOCAL, SCX_SLICE_DFL, enq_flags);
-	else
-		scx_bpf_dispatch(p, SCX_DSQ_GLOBAL, SCX_SLICE_DFL, enq_flags);
-}
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct rq *rq = cpu_rq(cpu);
+		struct sched_ext_entity *entity, *n;
+		struct rq_flags rf;
+
+		rq_lock_irqsave(rq, &rf);
+		update_rq_clock(rq);
 
-static void scx_ops_fallback_dispatch(s32 cpu, struct task_struct *prev) {}
+		/*
+		 * Re-enqueueing puts the task back at or after its position in
+		 * the sorted watchdog_list. Walking backwards visits each task
+		 * exactly once.
+		 */
+		list_for_each_entry_safe_reverse(entity, n, &rq->scx->watchdog_list,
+						 watchdog_node) {
+			SCHED_CHANGE_BLOCK(rq, entity->task, DEQUEUE_SAVE |
+					   DEQUEUE_MOVE | DEQUEUE_NOCLOCK) {
+				/* cycling deq/enq is enough, see above */
+			}
+		}
+
+		rq_unlock_irqrestore(rq, &rf);
+
+		/* kick to restore ticks and pick from the local DSQ */
+		resched_cpu(cpu);
+	}
+}
 
 static void scx_ops_disable_workfn(struct kthread_work *work)
 {
 	struct scx_exit_info *ei = &scx_exit_info;
 	struct scx_task_iter sti;
 	struct task_struct *p;
+	struct rhashtable_iter rht_iter;
+	struct scx_dispatch_q *dsq;
 	const char *reason;
-	int i, cpu, type;
+	int i, type, nr_switched = 0;
 
 	type = atomic_read(&scx_exit_type);
 	while (true) {
@@ -2725,12 +5407,12 @@ static void scx_ops_disable_workfn(struct kthread_work *work)
 	 * forgetting to run, which unfortunately also excludes toggling the
 	 * static branches.
 	 *
-	 * Let's work around by overriding a couple ops and modifying behaviors
-	 * based on the DISABLING state and then cycling the tasks through
-	 * dequeue/enqueue to force global FIFO scheduling.
+	 * Let's work around by bypassing the BPF scheduler and modifying
+	 * behaviors based on the DISABLING state.
 	 *
-	 * a. ops.enqueue() and .dispatch() are overridden for simple global
-	 *    FIFO scheduling.
+	 * a. Tasks are scheduled in FIFO order on their local DSQs without
+	 *    calling ops.enqueue(), .dispatch() or .select_cpu(), see
+	 *    scx_ops_bypass().
 	 *
 	 * b. balance_scx() never sets %SCX_TASK_BAL_KEEP as the slice value
 	 *    can't be trusted. Whenever a tick triggers, the running task is
@@ -2740,25 +5422,7 @@ static void scx_ops_disable_workfn(struct kthread_work *work)
 	 *
 	 * d. scx_prio_less() reverts to the default core_sched_at order.
 	 */
-	scx_ops.enqueue = scx_ops_fallback_enqueue;
-	scx_ops.dispatch = scx_ops_fallback_dispatch;
-
-	spin_lock_irq(&scx_tasks_lock);
-	scx_task_iter_init(&sti);
-	while ((p = scx_task_iter_next_filtered_locked(&sti))) {
-		if (READ_ONCE(p->__state) != TASK_DEAD) {
-			SCHED_CHANGE_BLOCK(task_rq(p), p,
-					   DEQUEUE_SAVE | DEQUEUE_MOVE) {
-				/* cycling deq/enq is enough, see above */
-			}
-		}
-	}
-	scx_task_iter_exit(&sti);
-	spin_unlock_irq(&scx_tasks_lock);
-
-	/* kick all CPUs to restore ticks */
-	for_each_possible_cpu(cpu)
-		resched_cpu(cpu);
+	scx_ops_bypass();
 
 forward_progress_guaranteed:
 	/*
@@ -2776,7 +5440,11 @@ forward_progress_guaranteed:
 	percpu_down_write(&scx_fork_rwsem);
 	scx_cgroup_lock();
 
-	spin_lock_irq(&scx_tasks_lock);
+	/*
+	 * Everyone is making forward progress in bypass mode. Switch the tasks
+	 * back in batches, dropping the scx_tasks locks in between so that IRQs
+	 * aren't held off and higher priority tasks can run.
+	 */
 	scx_task_iter_init(&sti);
 	while ((p = scx_task_iter_next_filtered_locked(&sti))) {
 		const struct sched_class *old_class = p->sched_class;
@@ -2796,9 +5464,14 @@ forward_progress_guaranteed:
 			check_class_changed(task_rq(p), p, old_class, p->prio);
 
 		scx_ops_disable_task(p);
+
+		if (!(++nr_switched % SCX_SWITCH_BATCH)) {
+			scx_task_iter_unlock(&sti);
+			cond_resched();
+			scx_task_iter_relock(&sti);
+		}
 	}
 	scx_task_iter_exit(&sti);
-	spin_unlock_irq(&scx_tasks_lock);
 
 	/* no task is on scx, turn off all the switches and flush in-progress calls */
 	static_branch_disable_cpuslocked(&__scx_ops_enabled);
@@ -2807,15 +5480,35 @@ forward_progress_guaranteed:
 	static_branch_disable_cpuslocked(&scx_ops_enq_last);
 	static_branch_disable_cpuslocked(&scx_ops_enq_exiting);
 	static_branch_disable_cpuslocked(&scx_ops_cpu_preempt);
+	static_branch_disable_cpuslocked(&scx_ops_prio_heur);
+	static_branch_disable_cpuslocked(&scx_ops_load_heur);
 	static_branch_disable_cpuslocked(&scx_builtin_idle_enabled);
+	static_branch_disable_cpuslocked(&scx_gdsq_sharded);
+	static_branch_disable_cpuslocked(&scx_group_dsq);
+	static_branch_disable_cpuslocked(&scx_key_enabled);
+	static_branch_disable_cpuslocked(&scx_dsq_indexed);
+	static_branch_disable_cpuslocked(&scx_cap_select);
+	static_branch_disable_cpuslocked(&scx_slice_adapt);
+	static_branch_disable_cpuslocked(&scx_local_vtime_enabled);
+	if (scx_lat_hist_ops) {
+		static_branch_dec_cpuslocked(&scx_lat_hist_enabled);
+		scx_lat_hist_ops = false;
+	}
+	static_branch_disable_cpuslocked(&scx_shadow_tick_enabled);
+	hmbird_park_enable(false);
+	hmbird_trace_enable(false);
 	synchronize_rcu();
 
+	clear_dispatch_retries();
+
 	scx_cgroup_exit();
 
 	scx_cgroup_unlock();
 	percpu_up_write(&scx_fork_rwsem);
 	cpus_read_unlock();
 
+	slim_walt_enable(false);
+
 	if (ei->type >= SCX_EXIT_ERROR) {
 		printk(KERN_ERR "sched_ext: BPF scheduler \"%s\" errored, disabling\n", scx_ops.name);
 
@@ -2832,6 +5525,18 @@ forward_progress_guaranteed:
 
 	memset(&scx_ops, 0, sizeof(scx_ops));
 
+	/* no task is on scx, custom DSQs are empty and can be released */
+	rhashtable_walk_enter(&dsq_hash, &rht_iter);
+	do {
+		rhashtable_walk_start(&rht_iter);
+
+		while ((dsq = rhashtable_walk_next(&rht_iter)) && !IS_ERR(dsq))
+			destroy_dsq(dsq->id);
+
+		rhashtable_walk_stop(&rht_iter);
+	} while (dsq == ERR_PTR(-EAGAIN));
+	rhashtable_walk_exit(&rht_iter);
+
 	free_percpu(scx_dsp_buf);
 	scx_dsp_buf = NULL;
 	scx_dsp_max_batch = 0;
@@ -2931,7 +5636,7 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 		goto err_unlock;
 	}
 
-	//slim_walt_enable(true);
+	slim_walt_enable(true);
 
 	/*
 	 * Set scx_ops, transition to PREPPING and clear exit info to arm the
@@ -2954,6 +5659,36 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 	 */
 	cpus_read_lock();
 
+	/*
+	 * No task is on SCX yet. Set up the topology dependent DSQ layout
+	 * before ops.init() gets to create DSQs.
+	 */
+	scx_build_clusters();
+	if (READ_ONCE(gdsq_shard_ctrl) && scx_nr_clusters > 1)
+		static_branch_enable_cpuslocked(&scx_gdsq_sharded);
+	if (IS_ENABLED(CONFIG_EXT_GROUP_SCHED) && READ_ONCE(group_dsq_ctrl))
+		static_branch_enable_cpuslocked(&scx_group_dsq);
+	if (READ_ONCE(key_task_ctrl)) {
+		scx_key_build_cluster();
+		static_branch_enable_cpuslocked(&scx_key_enabled);
+	}
+	if (READ_ONCE(dsq_index_ctrl))
+		static_branch_enable_cpuslocked(&scx_dsq_indexed);
+	if (READ_ONCE(cap_select_ctrl) && scx_nr_clusters > 1)
+		static_branch_enable_cpuslocked(&scx_cap_select);
+	if (READ_ONCE(slice_adapt_ctrl))
+		static_branch_enable_cpuslocked(&scx_slice_adapt);
+	if (scx_local_vtime_setup())
+		static_branch_enable_cpuslocked(&scx_local_vtime_enabled);
+	if (READ_ONCE(lat_hist_ctrl)) {
+		static_branch_inc_cpuslocked(&scx_lat_hist_enabled);
+		scx_lat_hist_ops = true;
+	}
+	if (READ_ONCE(highres_tick_ctrl))
+		static_branch_enable_cpuslocked(&scx_shadow_tick_enabled);
+	hmbird_park_enable(true);
+	hmbird_trace_enable(true);
+
 	scx_switch_all_req = true;
 	if (scx_ops.init) {
 		ret = SCX_CALL_OP_RET(SCX_KF_INIT, init);
@@ -3007,6 +5742,10 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 
 	if (ops->flags & SCX_OPS_ENQ_EXITING)
 		static_branch_enable_cpuslocked(&scx_ops_enq_exiting);
+	if (ops->flags & SCX_OPS_HMBIRD_PRIO)
+		static_branch_enable_cpuslocked(&scx_ops_prio_heur);
+	if (ops->flags & SCX_OPS_HMBIRD_LOAD)
+		static_branch_enable_cpuslocked(&scx_ops_load_heur);
 	if (scx_ops.cpu_acquire || scx_ops.cpu_release)
 		static_branch_enable_cpuslocked(&scx_ops_cpu_preempt);
 
@@ -3034,34 +5773,35 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 	 * tasks. Prep all tasks first and then enable them with preemption
 	 * disabled.
 	 */
-	spin_lock_irq(&scx_tasks_lock);
-
 	scx_task_iter_init(&sti);
 	while ((p = scx_task_iter_next_filtered(&sti))) {
 		get_task_struct(p);
-		spin_unlock_irq(&scx_tasks_lock);
+		scx_task_iter_unlock(&sti);
 
 		ret = scx_ops_prepare_task(p, task_group(p));
 		if (ret) {
 			put_task_struct(p);
-			spin_lock_irq(&scx_tasks_lock);
+			scx_task_iter_relock(&sti);
 			scx_task_iter_exit(&sti);
-			spin_unlock_irq(&scx_tasks_lock);
 			pr_err("sched_ext: ops.prep_enable() failed (%d) for %s[%d] while loading\n",
 			       ret, p->comm, p->pid);
 			goto err_disable_unlock;
 		}
 
 		put_task_struct(p);
-		spin_lock_irq(&scx_tasks_lock);
+		scx_task_iter_relock(&sti);
 	}
 	scx_task_iter_exit(&sti);
 
 	/*
-	 * All tasks are prepped but are still ops-disabled. Ensure that
-	 * %current can't be scheduled out and switch everyone.
-	 * preempt_disable() is necessary because we can't guarantee that
-	 * %current won't be starved if scheduled out while switching.
+	 * All tasks are prepped but are still ops-disabled. Switch everyone in
+	 * batches of %SCX_SWITCH_BATCH. Within a batch, %current can't be
+	 * scheduled out so that it isn't starved while the tasks it competes
+	 * with are half switched. Between batches, the scx_tasks locks are dropped
+	 * and preemption enabled so that IRQs and other tasks aren't held off
+	 * for the whole walk. Once %current itself has been switched, it's at
+	 * the mercy of the BPF scheduler like everyone else and the watchdog is
+	 * there to catch a BPF scheduler which doesn't schedule it.
 	 */
 	preempt_disable();
 
@@ -3071,7 +5811,6 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 	 */
 	if (!scx_ops_tryset_enable_state(SCX_OPS_ENABLING, SCX_OPS_PREPPING)) {
 		preempt_enable();
-		spin_unlock_irq(&scx_tasks_lock);
 		ret = -EBUSY;
 		goto err_disable_unlock;
 	}
@@ -3079,7 +5818,7 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 	/*
 	 * We're fully committed and can't fail. The PREPPED -> ENABLED
 	 * transitions here are synchronized against sched_ext_free() through
-	 * scx_tasks_lock.
+	 * the scx_tasks shard locks.
 	 */
 	WRITE_ONCE(scx_switching_all, scx_switch_all_req);
 	start = sched_clock();
@@ -3103,11 +5842,18 @@ static int scx_ops_enable(struct sched_ext_ops *ops)
 		} else {
 			scx_ops_disable_task(p);
 		}
+
+		/* @sti's cursor keeps our position while the locks are dropped */
+		if (!(tcnt % SCX_SWITCH_BATCH)) {
+			scx_task_iter_unlock(&sti);
+			preempt_enable();
+			cond_resched();
+			preempt_disable();
+			scx_task_iter_relock(&sti);
+		}
 	}
 	printk("\n\n switch cnt = %d, duration = %llu, current cpu = %d \n\n", tcnt, sched_clock() - start, smp_processor_id());
 	scx_task_iter_exit(&sti);
-
-	spin_unlock_irq(&scx_tasks_lock);
 	preempt_enable();
 	scx_cgroup_unlock();
 	percpu_up_write(&scx_fork_rwsem);
@@ -3249,7 +5995,8 @@ static int bpf_scx_init_member(const struct btf_type *t,
 		ops->dispatch_max_batch = *(u32 *)(udata + moff);
 		return 1;
 	case offsetof(struct sched_ext_ops, flags):
-		if (*(u64 *)(udata + moff) & ~SCX_OPS_ALL_FLAGS)
+		if (*(u64 *)(udata + moff) &
+		    ~(SCX_OPS_ALL_FLAGS | SCX_OPS_HMBIRD_ALL_FLAGS))
 			return -EINVAL;
 		ops->flags = *(u64 *)(udata + moff);
 		return 1;
@@ -3343,11 +6090,69 @@ static const struct sysrq_key_op sysrq_sched_ext_reset_op = {
 	.enable_mask	= SYSRQ_ENABLE_RTNICE,
 };
 
+/*
+ * Kick @cpu right away if its rq lock can be taken without waiting. The
+ * caller may be holding some other rq lock, so this must never spin on one.
+ * Returns %false if the kick has to be bounced to kick_cpus_irq_workfn().
+ */
+static bool kick_cpu_direct(s32 cpu, u64 flags)
+{
+	struct rq *rq = cpu_rq(cpu);
+	unsigned long irq_flags;
+
+	local_irq_save(irq_flags);
+
+	if (!raw_spin_rq_trylock(rq)) {
+		local_irq_restore(irq_flags);
+		return false;
+	}
+
+	if (cpu_online(cpu) || cpu == smp_processor_id()) {
+		if ((flags & SCX_KICK_PREEMPT) &&
+		    rq->curr->sched_class == &ext_sched_class)
+			rq->curr->scx->slice = 0;
+		resched_curr(rq);
+	}
+
+	raw_spin_rq_unlock(rq);
+	local_irq_restore(irq_flags);
+	return true;
+}
+
+/*
+ * Called by scx_notify_pick_next_task() with @rq locked when some CPUs kicked
+ * @rq with %SCX_KICK_WAIT_ASYNC. @rq went through pick_next_task(), which is
+ * what they were waiting for, so kick them back. Their rq locks can't be taken
+ * here and the kicking is bounced to kick_cpus_irq_workfn().
+ */
+void __scx_notify_kick_waiters(struct rq *rq)
+{
+	struct scx_rq_remote *remote = per_cpu_ptr(&scx_rq_remote, cpu_of(rq));
+	struct cpumask *waiters = remote->kick_waiters;
+	bool queued = false;
+	int cpu;
+
+	/* full barrier, pairs with smp_mb__after_atomic() in scx_bpf_kick_cpu() */
+	if (!xchg(&remote->kick_waiters_pending, 0))
+		return;
+
+	for_each_cpu(cpu, waiters) {
+		if (cpumask_test_and_clear_cpu(cpu, waiters)) {
+			cpumask_set_cpu(cpu, rq->scx->cpus_to_kick);
+			queued = true;
+		}
+	}
+
+	if (queued)
+		irq_work_queue(&rq->scx->kick_cpus_irq_work);
+}
+
 static void kick_cpus_irq_workfn(struct irq_work *irq_work)
 {
 	struct rq *this_rq = this_rq();
 	u64 *pseqs = this_cpu_ptr(scx_kick_cpus_pnt_seqs);
 	int this_cpu = cpu_of(this_rq);
+	u64 start = scx_lat_start();
 	int cpu;
 
 	for_each_cpu(cpu, this_rq->scx->cpus_to_kick) {
@@ -3360,7 +6165,7 @@ static void kick_cpus_irq_workfn(struct irq_work *irq_work)
 			if (cpumask_test_cpu(cpu, this_rq->scx->cpus_to_preempt) &&
 			    rq->curr->sched_class == &ext_sched_class)
 				rq->curr->scx->slice = 0;
-			pseqs[cpu] = rq->scx->pnt_seq;
+			pseqs[cpu] = per_cpu(scx_rq_remote, cpu).pnt_seq;
 			resched_curr(rq);
 		} else {
 			cpumask_clear_cpu(cpu, this_rq->scx->cpus_to_wait);
@@ -3379,18 +6184,21 @@ static void kick_cpus_irq_workfn(struct irq_work *irq_work)
 		 * scheduled on our core before the target CPU has entered the
 		 * resched path.
 		 */
-		while (smp_load_acquire(&cpu_rq(cpu)->scx->pnt_seq) == pseqs[cpu])
+		while (smp_load_acquire(&per_cpu(scx_rq_remote, cpu).pnt_seq) ==
+		       pseqs[cpu])
 			cpu_relax();
 	}
 
 	cpumask_clear(this_rq->scx->cpus_to_kick);
 	cpumask_clear(this_rq->scx->cpus_to_preempt);
 	cpumask_clear(this_rq->scx->cpus_to_wait);
+
+	scx_lat_end(SCX_LAT_KICK, start);
 }
 
 void __init init_sched_ext_class(void)
 {
-	int cpu;
+	int cpu, i;
 	u32 v;
 
 	/*
@@ -3399,39 +6207,70 @@ void __init init_sched_ext_class(void)
 	 * through the generated vmlinux.h.
 	 */
 	WRITE_ONCE(v, SCX_WAKE_EXEC | SCX_ENQ_WAKEUP | SCX_DEQ_SLEEP |
-		   SCX_TG_ONLINE | SCX_KICK_PREEMPT);
-
-	init_dsq(&scx_dsq_global, SCX_DSQ_GLOBAL);
-#ifdef CONFIG_SMP
-	BUG_ON(!alloc_cpumask_var(&idle_masks.cpu, GFP_KERNEL));
-	BUG_ON(!alloc_cpumask_var(&idle_masks.smt, GFP_KERNEL));
-#endif
+		   SCX_TG_ONLINE | SCX_KICK_PREEMPT | SCX_KICK_WAIT_ASYNC);
+
+	BUG_ON(rhashtable_init(&dsq_hash, &dsq_hash_params));
+	init_dsq(&scx_dsq_global.dsq, SCX_DSQ_GLOBAL);
+	scx_dsq_global.idx = alloc_dsq_index(NUMA_NO_NODE);
+	BUG_ON(!scx_dsq_global.idx);
+	for (i = 0; i < SCX_MAX_CLUSTERS; i++) {
+		init_dsq(&scx_gdsq_shards[i].dsq, SCX_DSQ_GLOBAL);
+		scx_gdsq_shards[i].idx = alloc_dsq_index(NUMA_NO_NODE);
+		BUG_ON(!scx_gdsq_shards[i].idx);
+		init_dsq(&scx_key_dsqs[i].dsq, SCX_DSQ_GLOBAL);
+		scx_key_dsqs[i].idx = alloc_dsq_index(NUMA_NO_NODE);
+		BUG_ON(!scx_key_dsqs[i].idx);
+	}
+	scx_group_init_root();
+	for_each_possible_cpu(cpu)
+		cpumask_set_cpu(cpu, &scx_cluster_cpus[0]);
 	scx_kick_cpus_pnt_seqs =
 		__alloc_percpu(sizeof(scx_kick_cpus_pnt_seqs[0]) *
 			       num_possible_cpus(),
 			       __alignof__(scx_kick_cpus_pnt_seqs[0]));
 	BUG_ON(!scx_kick_cpus_pnt_seqs);
 
+	scx_rq_cachep = KMEM_CACHE(scx_rq, SLAB_HWCACHE_ALIGN | SLAB_PANIC);
+	scx_entity_cachep = KMEM_CACHE(scx_entity_ext,
+				       SLAB_HWCACHE_ALIGN | SLAB_PANIC);
+
 	for_each_possible_cpu(cpu) {
+		struct scx_tasks_shard *shard = per_cpu_ptr(&scx_tasks_shards, cpu);
 		struct rq *rq = cpu_rq(cpu);
+		struct scx_shadow_tick *st;
 
-		rq->scx = kmalloc(sizeof(struct scx_rq), GFP_KERNEL);
-		if (rq->scx)
-			rq->scx->rq = rq;
-		else
-			pr_err("fatal error : alloc rq->scx failed!!!\n");
+		spin_lock_init(&shard->lock);
+		INIT_LIST_HEAD(&shard->tasks);
+
+		st = per_cpu_ptr(&scx_shadow_tick, cpu);
+		hrtimer_init(&st->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+		st->timer.function = scx_shadow_tick_fn;
+		st->rq = rq;
+		INIT_CSD(&st->csd, scx_shadow_tick_csd_fn, st);
+
+		rq->scx = kmem_cache_alloc_node(scx_rq_cachep,
+						GFP_KERNEL | __GFP_ZERO,
+						cpu_to_node(cpu));
+		BUG_ON(!rq->scx);
+		rq->scx->rq = rq;
 
 		init_dsq(&rq->scx->local_dsq, SCX_DSQ_LOCAL);
 		INIT_LIST_HEAD(&rq->scx->watchdog_list);
 
-		BUG_ON(!zalloc_cpumask_var(&rq->scx->cpus_to_kick, GFP_KERNEL));
-		BUG_ON(!zalloc_cpumask_var(&rq->scx->cpus_to_preempt, GFP_KERNEL));
-		BUG_ON(!zalloc_cpumask_var(&rq->scx->cpus_to_wait, GFP_KERNEL));
+		BUG_ON(!zalloc_cpumask_var_node(&rq->scx->cpus_to_kick, GFP_KERNEL,
+						cpu_to_node(cpu)));
+		BUG_ON(!zalloc_cpumask_var_node(&rq->scx->cpus_to_preempt, GFP_KERNEL,
+						cpu_to_node(cpu)));
+		BUG_ON(!zalloc_cpumask_var_node(&rq->scx->cpus_to_wait, GFP_KERNEL,
+						cpu_to_node(cpu)));
+		BUG_ON(!zalloc_cpumask_var_node(&per_cpu(scx_rq_remote, cpu).kick_waiters,
+						GFP_KERNEL, cpu_to_node(cpu)));
 		init_irq_work(&rq->scx->kick_cpus_irq_work, kick_cpus_irq_workfn);
 	}
 
 	register_sysrq_key('S', &sysrq_sched_ext_reset_op);
 	INIT_DELAYED_WORK(&scx_watchdog_work, scx_watchdog_workfn);
+	INIT_DEFERRABLE_WORK(&hmbird_park_work, hmbird_park_workfn);
 	scx_cgroup_config_knobs();
 }
 
@@ -3644,6 +6483,37 @@ u32 scx_bpf_dispatch_nr_slots(void)
 	return scx_dsp_max_batch - __this_cpu_read(scx_dsp_ctx.buf_cursor);
 }
 
+static u32 scx_consume(u64 dsq_id, u32 max)
+{
+	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
+	struct scx_dispatch_q *dsq;
+	u32 nr;
+
+	if (!scx_kf_allowed(SCX_KF_DISPATCH))
+		return 0;
+
+	flush_dispatch_buf(dspc->rq, dspc->rf);
+
+	if (dsq_id == SCX_DSQ_GLOBAL) {
+		nr = consume_global_dsq_n(dspc->rq, dspc->rf, max);
+	} else {
+		dsq = find_non_local_dsq(dsq_id);
+		if (unlikely(!dsq)) {
+			scx_ops_error("invalid DSQ ID 0x%016llx", dsq_id);
+			return 0;
+		}
+		nr = consume_dispatch_q_n(dspc->rq, dspc->rf, dsq, max);
+	}
+
+	/*
+	 * A successfully consumed task can be dequeued before it starts running
+	 * while the CPU is trying to migrate other dispatched tasks. Bump
+	 * nr_tasks to tell balance_scx() to retry on empty local DSQ.
+	 */
+	dspc->nr_tasks += nr;
+	return nr;
+}
+
 /**
  * scx_bpf_consume - Transfer a task from a DSQ to the current CPU's local DSQ
  * @dsq_id: DSQ to consume
@@ -3660,38 +6530,62 @@ u32 scx_bpf_dispatch_nr_slots(void)
  * consume.
  */
 bool scx_bpf_consume(u64 dsq_id)
+{
+	return scx_consume(dsq_id, 1);
+}
+
+/**
+ * scx_bpf_consume_n - Transfer multiple tasks from a DSQ to the local DSQ
+ * @dsq_id: DSQ to consume
+ * @nr: maximum number of tasks to consume, capped at %SCX_CONSUME_MAX_BATCH
+ *
+ * Like scx_bpf_consume() but consumes up to @nr tasks at once. Consecutive
+ * tasks of the DSQ which sit on the same remote rq are migrated together in a
+ * single rq lock round-trip. Fewer than @nr tasks may be consumed even if more
+ * are queued, e.g. when the next task sits on yet another rq.
+ *
+ * Returns the number of tasks consumed.
+ */
+u32 scx_bpf_consume_n(u64 dsq_id, u32 nr)
+{
+	return scx_consume(dsq_id, nr);
+}
+
+/**
+ * scx_bpf_consume_task - Transfer a specific task from a DSQ to the local DSQ
+ * @dsq_id: DSQ @p is expected to be on
+ * @p: task to consume, usually found with scx_bpf_dsq_peek()
+ *
+ * Like scx_bpf_consume() but consumes @p instead of the first task which can
+ * run on the current CPU. For %SCX_DSQ_GLOBAL, @p may be on any of the global
+ * DSQ shards or group DSQs. Fails if @p is no longer on such a DSQ or can't run
+ * on the current CPU, which is expected as the DSQ may have changed since @p
+ * was peeked at. Can only be called from ops.dispatch().
+ *
+ * Returns %true if @p has been consumed.
+ */
+bool scx_bpf_consume_task(u64 dsq_id, struct task_struct *p)
 {
 	struct scx_dsp_ctx *dspc = this_cpu_ptr(&scx_dsp_ctx);
-	struct scx_dispatch_q *dsq;
 
 	if (!scx_kf_allowed(SCX_KF_DISPATCH))
 		return false;
 
 	flush_dispatch_buf(dspc->rq, dspc->rf);
 
-	dsq = find_non_local_dsq(dsq_id);
-	if (unlikely(!dsq)) {
-		scx_ops_error("invalid DSQ ID 0x%016llx", dsq_id);
+	if (!consume_task(dspc->rq, dspc->rf, dsq_id, p))
 		return false;
-	}
 
-	if (consume_dispatch_q(dspc->rq, dspc->rf, dsq)) {
-		/*
-		 * A successfully consumed task can be dequeued before it starts
-		 * running while the CPU is trying to migrate other dispatched
-		 * tasks. Bump nr_tasks to tell balance_scx() to retry on empty
-		 * local DSQ.
-		 */
-		dspc->nr_tasks++;
-		return true;
-	} else {
-		return false;
-	}
+	/* see scx_consume() */
+	dspc->nr_tasks++;
+	return true;
 }
 
 BTF_SET8_START(scx_kfunc_ids_dispatch)
 BTF_ID_FLAGS(func, scx_bpf_dispatch_nr_slots)
 BTF_ID_FLAGS(func, scx_bpf_consume)
+BTF_ID_FLAGS(func, scx_bpf_consume_n)
+BTF_ID_FLAGS(func, scx_bpf_consume_task, KF_TRUSTED_ARGS)
 BTF_SET8_END(scx_kfunc_ids_dispatch)
 
 static const struct btf_kfunc_id_set scx_kfunc_set_dispatch = {
@@ -3756,8 +6650,12 @@ static const struct btf_kfunc_id_set scx_kfunc_set_cpu_release = {
  *
  * Kick @cpu into rescheduling. This can be used to wake up an idle CPU or
  * trigger rescheduling on a busy CPU. This can be called from any online
- * scx_ops operation and the actual kicking is performed asynchronously through
- * an irq work.
+ * scx_ops operation. @cpu is kicked right away if its rq lock is free and
+ * through an irq work otherwise.
+ *
+ * With %SCX_KICK_WAIT, the irq work spins until @cpu has been rescheduled.
+ * With %SCX_KICK_WAIT_ASYNC, the calling CPU is kicked in turn once @cpu has
+ * gone through pick_next_task(), without spinning.
  */
 void scx_bpf_kick_cpu(s32 cpu, u64 flags)
 {
@@ -3770,11 +6668,25 @@ void scx_bpf_kick_cpu(s32 cpu, u64 flags)
 
 	preempt_disable();
 	rq = this_rq();
+	scx_stat_inc(SCX_STAT_KICK);
+	hmbird_trace(HMBIRD_TRACE_KICK, NULL, flags, cpu);
+
+	if ((flags & SCX_KICK_WAIT_ASYNC) && cpu != cpu_of(rq)) {
+		struct scx_rq_remote *remote = per_cpu_ptr(&scx_rq_remote, cpu);
+
+		cpumask_set_cpu(cpu_of(rq), remote->kick_waiters);
+		/* pairs with xchg() in __scx_notify_kick_waiters() */
+		smp_mb__after_atomic();
+		WRITE_ONCE(remote->kick_waiters_pending, 1);
+	}
+
+	/* the spinning wait is done from the irq work, bounce */
+	if (!(flags & SCX_KICK_WAIT) && kick_cpu_direct(cpu, flags))
+		goto out;
 
 	/*
-	 * Actual kicking is bounced to kick_cpus_irq_workfn() to avoid nesting
-	 * rq locks. We can probably be smarter and avoid bouncing if called
-	 * from ops which don't hold a rq lock.
+	 * @cpu's rq lock is contended, possibly by ourselves. Bounce to
+	 * kick_cpus_irq_workfn() to avoid nesting rq locks.
 	 */
 	cpumask_set_cpu(cpu, rq->scx->cpus_to_kick);
 	if (flags & SCX_KICK_PREEMPT)
@@ -3783,6 +6695,7 @@ void scx_bpf_kick_cpu(s32 cpu, u64 flags)
 		cpumask_set_cpu(cpu, rq->scx->cpus_to_wait);
 
 	irq_work_queue(&rq->scx->kick_cpus_irq_work);
+out:
 	preempt_enable();
 }
 
@@ -3807,6 +6720,24 @@ s32 scx_bpf_dsq_nr_queued(u64 dsq_id)
 
 		if (ops_cpu_valid(cpu))
 			return cpu_rq(cpu)->scx->local_dsq.nr;
+	} else if (dsq_id == SCX_DSQ_GLOBAL &&
+		   (static_branch_unlikely(&scx_gdsq_sharded) ||
+		    static_branch_unlikely(&scx_group_dsq) ||
+		    static_branch_unlikely(&scx_key_enabled))) {
+		s32 nr = READ_ONCE(scx_dsq_global.dsq.nr);
+		int i;
+
+		if (static_branch_unlikely(&scx_gdsq_sharded)) {
+			for (i = 0; i < scx_nr_clusters; i++)
+				nr += READ_ONCE(scx_gdsq_shards[i].dsq.nr);
+		}
+		if (static_branch_unlikely(&scx_key_enabled)) {
+			for (i = 0; i < scx_nr_clusters; i++)
+				nr += READ_ONCE(scx_key_dsqs[i].dsq.nr);
+		}
+		if (static_branch_unlikely(&scx_group_dsq))
+			nr += scx_group_nr_queued();
+		return nr;
 	} else {
 		dsq = find_non_local_dsq(dsq_id);
 		if (dsq)
@@ -3815,6 +6746,125 @@ s32 scx_bpf_dsq_nr_queued(u64 dsq_id)
 	return -ENOENT;
 }
 
+/*
+ * Return the task at *@pos in @dsq with a reference held. If @dsq is shorter,
+ * *@pos is advanced past it for the next DSQ in the walk and %NULL returned.
+ * If @dsq shrank while being locked, the walk ends there: *@pos is set to
+ * %U32_MAX, which the following calls return %NULL for, so that a caller
+ * scanning positions doesn't see a task twice.
+ */
+static struct task_struct *dsq_peek_at(struct scx_dispatch_q *dsq, u32 *pos)
+{
+	u32 nr = READ_ONCE(dsq->nr);
+	struct task_struct *p;
+	unsigned long flags;
+
+	if (*pos == U32_MAX)
+		return NULL;
+
+	if (*pos >= nr) {
+		*pos -= nr;
+		return NULL;
+	}
+
+	raw_spin_lock_irqsave(&dsq->lock, flags);
+	p = dsq_nth_task(dsq, *pos);
+	if (p)
+		get_task_struct(p);
+	raw_spin_unlock_irqrestore(&dsq->lock, flags);
+
+	if (!p)
+		*pos = U32_MAX;
+	return p;
+}
+
+/*
+ * Walk the DSQs %SCX_DSQ_GLOBAL maps to for @cpu as consume_global_dsq_n()
+ * would, the group DSQs in list order.
+ */
+static struct task_struct *global_dsq_peek(s32 cpu, u32 pos)
+{
+	int cl = scx_cpu_cluster_id(cpu), i;
+	struct task_struct *p;
+
+	if (static_branch_unlikely(&scx_key_enabled)) {
+		p = dsq_peek_at(&scx_key_dsqs[cl].dsq, &pos);
+		for (i = 0; !p && i < scx_nr_clusters - 1; i++)
+			p = dsq_peek_at(&scx_key_dsqs[scx_cluster_steal[cl][i]].dsq,
+					&pos);
+		if (p)
+			return p;
+	}
+
+#ifdef CONFIG_EXT_GROUP_SCHED
+	if (static_branch_unlikely(&scx_group_dsq)) {
+		struct scx_group *g;
+
+		list_for_each_entry_rcu(g, &scx_group_list, node) {
+			p = dsq_peek_at(&g->dsq.dsq, &pos);
+			if (p)
+				return p;
+		}
+	}
+#endif
+
+	if (static_branch_unlikely(&scx_gdsq_sharded)) {
+		p = dsq_peek_at(&scx_gdsq_shards[cl].dsq, &pos);
+		for (i = 0; !p && i < scx_nr_clusters - 1; i++)
+			p = dsq_peek_at(&scx_gdsq_shards[scx_cluster_steal[cl][i]].dsq,
+					&pos);
+		if (p)
+			return p;
+	}
+
+	return dsq_peek_at(&scx_dsq_global.dsq, &pos);
+}
+
+/**
+ * scx_bpf_dsq_peek - Look at a queued task without consuming it
+ * @dsq_id: non-local DSQ to look at
+ * @pos: position of the task, 0 being the first
+ *
+ * Return the task at @pos in the DSQ identified by @dsq_id with a reference
+ * held which must be released with scx_bpf_task_release(). FIFO tasks come
+ * before the tasks ordered by scx_bpf_dispatch_vtime(). With dsq_index_ctrl set,
+ * the DSQ is listed one index bucket after another, so the order isn't the
+ * consumption order. For %SCX_DSQ_GLOBAL, @pos counts across the key DSQs, the
+ * group DSQs and the global DSQ shards in the order the calling CPU consumes
+ * them, see consume_global_dsq_n().
+ *
+ * The task's scx fields, weight and cpus_ptr can be inspected and the task
+ * then consumed with scx_bpf_consume_task(). The DSQ may change at any point
+ * after this returns. Each call walks the DSQ from the start, so scanning with
+ * increasing @pos should be limited to the first few tasks.
+ *
+ * Returns %NULL if @pos is beyond the end of the DSQ or the DSQ doesn't exist.
+ * Can be called from any non-sleepable online scx_ops operations.
+ */
+struct task_struct *scx_bpf_dsq_peek(u64 dsq_id, u32 pos)
+{
+	struct scx_dispatch_q *dsq;
+
+	lockdep_assert(rcu_read_lock_any_held());
+
+	if (dsq_id == SCX_DSQ_GLOBAL)
+		return global_dsq_peek(raw_smp_processor_id(), pos);
+
+	dsq = find_non_local_dsq(dsq_id);
+	if (!dsq)
+		return NULL;
+	return dsq_peek_at(dsq, &pos);
+}
+
+/**
+ * scx_bpf_task_release - Release a task returned by scx_bpf_dsq_peek()
+ * @p: task to release
+ */
+void scx_bpf_task_release(struct task_struct *p)
+{
+	put_task_struct(p);
+}
+
 /**
  * scx_bpf_test_and_clear_cpu_idle - Test and clear @cpu's idle state
  * @cpu: cpu to test and clear idle for
@@ -3855,13 +6905,17 @@ s32 scx_bpf_pick_idle_cpu(const struct cpumask *cpus_allowed)
 		return -EBUSY;
 	}
 
-	return scx_pick_idle_cpu(cpus_allowed);
+	return scx_pick_idle_cpu(cpus_allowed, raw_smp_processor_id());
 }
 
 /**
  * scx_bpf_get_idle_cpumask - Get a referenced kptr to the idle-tracking
  * per-CPU cpumask.
  *
+ * The mask is a snapshot assembled from the per-cluster idle masks. Up to
+ * %SCX_IDLE_SNAP_SLOTS snapshots can be held at the same time on a CPU, further
+ * acquisitions get an empty mask until one is released.
+ *
  * Returns NULL if idle tracking is not enabled, or running on a UP kernel.
  */
 const struct cpumask *scx_bpf_get_idle_cpumask(void)
@@ -3872,7 +6926,7 @@ const struct cpumask *scx_bpf_get_idle_cpumask(void)
 	}
 
 #ifdef CONFIG_SMP
-	return idle_masks.cpu;
+	return scx_idle_snapshot(false);
 #else
 	return cpu_none_mask;
 #endif
@@ -3881,7 +6935,7 @@ const struct cpumask *scx_bpf_get_idle_cpumask(void)
 /**
  * scx_bpf_get_idle_smtmask - Get a referenced kptr to the idle-tracking,
  * per-physical-core cpumask. Can be used to determine if an entire physical
- * core is free.
+ * core is free. Snapshot like scx_bpf_get_idle_cpumask().
  *
  * Returns NULL if idle tracking is not enabled, or running on a UP kernel.
  */
@@ -3893,7 +6947,7 @@ const struct cpumask *scx_bpf_get_idle_smtmask(void)
 	}
 
 #ifdef CONFIG_SMP
-	return idle_masks.smt;
+	return scx_idle_snapshot(true);
 #else
 	return cpu_none_mask;
 #endif
@@ -3905,13 +6959,8 @@ const struct cpumask *scx_bpf_get_idle_smtmask(void)
  */
 void scx_bpf_put_idle_cpumask(const struct cpumask *idle_mask)
 {
-	/*
-	 * Empty function body because we aren't actually acquiring or
-	 * releasing a reference to a global idle cpumask, which is read-only
-	 * in the caller and is never released. The acquire / release semantics
-	 * here are just used to make the cpumask is a trusted pointer in the
-	 * caller.
-	 */
+	/* frees the snapshot slot, see scx_idle_snapshot() */
+	scx_idle_snapshot_put(idle_mask);
 }
 
 struct scx_bpf_error_bstr_bufs {
@@ -4005,6 +7054,21 @@ s32 scx_bpf_task_cpu(const struct task_struct *p)
 	return task_cpu(p);
 }
 
+/**
+ * scx_bpf_task_set_key - Tag or untag a task as a key task
+ * @p: task of interest
+ * @key: whether @p is a key task
+ *
+ * Key tasks dispatched to %SCX_DSQ_GLOBAL are queued on the key DSQs which are
+ * consumed before the global DSQs, and are boosted while frames are in flight,
+ * see hmbird_key.c. The tag only takes effect if key_task_ctrl was set when the
+ * BPF scheduler was enabled. Returns whether @p was a key task.
+ */
+bool scx_bpf_task_set_key(struct task_struct *p, bool key)
+{
+	return scx_set_key_task(p, key);
+}
+
 /**
  * scx_bpf_task_cgroup - Return the sched cgroup of a task
  * @p: task of interest
@@ -4041,6 +7105,8 @@ out:
 BTF_SET8_START(scx_kfunc_ids_any)
 BTF_ID_FLAGS(func, scx_bpf_kick_cpu)
 BTF_ID_FLAGS(func, scx_bpf_dsq_nr_queued)
+BTF_ID_FLAGS(func, scx_bpf_dsq_peek, KF_ACQUIRE | KF_RET_NULL)
+BTF_ID_FLAGS(func, scx_bpf_task_release, KF_RELEASE)
 BTF_ID_FLAGS(func, scx_bpf_test_and_clear_cpu_idle)
 BTF_ID_FLAGS(func, scx_bpf_pick_idle_cpu)
 BTF_ID_FLAGS(func, scx_bpf_get_idle_cpumask, KF_ACQUIRE)
@@ -4050,6 +7116,7 @@ BTF_ID_FLAGS(func, scx_bpf_error_bstr, KF_TRUSTED_ARGS)
 BTF_ID_FLAGS(func, scx_bpf_destroy_dsq)
 BTF_ID_FLAGS(func, scx_bpf_task_running)
 BTF_ID_FLAGS(func, scx_bpf_task_cpu)
+BTF_ID_FLAGS(func, scx_bpf_task_set_key, KF_TRUSTED_ARGS)
 BTF_ID_FLAGS(func, scx_bpf_task_cgroup, KF_ACQUIRE)
 BTF_SET8_END(scx_kfunc_ids_any)
 
@@ -18,8 +18,46 @@
  */
 #define __bpf_kfunc __used noinline
 extern atomic_t scx_exit_type;
-extern atomic_t scx_active_tasks;
-extern u64 scx_total_dispatches;
+
+/* HMBird tunables, see hmbird_sched_proc_main.c */
+extern unsigned int cpu_cluster_masks;
+extern int gdsq_shard_ctrl;
+extern int gdsq_steal_order;
+extern int group_dsq_ctrl;
+extern int dsq_index_ctrl;
+extern int cap_select_ctrl;
+extern int slice_adapt_ctrl;
+extern int slice_min_us;
+extern int slice_max_us;
+extern int local_vtime_ctrl;
+extern int lat_hist_ctrl;
+extern int prio_heur_thresh;
+extern int high_load_ratio;
+extern int busy_load_ratio;
+extern int interactive_wait_us;
+extern int dsp_retry_ctrl;
+extern int dsp_retry_budget_us;
+extern int dsp_coalesce_ctrl;
+extern int hmbird_trace_ctrl;
+extern int partial_enable;
+extern int cpuctrl_high_ratio;
+extern int cpuctrl_low_ratio;
+extern int parctrl_high_ratio;
+extern int parctrl_low_ratio;
+extern int parctrl_high_ratio_l;
+extern int parctrl_low_ratio_l;
+extern int isoctrl_high_ratio;
+extern int isoctrl_low_ratio;
+extern int isolate_ctrl;
+extern int iso_free_rescue;
+extern int key_task_ctrl;
+extern int heartbeat;
+extern int heartbeat_enable;
+extern int misfit_ds;
+extern int cpu7_tl;
+extern int scx_gov_ctrl;
+extern int slim_gov_debug;
+extern char saved_gov[NR_CPUS][16];
 
 enum scx_wake_flags {
 	/* expose select WF_* flags as enums */
@@ -104,6 +142,36 @@ enum scx_tg_flags {
 enum scx_kick_flags {
 	SCX_KICK_PREEMPT	= 1LLU << 0,	/* force scheduling on the CPU */
 	SCX_KICK_WAIT		= 1LLU << 1,	/* wait for the CPU to be rescheduled */
+	/*
+	 * Don't spin for the CPU to be rescheduled, kick the caller's CPU
+	 * back once the target went through pick_next_task() instead.
+	 */
+	SCX_KICK_WAIT_ASYNC	= 1LLU << 2,
+};
+
+/*
+ * HMBird specific sched_ext_ops.flags. They live above the upstream
+ * SCX_OPS_* flags and turn on the HMBird scheduling heuristics, which are
+ * behind static keys and cost nothing unless the BPF scheduler opts in. The
+ * thresholds are tunable under /proc/hmbird_sched.
+ */
+enum scx_ops_hmbird_flags {
+	/*
+	 * Favor RT tasks and tasks with prio below prio_heur_thresh: retry
+	 * harder and queue at the head on dispatch, keep running them from
+	 * balance and refill their slices. Also extend the slices of user
+	 * tasks which waited less than interactive_wait_us.
+	 */
+	SCX_OPS_HMBIRD_PRIO	= 1LLU << 32,
+
+	/*
+	 * On CPUs with more than high_load_ratio runnable tasks per online
+	 * CPU, preempt low slice tasks and shorten the dispatch loop. Halve
+	 * the slices of normal tasks above busy_load_ratio.
+	 */
+	SCX_OPS_HMBIRD_LOAD	= 1LLU << 33,
+
+	SCX_OPS_HMBIRD_ALL_FLAGS = SCX_OPS_HMBIRD_PRIO | SCX_OPS_HMBIRD_LOAD,
 };
 
 #ifdef CONFIG_SCHED_CLASS_EXT
@@ -138,6 +206,19 @@ __printf(2, 3) void scx_ops_error_type(enum scx_exit_type type,
 void __scx_notify_pick_next_task(struct rq *rq,
 				 struct task_struct *p,
 				 const struct sched_class *active);
+void __scx_notify_kick_waiters(struct rq *rq);
+
+/*
+ * Per-CPU SCX state which other CPUs poll or write. It's kept on its own cache
+ * line, away from the rq->scx fields the CPU itself works on.
+ */
+struct scx_rq_remote {
+	u64			pnt_seq;	/* see kick_cpus_irq_workfn() */
+	int			kick_waiters_pending;
+	cpumask_var_t		kick_waiters;	/* see __scx_notify_kick_waiters() */
+};
+
+DECLARE_PER_CPU_SHARED_ALIGNED(struct scx_rq_remote, scx_rq_remote);
 
 static inline void scx_notify_pick_next_task(struct rq *rq,
 					     struct task_struct *p,
@@ -151,7 +232,13 @@ static inline void scx_notify_pick_next_task(struct rq *rq,
 	 * kick_cpus_irq_workfn() who is waiting for this CPU to perform a
 	 * resched.
 	 */
-	smp_store_release(&rq->scx->pnt_seq, rq->scx->pnt_seq + 1);
+	struct scx_rq_remote *remote = per_cpu_ptr(&scx_rq_remote, cpu_of(rq));
+
+	smp_store_release(&remote->pnt_seq, remote->pnt_seq + 1);
+
+	/* %SCX_KICK_WAIT_ASYNC kickers to notify */
+	if (unlikely(READ_ONCE(remote->kick_waiters_pending)))
+		__scx_notify_kick_waiters(rq);
 #endif
 	if (!static_branch_unlikely(&scx_ops_cpu_preempt))
 		return;
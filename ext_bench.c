@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * ext_bench: in-kernel microbenchmark of the SCX hot paths.
+ *
+ * Writing "<pattern> <nr_tasks> <duration_ms>" to /proc/hmbird_sched/bench
+ * spawns @nr_tasks kthreads on SCX, runs them through @pattern for
+ * @duration_ms and blocks until done. Reading the file shows the per path
+ * report of the last run. The patterns are
+ *
+ *   wake	pairs of unbound tasks waking each other up and going to sleep
+ *   pin	the same with each task pinned and the two of a pair on
+ *		different CPUs, so that every wakeup is a remote one
+ *   fork	tasks forking short-lived kernel threads, which inherit SCX
+ *		through the fork path, and waiting for them
+ *
+ * The tasks go through the real paths of the loaded BPF scheduler, which is
+ * what's measured. The paths are timed with the latency histograms, which are
+ * reset at the start of a run and turned on for its duration if lat_hist_ctrl
+ * is off. p50 and p99 are interpolated within the log2 buckets, so they're
+ * only accurate to the bucket width for very skewed distributions.
+ *
+ * Included from build_policy.c.
+ */
+
+#define SCX_BENCH_MAX_TASKS	256
+#define SCX_BENCH_MAX_MS	10000
+
+enum scx_bench_pattern {
+	SCX_BENCH_WAKE,
+	SCX_BENCH_PIN,
+	SCX_BENCH_FORK,
+	SCX_BENCH_NR_PATTERNS,
+};
+
+static const char *scx_bench_names[SCX_BENCH_NR_PATTERNS] = {
+	[SCX_BENCH_WAKE]	= "wake",
+	[SCX_BENCH_PIN]		= "pin",
+	[SCX_BENCH_FORK]	= "fork",
+};
+
+struct scx_bench_task {
+	struct task_struct	*p;
+	struct scx_bench_task	*peer;		/* wake and pin */
+	bool			kicked;
+	bool			stop;
+	u64			nr_loops;
+};
+
+struct scx_bench_path {
+	u64			nr;
+	u64			ns_per_op;
+	u64			p50;
+	u64			p99;
+};
+
+struct scx_bench_report {
+	enum scx_bench_pattern	pattern;
+	u32			nr_tasks;
+	u32			duration_ms;
+	u64			nr_loops;
+	struct scx_bench_path	paths[SCX_NR_LATS];
+};
+
+static DEFINE_MUTEX(scx_bench_mutex);
+static struct scx_bench_report scx_bench_report;	/* last run */
+static bool scx_bench_has_report;
+
+/* move @p to SCX unless the BPF scheduler already switched everything */
+static void scx_bench_set_scx(struct task_struct *p)
+{
+	struct sched_param param = { .sched_priority = 0 };
+
+	if (!scx_switched_all())
+		sched_setscheduler_nocheck(p, SCHED_EXT, &param);
+}
+
+static void scx_bench_kick(struct scx_bench_task *t)
+{
+	WRITE_ONCE(t->kicked, true);
+	wake_up_process(t->p);
+}
+
+static int scx_bench_wake_fn(void *data)
+{
+	struct scx_bench_task *t = data;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!xchg(&t->kicked, false)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		if (READ_ONCE(t->stop))
+			continue;
+		t->nr_loops++;
+		scx_bench_kick(t->peer);
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/*
+ * Forked by scx_bench_fork_fn() rather than kthreadd, so that the SCX fork
+ * path is what's measured. Reaped on exit as kthreads ignore SIGCHLD.
+ */
+static int scx_bench_child_fn(void *data)
+{
+	struct completion *done = data;
+
+	yield();
+	complete(done);
+	do_exit(0);
+}
+
+static int scx_bench_fork_fn(void *data)
+{
+	struct scx_bench_task *t = data;
+
+	while (!kthread_should_stop()) {
+		DECLARE_COMPLETION_ONSTACK(done);
+		pid_t child;
+
+		if (READ_ONCE(t->stop)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+
+		child = kernel_thread(scx_bench_child_fn, &done,
+				      CLONE_FS | CLONE_FILES | SIGCHLD);
+		if (child < 0) {
+			WRITE_ONCE(t->stop, true);
+			continue;
+		}
+
+		wait_for_completion(&done);
+		t->nr_loops++;
+	}
+
+	return 0;
+}
+
+/* value below which @pct percent of the samples of @idx are */
+static u64 scx_bench_pct(enum scx_lat_idx idx, u64 total, int pct)
+{
+	u64 target = div_u64(total * pct, 100), cum = 0;
+	int b;
+
+	for (b = 0; b < SCX_LAT_NR_BUCKETS; b++) {
+		u64 cnt = scx_lat_hist_sum(idx, b);
+		u64 lo = b ? 1ULL << (b - 1) : 0, hi = 1ULL << b;
+
+		if (cnt && cum + cnt > target)
+			return lo + div64_u64((hi - lo) * (target - cum), cnt);
+		cum += cnt;
+	}
+	return 1ULL << (SCX_LAT_NR_BUCKETS - 1);
+}
+
+static void scx_bench_collect(struct scx_bench_report *rep)
+{
+	int i, b;
+
+	for (i = 0; i < SCX_NR_LATS; i++) {
+		struct scx_bench_path *path = &rep->paths[i];
+
+		path->nr = 0;
+		for (b = 0; b < SCX_LAT_NR_BUCKETS; b++)
+			path->nr += scx_lat_hist_sum(i, b);
+		if (!path->nr)
+			continue;
+
+		path->ns_per_op = div64_u64(scx_lat_hist_ns(i), path->nr);
+		path->p50 = scx_bench_pct(i, path->nr, 50);
+		path->p99 = scx_bench_pct(i, path->nr, 99);
+	}
+}
+
+static int scx_bench_run(enum scx_bench_pattern pattern, u32 nr_tasks,
+			 u32 duration_ms)
+{
+	int (*fn)(void *) = pattern == SCX_BENCH_FORK ? scx_bench_fork_fn :
+							scx_bench_wake_fn;
+	struct scx_bench_report *rep = &scx_bench_report;
+	struct scx_bench_task *tasks;
+	int i, cpu = -1, ret = 0;
+	u64 nr_loops = 0;
+
+	/* the wakeup patterns run in pairs */
+	if (pattern != SCX_BENCH_FORK)
+		nr_tasks = ALIGN(nr_tasks, 2);
+
+	tasks = kcalloc(nr_tasks, sizeof(*tasks), GFP_KERNEL);
+	if (!tasks)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_tasks; i++) {
+		struct scx_bench_task *t = &tasks[i];
+
+		t->peer = &tasks[i ^ 1];
+		t->p = kthread_create(fn, t, "scx_bench/%d", i);
+		if (IS_ERR(t->p)) {
+			ret = PTR_ERR(t->p);
+			t->p = NULL;
+			goto out_stop;
+		}
+		get_task_struct(t->p);
+
+		if (pattern == SCX_BENCH_PIN) {
+			cpu = cpumask_next(cpu, cpu_online_mask);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpu_online_mask);
+			kthread_bind(t->p, cpu);
+		}
+		scx_bench_set_scx(t->p);
+	}
+
+	static_branch_inc(&scx_lat_hist_enabled);
+	scx_lat_hist_reset();
+
+	for (i = 0; i < nr_tasks; i++)
+		wake_up_process(tasks[i].p);
+	if (pattern != SCX_BENCH_FORK) {
+		for (i = 0; i < nr_tasks; i += 2)
+			scx_bench_kick(&tasks[i]);
+	}
+
+	msleep(duration_ms);
+
+	for (i = 0; i < nr_tasks; i++)
+		WRITE_ONCE(tasks[i].stop, true);
+
+	memset(rep, 0, sizeof(*rep));
+	rep->pattern = pattern;
+	rep->nr_tasks = nr_tasks;
+	rep->duration_ms = duration_ms;
+	scx_bench_collect(rep);
+	scx_bench_has_report = true;
+
+	static_branch_dec(&scx_lat_hist_enabled);
+
+out_stop:
+	for (i = 0; i < nr_tasks; i++) {
+		if (!tasks[i].p)
+			break;
+		kthread_stop(tasks[i].p);
+		nr_loops += tasks[i].nr_loops;
+		put_task_struct(tasks[i].p);
+	}
+	if (!ret)
+		rep->nr_loops = nr_loops;
+	kfree(tasks);
+	return ret;
+}
+
+static ssize_t scx_bench_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	char kbuf[64] = {0}, name[16];
+	u32 nr_tasks, duration_ms;
+	int pattern, ret;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+
+	if (sscanf(kbuf, "%15s %u %u", name, &nr_tasks, &duration_ms) != 3)
+		return -EINVAL;
+
+	pattern = match_string(scx_bench_names, SCX_BENCH_NR_PATTERNS, name);
+	if (pattern < 0 || !nr_tasks || nr_tasks > SCX_BENCH_MAX_TASKS ||
+	    !duration_ms || duration_ms > SCX_BENCH_MAX_MS)
+		return -EINVAL;
+
+	if (!scx_enabled())
+		return -ENODEV;
+
+	if (!mutex_trylock(&scx_bench_mutex))
+		return -EBUSY;
+	ret = scx_bench_run(pattern, nr_tasks, duration_ms);
+	mutex_unlock(&scx_bench_mutex);
+
+	return ret ?: count;
+}
+
+static int scx_bench_show(struct seq_file *m, void *v)
+{
+	struct scx_bench_report *rep = &scx_bench_report;
+	int i;
+
+	mutex_lock(&scx_bench_mutex);
+
+	if (!scx_bench_has_report)
+		goto out_unlock;
+
+	seq_printf(m, "pattern:%s tasks:%u duration_ms:%u loops:%llu\n",
+		   scx_bench_names[rep->pattern], rep->nr_tasks,
+		   rep->duration_ms, rep->nr_loops);
+	seq_printf(m, "%-18s %12s %10s %10s %10s\n",
+		   "path", "ops", "ns/op", "p50", "p99");
+	for (i = 0; i < SCX_NR_LATS; i++) {
+		struct scx_bench_path *path = &rep->paths[i];
+
+		seq_printf(m, "%-18s %12llu %10llu %10llu %10llu\n",
+			   scx_lat_names[i], path->nr, path->ns_per_op,
+			   path->p50, path->p99);
+	}
+
+out_unlock:
+	mutex_unlock(&scx_bench_mutex);
+	return 0;
+}
+
+static int scx_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scx_bench_show, NULL);
+}
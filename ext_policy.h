@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * HMBird dispatch policy decisions shared by ext.c and the trace replay
+ * simulator in tools/hmbird_sim.
+ *
+ * Everything here is a pure function of its arguments, with the tunables and
+ * the task and rq state read by the caller. ext.c feeds them from the live
+ * state and hmbird_sim from the replayed one, so policy changes made here can
+ * be evaluated on recorded traces before they're flashed.
+ *
+ * Builds in the kernel and on the host, so only use the types and helpers
+ * defined below.
+ */
+#ifndef __SCX_EXT_POLICY_H
+#define __SCX_EXT_POLICY_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+
+#define scx_policy_div(a, b)	div_u64((a), (b))
+#else
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint64_t u64;
+typedef uint32_t u32;
+typedef uint8_t u8;
+typedef int64_t s64;
+typedef int32_t s32;
+
+#define scx_policy_div(a, b)	((u64)(a) / (b))
+
+#define SCHED_CAPACITY_SHIFT	10
+#define SCHED_CAPACITY_SCALE	(1L << SCHED_CAPACITY_SHIFT)
+#endif
+
+enum scx_policy_consts {
+	SCX_UTIL_HALFLIFE_SHIFT	= 25,	/* ~33ms like PELT */
+};
+
+enum scx_steal_order {
+	SCX_STEAL_NEAREST,	/* closest capacity first */
+	SCX_STEAL_BIG_FIRST,	/* highest capacity first */
+	SCX_STEAL_LITTLE_FIRST,	/* lowest capacity first */
+};
+
+/* 3/4 of the old average and 1/4 of the new sample */
+static inline u64 scx_policy_ewma(u64 avg, u64 val)
+{
+	return avg ? avg - (avg >> 2) + (val >> 2) : val;
+}
+
+/*
+ * Move @util towards full or zero utilization depending on @running for @delta
+ * nsecs. The distance halves every 2^SCX_UTIL_HALFLIFE_SHIFT nsecs, linearly
+ * interpolated within a half-life.
+ */
+static inline u32 scx_policy_util_decay(u32 util, u64 delta, bool running)
+{
+	u64 periods = delta >> SCX_UTIL_HALFLIFE_SHIFT;
+	u64 rem = delta & ((1ULL << SCX_UTIL_HALFLIFE_SHIFT) - 1);
+	u32 target = running ? SCHED_CAPACITY_SCALE : 0;
+
+	if (periods > SCHED_CAPACITY_SHIFT)
+		return target;
+
+	while (periods--)
+		util = (util + target) / 2;
+
+	if (running)
+		util += ((u64)(target - util) * rem) >> (SCX_UTIL_HALFLIFE_SHIFT + 1);
+	else
+		util -= ((u64)util * rem) >> (SCX_UTIL_HALFLIFE_SHIFT + 1);
+	return util;
+}
+
+/* where dispatch_enqueue() queues a task on a DSQ */
+enum scx_policy_dsq_pos {
+	SCX_POS_TAIL,		/* FIFO tail */
+	SCX_POS_HEAD,		/* FIFO head */
+	SCX_POS_PRIQ,		/* the DSQ's vtime ordered priq */
+	SCX_POS_VTIME,		/* vtime ordered local DSQ, see local_vtime_ctrl */
+};
+
+/*
+ * @head for %SCX_ENQ_HEAD or %SCX_ENQ_PREEMPT, @priq for %SCX_ENQ_DSQ_PRIQ and
+ * @local_vtime if the DSQ is a local DSQ in vtime order.
+ */
+static inline enum scx_policy_dsq_pos scx_policy_dsq_pos(bool head, bool priq,
+							 bool local_vtime)
+{
+	if (local_vtime && !head)
+		return SCX_POS_VTIME;
+	if (priq)
+		return SCX_POS_PRIQ;
+	return head ? SCX_POS_HEAD : SCX_POS_TAIL;
+}
+
+/* @a is ahead of @b in a vtime ordered DSQ */
+static inline bool scx_policy_vtime_before(u64 a, u64 b)
+{
+	return (s64)(a - b) < 0;
+}
+
+/*
+ * Adaptive base slice for a task which runs @avg_run per wakeup on average,
+ * @run_sum in the current one, and wakes up every @avg_wake_gap. Tasks that
+ * sleep more than they run get twice their burst, CPU bound ones @max.
+ */
+static inline u64 scx_policy_slice_base(u64 avg_run, u64 run_sum,
+					u64 avg_wake_gap, u64 min, u64 max)
+{
+	/* a CPU bound task may not have slept for a long time */
+	u64 run = avg_run > run_sum ? avg_run : run_sum;
+
+	if (!avg_wake_gap || run * 2 >= avg_wake_gap)
+		return max;
+
+	run *= 2;
+	return run < min ? min : run > max ? max : run;
+}
+
+/* share @slice with the @nr_queued tasks waiting on the local DSQ */
+static inline u64 scx_policy_slice_share(u64 slice, u32 nr_queued, u64 min)
+{
+	if (!nr_queued)
+		return slice;
+
+	slice = scx_policy_div(slice, nr_queued + 1);
+	return slice > min ? slice : min;
+}
+
+/*
+ * Whether balance_one() keeps running @prev, which has @slice of the @full
+ * slice it'd be refilled with left, instead of fetching more tasks.
+ */
+static inline bool scx_policy_keep_prev(u64 slice, u64 full, bool high_prio,
+					bool high_load)
+{
+	if (high_prio || (!high_load && slice > (full >> 2)))
+		return true;
+
+	/* force preemption for low slice tasks on high load CPUs */
+	return !(high_load && slice < (full >> 3));
+}
+
+/* @wait_ns between two runs makes a task with an mm interactive */
+static inline bool scx_policy_interactive(u64 wait_ns, bool has_mm,
+					  u64 interactive_wait_ns)
+{
+	return has_mm && wait_ns > 0 && wait_ns < interactive_wait_ns;
+}
+
+/* state of a task being picked by set_next_task_scx() */
+struct scx_policy_pick {
+	bool	interactive;
+	bool	high_prio;
+	bool	key_boosted;
+	bool	overloaded;	/* rq above busy_load_ratio */
+};
+
+/*
+ * Adjust the @slice of a task being picked. @dfl is %SCX_SLICE_DFL and @inf
+ * %SCX_SLICE_INF.
+ */
+static inline u64 scx_policy_pick_slice(u64 slice,
+					const struct scx_policy_pick *pk,
+					u64 dfl, u64 inf)
+{
+	if (pk->interactive && slice < dfl)
+		slice = slice + (dfl >> 2) < dfl ? slice + (dfl >> 2) : dfl;
+
+	if (pk->high_prio && slice < (dfl >> 1))
+		slice = dfl;
+
+	/* let a key task finish its part of the frame without being sliced */
+	if (pk->key_boosted && slice < dfl)
+		slice = dfl;
+
+	if (pk->overloaded && !pk->high_prio && !pk->key_boosted &&
+	    slice != inf && slice > (dfl >> 1))
+		slice >>= 1;
+
+	return slice;
+}
+
+/*
+ * Whether a dispatch which isn't to a local DSQ queues at the head, so that a
+ * high priority task doesn't wait behind the tasks queued meanwhile.
+ */
+static inline bool scx_policy_fallback_head(bool high_prio)
+{
+	return high_prio;
+}
+
+/* cluster @a comes before @b in the steal order of cluster @self */
+static inline bool scx_policy_steal_before(const unsigned long *cap, int order,
+					   int self, int a, int b)
+{
+	long da = (long)cap[a] - (long)cap[self];
+	long db = (long)cap[b] - (long)cap[self];
+
+	da = da < 0 ? -da : da;
+	db = db < 0 ? -db : db;
+
+	switch (order) {
+	case SCX_STEAL_BIG_FIRST:
+		return cap[a] > cap[b];
+	case SCX_STEAL_LITTLE_FIRST:
+		return cap[a] < cap[b];
+	default:
+		return da < db || (da == db && a < b);
+	}
+}
+
+/*
+ * Fill @steal[0 .. @nr - 2] with the clusters other than @self in steal
+ * order, an insertion sort by scx_policy_steal_before().
+ */
+static inline void scx_policy_build_steal(const unsigned long *cap, int nr,
+					  int order, int self, u8 *steal)
+{
+	int j, k, n = 0;
+
+	for (j = 0; j < nr; j++) {
+		if (j == self)
+			continue;
+		k = n++;
+		while (k > 0 &&
+		       scx_policy_steal_before(cap, order, self, j, steal[k - 1])) {
+			steal[k] = steal[k - 1];
+			k--;
+		}
+		steal[k] = j;
+	}
+}
+
+/*
+ * Cluster a task of @util, in %SCHED_CAPACITY_SCALE, last run in cluster @cl
+ * fits in, see scx_fit_cluster(). @misfit and @prime_tl are misfit_ds and
+ * cpu7_tl, @prime the prime cluster or -1. Clusters in @skip aren't
+ * considered, and the prime cluster is added to it if @util is below
+ * @prime_tl.
+ */
+static inline int scx_policy_fit_cluster(u64 util, int cl,
+					 const unsigned long *cap, int nr,
+					 int prime, u64 misfit, u64 prime_tl,
+					 unsigned long *skip)
+{
+	int fit = -1, big = -1, i;
+
+	util *= 100;
+
+	if (prime >= 0 && util < prime_tl * cap[prime])
+		*skip |= 1UL << prime;
+
+	if (util <= misfit * cap[cl] && !(*skip & (1UL << cl)))
+		return cl;
+
+	for (i = 0; i < nr; i++) {
+		if (*skip & (1UL << i))
+			continue;
+		if (util <= misfit * cap[i] && (fit < 0 || cap[i] < cap[fit]))
+			fit = i;
+		if (big < 0 || cap[i] > cap[big])
+			big = i;
+	}
+
+	if (fit >= 0 && (cap[fit] > cap[cl] || (*skip & (1UL << cl))))
+		return fit;
+	if (big >= 0 && (cap[big] > cap[cl] || (*skip & (1UL << cl))))
+		return big;
+	return cl;
+}
+
+#endif /* __SCX_EXT_POLICY_H */
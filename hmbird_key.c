@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * hmbird_key: fast lane for the frame critical tasks.
+ *
+ * Userspace tags the UI and render threads as key tasks by writing their TIDs
+ * to /proc/hmbird_sched/key_task, a negative TID untags. The BPF scheduler can
+ * also use scx_bpf_task_set_key(). With key_task_ctrl set when the BPF
+ * scheduler is enabled, key tasks dispatched to %SCX_DSQ_GLOBAL are queued on
+ * the key DSQ of their cluster, which CPUs consume before the global DSQs.
+ *
+ * With heartbeat_enable set, writing N to /proc/hmbird_sched/heartbeat opens a
+ * boost window of N frames at sched_ravg_window_frame_per_sec, 0 closes it.
+ * While the window is open, key tasks are queued on and woken up to the key
+ * cluster, the biggest one below the prime CPU, run at least a default slice
+ * and keep their CPU on balance.
+ *
+ * Included from ext.c.
+ */
+
+#define SCX_KEY_MAX_FRAMES	16	/* longest boost window */
+
+static atomic_t scx_nr_key_tasks;
+static u64 scx_key_boost_until;		/* sched_clock() */
+static int scx_key_cluster;
+
+static bool scx_key_task(const struct task_struct *p)
+{
+	return static_branch_unlikely(&scx_key_enabled) &&
+		READ_ONCE(scx_ext(p)->key);
+}
+
+static bool scx_key_boosting(void)
+{
+	return static_branch_unlikely(&scx_key_enabled) &&
+		sched_clock() < READ_ONCE(scx_key_boost_until);
+}
+
+static bool scx_key_boosted(const struct task_struct *p)
+{
+	return scx_key_task(p) && scx_key_boosting();
+}
+
+/* key DSQ to queue a key task associated with @cpu on */
+static struct scx_dispatch_q *find_key_dsq(s32 cpu)
+{
+	int cl = scx_key_boosting() ? scx_key_cluster : scx_cpu_cluster_id(cpu);
+
+	return &scx_key_dsqs[cl].dsq;
+}
+
+/* tag or untag @p as a key task, returns whether it was one */
+static bool scx_set_key_task(struct task_struct *p, bool key)
+{
+	bool was = xchg(&scx_ext(p)->key, key);
+
+	if (was != key)
+		atomic_add(key ? 1 : -1, &scx_nr_key_tasks);
+	return was;
+}
+
+/* for /proc/hmbird_sched/key_task, tag the task with TID @pid */
+static int scx_set_key_pid(pid_t pid, bool key)
+{
+	struct task_struct *p;
+
+	rcu_read_lock();
+	p = find_task_by_vpid(pid);
+	if (p)
+		scx_set_key_task(p, key);
+	rcu_read_unlock();
+
+	return p ? 0 : -ESRCH;
+}
+
+/* for /proc/hmbird_sched/heartbeat, open a boost window of @frames frames */
+static void scx_key_heartbeat(int frames)
+{
+	int fps = READ_ONCE(sched_ravg_window_frame_per_sec);
+
+	if (!READ_ONCE(heartbeat_enable) || frames <= 0 || fps <= 0) {
+		WRITE_ONCE(scx_key_boost_until, 0);
+		return;
+	}
+
+	frames = min(frames, SCX_KEY_MAX_FRAMES);
+	WRITE_ONCE(scx_key_boost_until,
+		   sched_clock() + div_u64((u64)frames * NSEC_PER_SEC, fps));
+}
+
+/*
+ * Pick the key cluster, the highest capacity one other than the prime cluster.
+ * Called from scx_ops_enable() after scx_build_clusters().
+ */
+static void scx_key_build_cluster(void)
+{
+	int cl;
+
+	scx_key_cluster = -1;
+	for (cl = 0; cl < scx_nr_clusters; cl++) {
+		if (cl == scx_prime_cluster)
+			continue;
+		if (scx_key_cluster < 0 ||
+		    scx_cluster_cap[cl] > scx_cluster_cap[scx_key_cluster])
+			scx_key_cluster = cl;
+	}
+}
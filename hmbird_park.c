@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * hmbird_park: load driven core parking for sched_ext.
+ *
+ * With partial_ctrl set when the BPF scheduler is enabled, an evaluator runs
+ * every HMBIRD_PARK_PERIOD_MS and samples the busy ratio of each CPU. Parked
+ * CPUs aren't picked as idle CPUs and don't consume tasks from non-local DSQs
+ * which can run on an unparked CPU, so work is concentrated on fewer cores
+ * and the parked ones can stay in deep idle states.
+ *
+ * - Whole clusters other than the lowest capacity one are parked, highest
+ *   capacity first, while the average busy ratio of the unparked CPUs is below
+ *   cpuctrl_low and unparked again once it exceeds cpuctrl_high.
+ * - Within each unparked cluster, cores are parked one at a time while the
+ *   cluster's busy ratio is below parctrl_low_ratio and unparked above
+ *   parctrl_high_ratio. The lowest capacity cluster uses the _l ratios and
+ *   always keeps at least one core.
+ * - With isolate_ctrl set, parked CPUs are also isolated while the busiest
+ *   unparked CPU stays below isoctrl_low_ratio, until it exceeds
+ *   isoctrl_high_ratio. Isolated CPUs push the tasks on their local DSQ which
+ *   can run elsewhere to the global DSQ.
+ * - If iso_free_rescue is non-zero and a task waits longer than that many
+ *   usecs to run, everything is unparked for HMBIRD_PARK_RESCUE_HOLD periods.
+ *
+ * Parking is a placement preference. Tasks which can only run on parked CPUs
+ * still run there and the BPF scheduler can dispatch anywhere explicitly.
+ *
+ * The evaluator and the rescue from set_next_task_scx() compute the next state
+ * in hmbird_park_next and hmbird_iso_next under hmbird_park_lock and publish
+ * it by copying them to hmbird_parked_cpus and hmbird_isolated_cpus, which
+ * the scheduling paths read locklessly.
+ *
+ * Included from ext.c.
+ */
+
+#define HMBIRD_PARK_PERIOD_MS		20
+#define HMBIRD_PARK_RESCUE_HOLD		10	/* periods */
+
+struct hmbird_park_cpu {
+	u64			idle;
+	u64			wall;
+};
+
+static DEFINE_PER_CPU(struct hmbird_park_cpu, hmbird_park_cpu);
+static DEFINE_STATIC_KEY_FALSE(hmbird_park_enabled);
+static struct cpumask hmbird_parked_cpus;
+static struct cpumask hmbird_isolated_cpus;
+
+/* protects the state below, nests inside the rq lock in check_wait */
+static DEFINE_RAW_SPINLOCK(hmbird_park_lock);
+static struct cpumask hmbird_park_next;
+static struct cpumask hmbird_iso_next;
+static struct cpumask hmbird_park_scratch;
+static struct cpumask hmbird_park_kick;
+static bool hmbird_cluster_parked[SCX_MAX_CLUSTERS];
+static bool hmbird_isolating;
+static atomic_t hmbird_park_rescue_hold;
+static struct delayed_work hmbird_park_work;
+
+static s32 scx_pick_idle_cpu(const struct cpumask *cpus_allowed, s32 near_cpu);
+void scx_bpf_kick_cpu(s32 cpu, u64 flags);
+
+static bool hmbird_cpu_parked(s32 cpu)
+{
+	return static_branch_unlikely(&hmbird_park_enabled) &&
+		cpumask_test_cpu(cpu, &hmbird_parked_cpus);
+}
+
+static bool hmbird_cpu_isolated(s32 cpu)
+{
+	return static_branch_unlikely(&hmbird_park_enabled) &&
+		cpumask_test_cpu(cpu, &hmbird_isolated_cpus);
+}
+
+/* @p should be left to the unparked CPUs rather than run on @cpu */
+static bool hmbird_park_keep_off(struct task_struct *p, s32 cpu)
+{
+	int other;
+
+	if (!hmbird_cpu_parked(cpu) || scx_ops_disabling())
+		return false;
+
+	for_each_cpu(other, p->cpus_ptr)
+		if (!cpumask_test_cpu(other, &hmbird_parked_cpus) &&
+		    cpu_online(other))
+			return false;
+	return true;
+}
+
+/* bitmask of the clusters whose CPUs are all parked */
+static unsigned long hmbird_parked_clusters(void)
+{
+	unsigned long mask = 0;
+	int cl;
+
+	if (!static_branch_unlikely(&hmbird_park_enabled))
+		return 0;
+
+	for (cl = 0; cl < scx_nr_clusters; cl++)
+		if (cpumask_subset(&scx_cluster_cpus[cl], &hmbird_parked_cpus))
+			mask |= 1UL << cl;
+	return mask;
+}
+
+/* publish the next state, called with hmbird_park_lock held */
+static void hmbird_park_publish(void)
+{
+	lockdep_assert_held(&hmbird_park_lock);
+	cpumask_copy(&hmbird_parked_cpus, &hmbird_park_next);
+	cpumask_copy(&hmbird_isolated_cpus, &hmbird_iso_next);
+}
+
+static void hmbird_unpark_all(void)
+{
+	int cl;
+
+	lockdep_assert_held(&hmbird_park_lock);
+	cpumask_clear(&hmbird_iso_next);
+	cpumask_clear(&hmbird_park_next);
+	for (cl = 0; cl < SCX_MAX_CLUSTERS; cl++)
+		hmbird_cluster_parked[cl] = false;
+	hmbird_isolating = false;
+}
+
+/**
+ * hmbird_park_check_wait - Unpark everything if a task waited too long
+ * @wait: how long the task being switched to was runnable in nsecs
+ *
+ * Called from set_next_task_scx() with the rq locked. The parked CPUs get
+ * kicked so that they pick up the tasks waiting in the global DSQs.
+ */
+static void hmbird_park_check_wait(u64 wait)
+{
+	u64 thresh = READ_ONCE(iso_free_rescue);
+	unsigned long flags;
+	int cpu;
+
+	if (!static_branch_unlikely(&hmbird_park_enabled) || !thresh ||
+	    wait < thresh * NSEC_PER_USEC ||
+	    cpumask_empty(&hmbird_parked_cpus) ||
+	    atomic_xchg(&hmbird_park_rescue_hold, HMBIRD_PARK_RESCUE_HOLD))
+		return;
+
+	raw_spin_lock_irqsave(&hmbird_park_lock, flags);
+	cpumask_copy(&hmbird_park_scratch, &hmbird_park_next);
+	hmbird_unpark_all();
+	hmbird_park_publish();
+
+	for_each_cpu_and(cpu, &hmbird_park_scratch, cpu_online_mask)
+		scx_bpf_kick_cpu(cpu, 0);
+	raw_spin_unlock_irqrestore(&hmbird_park_lock, flags);
+}
+
+/*
+ * Idle and iowait time of @cpu in nsecs. Like get_cpu_idle_time(), which only
+ * exists with CONFIG_CPU_FREQ, uses the NOHZ idle accounting, which includes
+ * an idle period in progress, and falls back to kcpustat without NOHZ.
+ */
+static u64 hmbird_park_idle_ns(s32 cpu)
+{
+	u64 idle = get_cpu_idle_time_us(cpu, NULL);
+	struct kernel_cpustat kcs;
+
+	if (idle != -1ULL)
+		return (idle + get_cpu_iowait_time_us(cpu, NULL)) * NSEC_PER_USEC;
+
+	kcpustat_cpu_fetch(&kcs, cpu);
+	return kcs.cpustat[CPUTIME_IDLE] + kcs.cpustat[CPUTIME_IOWAIT];
+}
+
+/* busy percentage of @cpu since the last sample */
+static u32 hmbird_park_sample(s32 cpu)
+{
+	struct hmbird_park_cpu *pc = per_cpu_ptr(&hmbird_park_cpu, cpu);
+	u64 wall = ktime_get_ns(), idle = hmbird_park_idle_ns(cpu);
+	u64 dwall = wall - pc->wall, didle = idle - pc->idle;
+
+	pc->idle = idle;
+	pc->wall = wall;
+
+	if (!dwall || didle >= dwall)
+		return 0;
+	return div64_u64((dwall - didle) * 100, dwall);
+}
+
+/* unpark the parked CPUs of @cl, or one of them if !@all */
+static void hmbird_unpark_cluster(int cl, bool all)
+{
+	int cpu;
+
+	for_each_cpu_and(cpu, &scx_cluster_cpus[cl], &hmbird_park_next) {
+		__cpumask_clear_cpu(cpu, &hmbird_park_next);
+		__cpumask_clear_cpu(cpu, &hmbird_iso_next);
+		if (!all)
+			break;
+	}
+}
+
+static void hmbird_park_cores(int cl, u32 busy_sum, u32 nr_active, int home)
+{
+	u32 high = cl == home ? READ_ONCE(parctrl_high_ratio_l) :
+				READ_ONCE(parctrl_high_ratio);
+	u32 low = cl == home ? READ_ONCE(parctrl_low_ratio_l) :
+			       READ_ONCE(parctrl_low_ratio);
+	struct cpumask *active = &hmbird_park_scratch;
+
+	if (!nr_active)
+		return;
+
+	if (busy_sum > high * nr_active) {
+		hmbird_unpark_cluster(cl, false);
+		return;
+	}
+
+	/* park if the cluster would still be below high with one core less */
+	if (nr_active < 2 || busy_sum >= low * nr_active ||
+	    busy_sum >= high * (nr_active - 1))
+		return;
+
+	cpumask_andnot(active, &scx_cluster_cpus[cl], &hmbird_park_next);
+	cpumask_and(active, active, cpu_online_mask);
+	__cpumask_set_cpu(cpumask_last(active), &hmbird_park_next);
+}
+
+static void hmbird_park_workfn(struct work_struct *work)
+{
+	u32 busy_sum[SCX_MAX_CLUSTERS] = {}, nr_active[SCX_MAX_CLUSTERS] = {};
+	u32 sys_sum = 0, sys_nr = 0, max_busy = 0, busy;
+	int home = 0, cl, cpu, victim = -1;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&hmbird_park_lock, flags);
+	cpumask_clear(&hmbird_park_kick);
+
+	for_each_online_cpu(cpu) {
+		busy = hmbird_park_sample(cpu);
+		if (cpumask_test_cpu(cpu, &hmbird_park_next))
+			continue;
+
+		cl = scx_cpu_cluster_id(cpu);
+		busy_sum[cl] += busy;
+		nr_active[cl]++;
+		sys_sum += busy;
+		sys_nr++;
+		max_busy = max(max_busy, busy);
+	}
+
+	if (atomic_read(&hmbird_park_rescue_hold)) {
+		atomic_dec(&hmbird_park_rescue_hold);
+		hmbird_unpark_all();
+		goto out;
+	}
+
+	if (!sys_nr)
+		goto out;
+
+	for (cl = 1; cl < scx_nr_clusters; cl++)
+		if (scx_cluster_cap[cl] < scx_cluster_cap[home])
+			home = cl;
+
+	/*
+	 * Whole clusters. Unpark the lowest capacity parked cluster above
+	 * cpuctrl_high. Below cpuctrl_low, park the highest capacity unparked
+	 * one if the rest would stay below cpuctrl_high.
+	 */
+	if (sys_sum > READ_ONCE(cpuctrl_high_ratio) * sys_nr) {
+		for (cl = 0; cl < scx_nr_clusters; cl++)
+			if (hmbird_cluster_parked[cl] &&
+			    (victim < 0 || scx_cluster_cap[cl] < scx_cluster_cap[victim]))
+				victim = cl;
+		if (victim >= 0) {
+			hmbird_cluster_parked[victim] = false;
+			hmbird_unpark_cluster(victim, true);
+		}
+	} else if (sys_sum < READ_ONCE(cpuctrl_low_ratio) * sys_nr) {
+		for (cl = 0; cl < scx_nr_clusters; cl++)
+			if (cl != home && !hmbird_cluster_parked[cl] &&
+			    (victim < 0 || scx_cluster_cap[cl] > scx_cluster_cap[victim]))
+				victim = cl;
+		if (victim >= 0 && sys_nr > nr_active[victim] &&
+		    sys_sum < READ_ONCE(cpuctrl_high_ratio) *
+			      (sys_nr - nr_active[victim])) {
+			hmbird_cluster_parked[victim] = true;
+			cpumask_or(&hmbird_park_next, &hmbird_park_next,
+				   &scx_cluster_cpus[victim]);
+		}
+	}
+
+	/* cores of the unparked clusters */
+	for (cl = 0; cl < scx_nr_clusters; cl++)
+		if (!hmbird_cluster_parked[cl] && cl != victim)
+			hmbird_park_cores(cl, busy_sum[cl], nr_active[cl], home);
+
+	/* isolation, with hysteresis on the busiest unparked CPU */
+	if (!READ_ONCE(isolate_ctrl))
+		hmbird_isolating = false;
+	else if (hmbird_isolating)
+		hmbird_isolating = max_busy <= READ_ONCE(isoctrl_high_ratio);
+	else
+		hmbird_isolating = max_busy < READ_ONCE(isoctrl_low_ratio);
+
+	if (!hmbird_isolating) {
+		cpumask_clear(&hmbird_iso_next);
+		goto out;
+	}
+
+	/* kick the newly isolated CPUs so that they push their tasks away */
+	cpumask_and(&hmbird_park_kick, &hmbird_park_next, cpu_online_mask);
+	cpumask_andnot(&hmbird_park_kick, &hmbird_park_kick, &hmbird_iso_next);
+	cpumask_and(&hmbird_iso_next, &hmbird_iso_next, &hmbird_park_next);
+	cpumask_or(&hmbird_iso_next, &hmbird_iso_next, &hmbird_park_kick);
+out:
+	hmbird_park_publish();
+	for_each_cpu(cpu, &hmbird_park_kick)
+		scx_bpf_kick_cpu(cpu, SCX_KICK_PREEMPT);
+	raw_spin_unlock_irqrestore(&hmbird_park_lock, flags);
+
+	queue_delayed_work(system_power_efficient_wq, &hmbird_park_work,
+			   msecs_to_jiffies(HMBIRD_PARK_PERIOD_MS));
+}
+
+/*
+ * Called with cpus_read_lock() held on BPF scheduler enable and disable. No
+ * task is on SCX at either point.
+ */
+static void hmbird_park_enable(bool enable)
+{
+	unsigned long flags;
+	int cpu;
+
+	if (!enable || !READ_ONCE(partial_enable)) {
+		if (static_branch_unlikely(&hmbird_park_enabled)) {
+			static_branch_disable_cpuslocked(&hmbird_park_enabled);
+			cancel_delayed_work_sync(&hmbird_park_work);
+		}
+		raw_spin_lock_irqsave(&hmbird_park_lock, flags);
+		hmbird_unpark_all();
+		hmbird_park_publish();
+		raw_spin_unlock_irqrestore(&hmbird_park_lock, flags);
+		return;
+	}
+
+	raw_spin_lock_irqsave(&hmbird_park_lock, flags);
+	hmbird_unpark_all();
+	hmbird_park_publish();
+	for_each_possible_cpu(cpu)
+		hmbird_park_sample(cpu);
+	raw_spin_unlock_irqrestore(&hmbird_park_lock, flags);
+
+	atomic_set(&hmbird_park_rescue_hold, 0);
+
+	static_branch_enable_cpuslocked(&hmbird_park_enabled);
+	queue_delayed_work(system_power_efficient_wq, &hmbird_park_work,
+			   msecs_to_jiffies(HMBIRD_PARK_PERIOD_MS));
+}
@@ -47,15 +47,34 @@ int heartbeat_enable;
 int watchdog_enable;
 int save_gov;
 unsigned int cpu_cluster_masks;
+int gdsq_shard_ctrl;
+int gdsq_steal_order;
+int group_dsq_ctrl;
+int dsq_index_ctrl;
+int cap_select_ctrl;
+int slice_adapt_ctrl;
+int slice_min_us = 1000;
+int slice_max_us = 20000;
+int local_vtime_ctrl;
+int lat_hist_ctrl;
+int prio_heur_thresh = 120;
+int high_load_ratio = 2;
+int busy_load_ratio = 1;
+int interactive_wait_us = 10000;
+int dsp_retry_ctrl = 1;
+int dsp_retry_budget_us = 500;
+int dsp_coalesce_ctrl;
+int hmbird_trace_ctrl;
+int key_task_ctrl;
 
 char saved_gov[NR_CPUS][16];
 
 static int set_proc_buf_val(struct file *file, const char __user *buf, size_t count, int *val)
 {
-	char kbuf[5] = {0};
+	char kbuf[12] = {0};
 	int err;
 
-	if (count >= 5)
+	if (count >= sizeof(kbuf))
 		return -EFAULT;
 
 	if (copy_from_user(kbuf, buf, count)) {
@@ -137,58 +156,45 @@ static int hmbird_stats_proc_show(struct seq_file *m, void *v)
     	seq_printf(m, "global stat:%llu, %llu\n", total_nr_running, current_time);
     	seq_printf(m, "cpu_allow_fail:%d, %d\n", 0, online_cpus);
     	seq_printf(m, "rt_cnt:%llu, %llu\n", total_nr_switches, avg_load_per_cpu);
-    	seq_puts(m, "key_task_cnt:0, 0\n");
+    	seq_printf(m, "key_task_cnt:%d, %llu\n", atomic_read(&scx_nr_key_tasks),
+    		   scx_stat_sum(SCX_STAT_KEY_DSP));
+    	seq_printf(m, "key_boost_cnt:%llu\n", scx_stat_sum(SCX_STAT_KEY_BOOST));
     	seq_puts(m, "switch_idx:0, 0\n");
-    	seq_puts(m, "timeout_cnt:0, 0\n");
-    	seq_puts(m, "total_dsp_cnt:0, 0\n");
-    	seq_puts(m, "move_rq_cnt:0, 0\n");
-	seq_puts(m, "select_cpu:0, 0\n");
+    	seq_printf(m, "timeout_cnt:%llu, %llu\n", scx_stat_sum(SCX_STAT_TIMEOUT),
+    		   scx_stat_sum(SCX_STAT_NEAR_TIMEOUT));
+    	seq_printf(m, "timeout_sum:%llu\n", scx_stat_sum(SCX_STAT_TIMEOUT));
+    	seq_printf(m, "near_timeout_cnt:%llu\n", scx_stat_sum(SCX_STAT_NEAR_TIMEOUT));
+    	seq_printf(m, "total_dsp_cnt:%llu, %llu\n", scx_stat_sum(SCX_STAT_DSP),
+    		   scx_stat_sum(SCX_STAT_DSP_LOCAL));
+    	seq_printf(m, "move_rq_cnt:%llu, %llu\n", scx_stat_sum(SCX_STAT_CONSUME_REMOTE),
+    		   scx_stat_sum(SCX_STAT_CONSUME_LOCAL));
+    	seq_printf(m, "select_cpu:%llu, %llu\n", scx_stat_sum(SCX_STAT_SELECT_HIT),
+    		   scx_stat_sum(SCX_STAT_SELECT_MISS));
+    	seq_printf(m, "kick_cnt:%llu\n", scx_stat_sum(SCX_STAT_KICK));
     
-    	// Output gdsq_cnt array with enhanced statistics
-    	for (int i = 0; i < 10; i++) {
-        	if (i < online_cpus && i < NR_CPUS) {
-            		rq = cpu_rq(i);
-            		seq_printf(m, "gdsq_cnt[%d]:%lu, %lu\n", i, rq->nr_running, rq->nr_switches & 0xFFFF);
-        	} else {
-            		seq_printf(m, "gdsq_cnt[%d]:0, 0\n", i);
-        	}
-    	}
+    	/* dispatches and queued tasks, [0] is the global DSQ, then its shards */
+    	seq_printf(m, "gdsq_cnt[0]:%llu, %u\n", scx_stat_gdsq_sum(0),
+    		   READ_ONCE(scx_dsq_global.dsq.nr));
+    	for (int i = 0; i < SCX_MAX_CLUSTERS; i++)
+        	seq_printf(m, "gdsq_cnt[%d]:%llu, %u\n", i + 1,
+        		   scx_stat_gdsq_sum(i + 1),
+        		   READ_ONCE(scx_gdsq_shards[i].dsq.nr));
     
     	seq_puts(m, "err_idx:0, 0, 0, 0, 0\n");
     
-    	// 扩展 pcp_timeout_cnt 输出（增加索引6-7）
-    	for (int i = 0; i < 8; i++) {  // 从 6 扩大到 8
-        	if (i < online_cpus && i < NR_CPUS) {
-            		rq = cpu_rq(i);
-            		u64 cpu_util = (rq->nr_running > 0) ? (current_time % 1000) : 0;
-            		seq_printf(m, "pcp_timeout_cnt[%d]:%llu\n", i, cpu_util);
-        	} else {
-            		seq_printf(m, "pcp_timeout_cnt[%d]:0\n", i);
-        	}
-    	}
+    	for_each_possible_cpu(cpu)
+        	seq_printf(m, "pcp_timeout_cnt[%d]:%llu\n", cpu,
+        		   scx_stat_cpu(cpu, SCX_STAT_TIMEOUT));
     
-    	// 添加缺失的 pcp_ldsq_cnt 数组输出（索引0-7）
-    	for (int i = 0; i < 8; i++) {
-        	if (i < online_cpus && i < NR_CPUS) {
-            		rq = cpu_rq(i);
-            		u64 local_load = rq->nr_running;
-            		u64 cpu_freq_ratio = (current_time >> 10) % 100;  // 模拟频率比率
-            		seq_printf(m, "pcp_ldsq_cnt[%d]:%llu, %llu\n", i, local_load, cpu_freq_ratio);
-        	} else {
-            		seq_printf(m, "pcp_ldsq_cnt[%d]:0, 0\n", i);
-        	}
-    	}
+    	/* local DSQ dispatches and currently queued */
+    	for_each_possible_cpu(cpu)
+        	seq_printf(m, "pcp_ldsq_cnt[%d]:%llu, %u\n", cpu,
+        		   scx_stat_cpu(cpu, SCX_STAT_DSP_LOCAL),
+        		   READ_ONCE(cpu_rq(cpu)->scx->local_dsq.nr));
     
-    	// 添加缺失的 pcp_enql_cnt 数组输出（索引0-7）
-    	for (int i = 0; i < 8; i++) {
-        	if (i < online_cpus && i < NR_CPUS) {
-            		rq = cpu_rq(i);
-            		u64 enqueue_activity = (rq->nr_switches >> 8) & 0xFF;
-            		seq_printf(m, "pcp_enql_cnt[%d]:%llu\n", i, enqueue_activity);
-        	} else {
-            		seq_printf(m, "pcp_enql_cnt[%d]:0\n", i);
-        	}
-    	}
+    	for_each_possible_cpu(cpu)
+        	seq_printf(m, "pcp_enql_cnt[%d]:%llu\n", cpu,
+        		   scx_stat_cpu(cpu, SCX_STAT_ENQ));
     
     	// 增强的调度器状态变量输出
     	seq_printf(m, "SCX Enabled: %d\n", scx_enable);
@@ -227,6 +233,8 @@ static int hmbird_stats_proc_show(struct seq_file *m, void *v)
     	seq_printf(m, "CPU Control High Ratio: %d\n", cpuctrl_high_ratio);
     	seq_printf(m, "CPU Control Low Ratio: %d\n", cpuctrl_low_ratio);
     	seq_printf(m, "Isolation Control: %d\n", isolate_ctrl);
+    	seq_printf(m, "Parked CPUs: %*pbl\n", cpumask_pr_args(&hmbird_parked_cpus));
+    	seq_printf(m, "Isolated CPUs: %*pbl\n", cpumask_pr_args(&hmbird_isolated_cpus));
     	seq_printf(m, "Governor Control: %d\n", scx_gov_ctrl);
     
     	return 0;
@@ -254,6 +262,11 @@ HMBIRD_PROC_OPS(sched_ravg_window_frame_per_sec, hmbird_common_open,
 			sched_ravg_window_frame_per_sec_proc_write);
 /* sched_ravg_window_frame_per_sec ops end */
 
+/*
+ * Remember the governor of every policy so that it can be restored after
+ * switching to the "scx" governor of slim_freq_gov.c. Reading save_gov lists
+ * the saved governors.
+ */
 static ssize_t save_gov_str(struct file *file, const char __user *buf,
 					size_t count, loff_t *ppos)
 {
@@ -262,12 +275,36 @@ static ssize_t save_gov_str(struct file *file, const char __user *buf,
 
 	for_each_present_cpu(cpu) {
 		policy = cpufreq_cpu_get(cpu);
-		if (cpu != policy->cpu)
+		if (!policy)
 			continue;
+
+		down_read(&policy->rwsem);
+		if (cpu == policy->cpu && policy->governor)
+			strscpy(saved_gov[cpu], policy->governor->name,
+				sizeof(saved_gov[cpu]));
+		up_read(&policy->rwsem);
+
+		cpufreq_cpu_put(policy);
 	}
 	return count;
 }
-HMBIRD_PROC_OPS(save_gov, hmbird_common_open, save_gov_str);
+
+static int save_gov_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	for_each_present_cpu(cpu) {
+		if (saved_gov[cpu][0])
+			seq_printf(m, "policy%d: %s\n", cpu, saved_gov[cpu]);
+	}
+	return 0;
+}
+
+static int save_gov_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, save_gov_show, pde_data(inode));
+}
+HMBIRD_PROC_OPS(save_gov, save_gov_open, save_gov_str);
 
 static ssize_t cpu_cluster_proc_write(struct file *file, const char __user *buf,
 								size_t count, loff_t *ppos)
@@ -296,6 +333,164 @@ HMBIRD_PROC_OPS(slim_walt_ctrl, hmbird_common_open,
                         slim_walt_ctrl_write);
 /* slim_walt_ctrl ops end */
 
+/* interactive_wait_us ops begin */
+static ssize_t interactive_wait_us_write(struct file *file, const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	int *pval = (int *)pde_data(file_inode(file));
+	int val;
+
+	if (set_proc_buf_val(file, buf, count, &val))
+		return -EFAULT;
+
+	/* scaled to ns as u64 in ext.c, a negative wait would wrap */
+	if (val < 0)
+		return -EINVAL;
+
+	WRITE_ONCE(*pval, val);
+	return count;
+}
+HMBIRD_PROC_OPS(interactive_wait_us, hmbird_common_open,
+			interactive_wait_us_write);
+/* interactive_wait_us ops end */
+
+/* latency_hist ops begin */
+static ssize_t latency_hist_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	/* any write resets */
+	scx_lat_hist_reset();
+	return count;
+}
+
+static int latency_hist_show(struct seq_file *m, void *v)
+{
+	int i, b;
+
+	for (i = 0; i < SCX_NR_LATS; i++) {
+		seq_printf(m, "%s:\n", scx_lat_names[i]);
+		for (b = 0; b < SCX_LAT_NR_BUCKETS; b++) {
+			u64 cnt = scx_lat_hist_sum(i, b);
+
+			if (!cnt)
+				continue;
+			if (b == SCX_LAT_NR_BUCKETS - 1)
+				seq_printf(m, "  >= %llu ns: %llu\n", 1ULL << (b - 1), cnt);
+			else
+				seq_printf(m, "  < %llu ns: %llu\n", 1ULL << b, cnt);
+		}
+	}
+	return 0;
+}
+
+static int latency_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_hist_show, inode);
+}
+HMBIRD_PROC_OPS(latency_hist, latency_hist_open, latency_hist_write);
+/* latency_hist ops end */
+
+/* trace_ring ops begin */
+static int trace_ring_open(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+static const struct proc_ops trace_ring_proc_ops = {
+	.proc_open	= trace_ring_open,
+	.proc_mmap	= hmbird_trace_mmap,
+};
+/* trace_ring ops end */
+
+/* bench ops begin, see ext_bench.c */
+HMBIRD_PROC_OPS(scx_bench, scx_bench_open, scx_bench_write);
+/* bench ops end */
+
+/* ctrl_page ops begin */
+static int ctrl_page_open(struct inode *inode, struct file *file)
+{
+	return 0;
+}
+
+static const struct proc_ops ctrl_page_proc_ops = {
+	.proc_open	= ctrl_page_open,
+	.proc_mmap	= hmbird_shm_mmap,
+};
+/* ctrl_page ops end */
+
+/* key_task ops begin */
+/*
+ * Writing a positive TID tags the thread as a key task, its negation untags
+ * it. Reading shows the number of tagged threads.
+ */
+static ssize_t key_task_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	int pid, err;
+
+	if (set_proc_buf_val(file, buf, count, &pid))
+		return -EFAULT;
+
+	/* -INT_MIN doesn't fit in an int */
+	if (!pid || pid == INT_MIN)
+		return -EINVAL;
+
+	err = scx_set_key_pid(pid > 0 ? pid : -pid, pid > 0);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static int key_task_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%d\n", atomic_read(&scx_nr_key_tasks));
+	return 0;
+}
+
+static int key_task_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, key_task_show, inode);
+}
+HMBIRD_PROC_OPS(key_task, key_task_open, key_task_write);
+/* key_task ops end */
+
+/* heartbeat ops begin */
+static ssize_t heartbeat_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	int *pval = (int *)pde_data(file_inode(file));
+
+	if (set_proc_buf_val(file, buf, count, pval))
+		return -EFAULT;
+
+	/* frames in flight, see hmbird_key.c */
+	scx_key_heartbeat(*pval);
+	return count;
+}
+HMBIRD_PROC_OPS(heartbeat, hmbird_common_open, heartbeat_write);
+/* heartbeat ops end */
+
+/* slim_walt_dump ops begin */
+static int slim_walt_dump_show(struct seq_file *m, void *v)
+{
+	int cpu;
+
+	seq_printf(m, "enabled: %d window: %llu\n",
+		   static_branch_unlikely(&slim_walt_enabled), slim_walt_window);
+	for_each_possible_cpu(cpu)
+		seq_printf(m, "cpu%d util: %lu\n", cpu, slim_walt_cpu_util(cpu));
+
+	return 0;
+}
+
+static int slim_walt_dump_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, slim_walt_dump_show, pde_data(inode));
+}
+HMBIRD_PROC_OPS(slim_walt_dump, slim_walt_dump_open, hmbird_common_write);
+/* slim_walt_dump ops end */
+
 static int hmbird_proc_init(void)
 {
 	struct proc_dir_entry *hmbird_dir;
@@ -370,6 +565,112 @@ static int hmbird_proc_init(void)
 					&cpu_cluster_masks_proc_ops,
 					&cpu_cluster_masks);
 
+	HMBIRD_CREATE_PROC_ENTRY_DATA("gdsq_shard_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&gdsq_shard_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("gdsq_steal_order", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&gdsq_steal_order);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("group_dsq_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&group_dsq_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("dsq_index_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&dsq_index_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("cap_select_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&cap_select_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("slice_adapt_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&slice_adapt_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("slice_min_us", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&slice_min_us);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("slice_max_us", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&slice_max_us);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("local_vtime_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&local_vtime_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("lat_hist_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&lat_hist_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY("latency_hist", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&latency_hist_proc_ops);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("prio_heur_thresh", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&prio_heur_thresh);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("high_load_ratio", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&high_load_ratio);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("busy_load_ratio", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&busy_load_ratio);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("interactive_wait_us", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&interactive_wait_us_proc_ops,
+					&interactive_wait_us);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("dsp_retry_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&dsp_retry_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("dsp_retry_budget_us", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&dsp_retry_budget_us);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("dsp_coalesce_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&dsp_coalesce_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY_DATA("hmbird_trace_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&hmbird_trace_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY("trace_ring", 0444,
+					hmbird_dir,
+					&trace_ring_proc_ops);
+
+	HMBIRD_CREATE_PROC_ENTRY("ctrl_page", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&ctrl_page_proc_ops);
+
+	HMBIRD_CREATE_PROC_ENTRY("bench", 0600,
+					hmbird_dir,
+					&scx_bench_proc_ops);
+
 	HMBIRD_CREATE_PROC_ENTRY_DATA("save_gov", HMBIRD_PROC_PERMISSION,
 					hmbird_dir,
 					&save_gov_proc_ops,
@@ -377,7 +678,7 @@ static int hmbird_proc_init(void)
 
 	HMBIRD_CREATE_PROC_ENTRY_DATA("heartbeat", HMBIRD_PROC_PERMISSION,
 					hmbird_dir,
-					&hmbird_common_proc_ops,
+					&heartbeat_proc_ops,
 					&heartbeat);
 
 	HMBIRD_CREATE_PROC_ENTRY_DATA("heartbeat_enable", HMBIRD_PROC_PERMISSION,
@@ -385,6 +686,15 @@ static int hmbird_proc_init(void)
 					&hmbird_common_proc_ops,
 					&heartbeat_enable);
 
+	HMBIRD_CREATE_PROC_ENTRY_DATA("key_task_ctrl", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&hmbird_common_proc_ops,
+					&key_task_ctrl);
+
+	HMBIRD_CREATE_PROC_ENTRY("key_task", HMBIRD_PROC_PERMISSION,
+					hmbird_dir,
+					&key_task_proc_ops);
+
 	HMBIRD_CREATE_PROC_ENTRY_DATA("watchdog_enable", HMBIRD_PROC_PERMISSION,
 					hmbird_dir,
 					&hmbird_common_proc_ops,
@@ -450,7 +760,7 @@ static int hmbird_proc_init(void)
 
 	HMBIRD_CREATE_PROC_ENTRY_DATA("slim_walt_dump", HMBIRD_PROC_PERMISSION,
 					load_track_dir,
-					&hmbird_common_proc_ops,
+					&slim_walt_dump_proc_ops,
 					&slim_walt_dump);
 
 	HMBIRD_CREATE_PROC_ENTRY_DATA("slim_walt_policy", HMBIRD_PROC_PERMISSION,
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * hmbird_shm: the mmapped control page, see hmbird_shm.h for the protocol.
+ *
+ * Polling a proc file per tunable and parsing the hmbird_stats text costs a
+ * syscall and a parse each time. The control page carries the same state and
+ * takes tunable changes without any syscall. The page is allocated on the
+ * first mmap and kept afterwards. hmbird_shm_work refreshes it and applies the
+ * requested sets while it's mapped.
+ *
+ * Included from ext.c.
+ */
+#include "hmbird_shm.h"
+
+struct hmbird_shm_tunable_def {
+	int	*val;
+	int	min;
+	int	max;
+};
+
+#define SHM_BOOL(v)		{ &(v), 0, 1 }
+#define SHM_PCT(v)		{ &(v), 0, 100 }
+#define SHM_UINT(v)		{ &(v), 0, INT_MAX }
+#define SHM_RANGE(v, lo, hi)	{ &(v), (lo), (hi) }
+
+static const struct hmbird_shm_tunable_def
+hmbird_shm_tunables[HMBIRD_SHM_NR_TUNABLES] = {
+	[HMBIRD_SHM_PARTIAL_CTRL]		= SHM_BOOL(partial_enable),
+	[HMBIRD_SHM_CPUCTRL_HIGH]		= SHM_PCT(cpuctrl_high_ratio),
+	[HMBIRD_SHM_CPUCTRL_LOW]		= SHM_PCT(cpuctrl_low_ratio),
+	[HMBIRD_SHM_PARCTRL_HIGH_RATIO]		= SHM_PCT(parctrl_high_ratio),
+	[HMBIRD_SHM_PARCTRL_LOW_RATIO]		= SHM_PCT(parctrl_low_ratio),
+	[HMBIRD_SHM_PARCTRL_HIGH_RATIO_L]	= SHM_PCT(parctrl_high_ratio_l),
+	[HMBIRD_SHM_PARCTRL_LOW_RATIO_L]	= SHM_PCT(parctrl_low_ratio_l),
+	[HMBIRD_SHM_ISOCTRL_HIGH_RATIO]		= SHM_PCT(isoctrl_high_ratio),
+	[HMBIRD_SHM_ISOCTRL_LOW_RATIO]		= SHM_PCT(isoctrl_low_ratio),
+	[HMBIRD_SHM_ISOLATE_CTRL]		= SHM_BOOL(isolate_ctrl),
+	[HMBIRD_SHM_ISO_FREE_RESCUE]		= SHM_UINT(iso_free_rescue),
+	[HMBIRD_SHM_MISFIT_DS]			= SHM_PCT(misfit_ds),
+	[HMBIRD_SHM_CPU7_TL]			= SHM_PCT(cpu7_tl),
+	[HMBIRD_SHM_HEARTBEAT]			= SHM_UINT(heartbeat),
+	[HMBIRD_SHM_HEARTBEAT_ENABLE]		= SHM_BOOL(heartbeat_enable),
+	[HMBIRD_SHM_KEY_TASK_CTRL]		= SHM_BOOL(key_task_ctrl),
+	[HMBIRD_SHM_GDSQ_SHARD_CTRL]		= SHM_BOOL(gdsq_shard_ctrl),
+	[HMBIRD_SHM_GDSQ_STEAL_ORDER]		= SHM_RANGE(gdsq_steal_order, 0,
+							    SCX_STEAL_LITTLE_FIRST),
+	[HMBIRD_SHM_GROUP_DSQ_CTRL]		= SHM_BOOL(group_dsq_ctrl),
+	[HMBIRD_SHM_DSQ_INDEX_CTRL]		= SHM_BOOL(dsq_index_ctrl),
+	[HMBIRD_SHM_CAP_SELECT_CTRL]		= SHM_BOOL(cap_select_ctrl),
+	[HMBIRD_SHM_SLICE_ADAPT_CTRL]		= SHM_BOOL(slice_adapt_ctrl),
+	[HMBIRD_SHM_SLICE_MIN_US]		= SHM_UINT(slice_min_us),
+	[HMBIRD_SHM_SLICE_MAX_US]		= SHM_UINT(slice_max_us),
+	/* a CPU mask, -1 selects all CPUs */
+	[HMBIRD_SHM_LOCAL_VTIME_CTRL]		= SHM_RANGE(local_vtime_ctrl,
+							    INT_MIN, INT_MAX),
+	[HMBIRD_SHM_LAT_HIST_CTRL]		= SHM_BOOL(lat_hist_ctrl),
+	[HMBIRD_SHM_PRIO_HEUR_THRESH]		= SHM_RANGE(prio_heur_thresh, 0,
+							    MAX_PRIO),
+	[HMBIRD_SHM_HIGH_LOAD_RATIO]		= SHM_UINT(high_load_ratio),
+	[HMBIRD_SHM_BUSY_LOAD_RATIO]		= SHM_UINT(busy_load_ratio),
+	[HMBIRD_SHM_INTERACTIVE_WAIT_US]	= SHM_UINT(interactive_wait_us),
+	[HMBIRD_SHM_DSP_RETRY_CTRL]		= SHM_BOOL(dsp_retry_ctrl),
+	[HMBIRD_SHM_DSP_RETRY_BUDGET_US]	= SHM_UINT(dsp_retry_budget_us),
+	[HMBIRD_SHM_DSP_COALESCE_CTRL]		= SHM_BOOL(dsp_coalesce_ctrl),
+	[HMBIRD_SHM_HMBIRD_TRACE_CTRL]		= SHM_BOOL(hmbird_trace_ctrl),
+	[HMBIRD_SHM_SLIM_WALT_CTRL]		= SHM_BOOL(slim_walt_ctrl),
+	[HMBIRD_SHM_SLIM_WALT_POLICY]		= SHM_RANGE(slim_walt_policy, 0,
+							    WINDOW_STATS_INVALID_POLICY - 1),
+	[HMBIRD_SHM_FRAME_PER_SEC]		=
+		SHM_UINT(sched_ravg_window_frame_per_sec),
+	[HMBIRD_SHM_SCX_GOV_CTRL]		= SHM_BOOL(scx_gov_ctrl),
+	[HMBIRD_SHM_SLIM_GOV_DEBUG]		= SHM_BOOL(slim_gov_debug),
+};
+
+static struct hmbird_shm *hmbird_shm;
+static DEFINE_MUTEX(hmbird_shm_mutex);
+static int hmbird_shm_nr_maps;		/* protected by hmbird_shm_mutex */
+static struct delayed_work hmbird_shm_work;
+
+/* apply the requested set if userspace published a new one */
+static void hmbird_shm_apply(struct hmbird_shm *shm)
+{
+	u32 seq = smp_load_acquire(&shm->hdr.req_seq);
+	s32 req[HMBIRD_SHM_NR_TUNABLES];
+	int i, err = 0;
+
+	if (seq == READ_ONCE(shm->hdr.ack_seq))
+		return;
+
+	memcpy(req, shm->req, sizeof(req));
+
+	/* userspace is still filling in the next set, retry on the next period */
+	smp_rmb();
+	if (READ_ONCE(shm->hdr.req_seq) != seq)
+		return;
+
+	for (i = 0; i < HMBIRD_SHM_NR_TUNABLES; i++) {
+		const struct hmbird_shm_tunable_def *def = &hmbird_shm_tunables[i];
+
+		/* a value left as is is fine even if set out of range via proc */
+		if (req[i] == READ_ONCE(*def->val))
+			continue;
+		if (req[i] < def->min || req[i] > def->max) {
+			err = -EINVAL;
+			break;
+		}
+	}
+
+	if (!err) {
+		bool beat = req[HMBIRD_SHM_HEARTBEAT] != READ_ONCE(heartbeat);
+
+		for (i = 0; i < HMBIRD_SHM_NR_TUNABLES; i++)
+			WRITE_ONCE(*hmbird_shm_tunables[i].val, req[i]);
+		if (beat)
+			scx_key_heartbeat(req[HMBIRD_SHM_HEARTBEAT]);
+	}
+
+	WRITE_ONCE(shm->hdr.ack_err, err);
+	smp_store_release(&shm->hdr.ack_seq, seq);
+}
+
+static void hmbird_shm_snapshot(struct hmbird_shm *shm)
+{
+	u32 seq = shm->hdr.stats_seq;
+	int cpu, i;
+
+	for (i = 0; i < HMBIRD_SHM_NR_TUNABLES; i++)
+		WRITE_ONCE(shm->cur[i], READ_ONCE(*hmbird_shm_tunables[i].val));
+
+	/* pairs with the reader's acquire load of stats_seq */
+	WRITE_ONCE(shm->hdr.stats_seq, seq + 1);
+	smp_wmb();
+
+	for_each_possible_cpu(cpu) {
+		struct hmbird_shm_cpu_stats *cs;
+
+		if (cpu >= HMBIRD_SHM_MAX_CPUS)
+			break;
+
+		cs = &shm->cpu[cpu];
+		for (i = 0; i < HMBIRD_SHM_NR_STATS; i++)
+			cs->cnt[i] = scx_stat_cpu(cpu, i);
+		cs->nr_running = READ_ONCE(cpu_rq(cpu)->nr_running);
+		cs->local_dsq_nr = READ_ONCE(cpu_rq(cpu)->scx->local_dsq.nr);
+	}
+	shm->hdr.stats_ts = sched_clock();
+	shm->hdr.nr_key_tasks = atomic_read(&scx_nr_key_tasks);
+
+	smp_store_release(&shm->hdr.stats_seq, seq + 2);
+}
+
+static void hmbird_shm_workfn(struct work_struct *work)
+{
+	hmbird_shm_apply(hmbird_shm);
+	hmbird_shm_snapshot(hmbird_shm);
+
+	queue_delayed_work(system_power_efficient_wq, &hmbird_shm_work,
+			   msecs_to_jiffies(HMBIRD_SHM_PERIOD_MS));
+}
+
+static int hmbird_shm_alloc(void)
+{
+	struct hmbird_shm *shm;
+
+	BUILD_BUG_ON(sizeof(struct hmbird_shm) > PAGE_SIZE);
+	BUILD_BUG_ON(HMBIRD_SHM_NR_TUNABLES > HMBIRD_SHM_MAX_TUNABLES);
+	BUILD_BUG_ON(HMBIRD_SHM_NR_STATS > HMBIRD_SHM_MAX_STATS);
+	BUILD_BUG_ON(HMBIRD_SHM_NR_STATS != SCX_NR_STATS);
+
+	if (hmbird_shm)
+		return 0;
+
+	shm = vmalloc_user(PAGE_SIZE);
+	if (!shm)
+		return -ENOMEM;
+
+	shm->hdr.magic = HMBIRD_SHM_MAGIC;
+	shm->hdr.version = HMBIRD_SHM_VERSION;
+	shm->hdr.size = sizeof(struct hmbird_shm);
+	shm->hdr.nr_tunables = HMBIRD_SHM_NR_TUNABLES;
+	shm->hdr.nr_stats = HMBIRD_SHM_NR_STATS;
+	shm->hdr.nr_cpus = min_t(u32, nr_cpu_ids, HMBIRD_SHM_MAX_CPUS);
+	hmbird_shm_snapshot(shm);
+	memcpy(shm->req, shm->cur, sizeof(shm->req));
+
+	INIT_DEFERRABLE_WORK(&hmbird_shm_work, hmbird_shm_workfn);
+	hmbird_shm = shm;
+	return 0;
+}
+
+static void hmbird_shm_vm_open(struct vm_area_struct *vma)
+{
+	mutex_lock(&hmbird_shm_mutex);
+	if (!hmbird_shm_nr_maps++)
+		queue_delayed_work(system_power_efficient_wq, &hmbird_shm_work, 0);
+	mutex_unlock(&hmbird_shm_mutex);
+}
+
+static void hmbird_shm_vm_close(struct vm_area_struct *vma)
+{
+	mutex_lock(&hmbird_shm_mutex);
+	if (!--hmbird_shm_nr_maps)
+		cancel_delayed_work_sync(&hmbird_shm_work);
+	mutex_unlock(&hmbird_shm_mutex);
+}
+
+static const struct vm_operations_struct hmbird_shm_vm_ops = {
+	.open		= hmbird_shm_vm_open,
+	.close		= hmbird_shm_vm_close,
+};
+
+/* map the control page read-write, offset 0 only */
+static int hmbird_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1 ||
+	    !(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&hmbird_shm_mutex);
+	ret = hmbird_shm_alloc();
+	mutex_unlock(&hmbird_shm_mutex);
+	if (ret)
+		return ret;
+
+	ret = remap_vmalloc_range(vma, hmbird_shm, 0);
+	if (ret)
+		return ret;
+
+	vma->vm_ops = &hmbird_shm_vm_ops;
+	hmbird_shm_vm_open(vma);
+	return 0;
+}
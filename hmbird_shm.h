@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * Layout of the HMBird control page, shared with userspace.
+ *
+ * /proc/hmbird_sched/ctrl_page is mmapped read-write as a single page holding
+ * struct hmbird_shm. While it's mapped, the kernel refreshes it every
+ * HMBIRD_SHM_PERIOD_MS:
+ *
+ * - cur[] holds the current value of every tunable in enum hmbird_shm_tunable,
+ *   including the changes made through the individual proc files.
+ *
+ * - To change tunables, fill all of req[], usually starting from a copy of
+ *   cur[], and then increment req_seq with release semantics. The kernel
+ *   applies the whole set in one go, or none of it if any changed value is
+ *   out of the range of its tunable, and then stores req_seq to ack_seq with
+ *   release semantics and the result to ack_err. Don't touch req[] until
+ *   ack_seq catches up. Values equal to the current ones are always accepted,
+ *   so a copy of cur[] with one field edited only fails if that field is out
+ *   of range.
+ *
+ * - cpu[] is a snapshot of the per-CPU counters and queue lengths protected
+ *   by stats_seq, which is odd while the snapshot is being updated. A reader
+ *   loads stats_seq with acquire semantics, retries while it's odd, copies the
+ *   snapshot and retries if stats_seq changed in the meantime.
+ *
+ * Fields are only ever appended, a reader should check version and the nr_*
+ * fields of the header.
+ */
+#ifndef __HMBIRD_SHM_H
+#define __HMBIRD_SHM_H
+
+#include <linux/types.h>
+
+#define HMBIRD_SHM_MAGIC	0x48424d53	/* "HBMS" */
+#define HMBIRD_SHM_VERSION	1
+#define HMBIRD_SHM_PERIOD_MS	4
+#define HMBIRD_SHM_MAX_TUNABLES	64
+#define HMBIRD_SHM_MAX_STATS	16
+#define HMBIRD_SHM_MAX_CPUS	16
+
+/* named after the proc files */
+enum hmbird_shm_tunable {
+	HMBIRD_SHM_PARTIAL_CTRL,
+	HMBIRD_SHM_CPUCTRL_HIGH,
+	HMBIRD_SHM_CPUCTRL_LOW,
+	HMBIRD_SHM_PARCTRL_HIGH_RATIO,
+	HMBIRD_SHM_PARCTRL_LOW_RATIO,
+	HMBIRD_SHM_PARCTRL_HIGH_RATIO_L,
+	HMBIRD_SHM_PARCTRL_LOW_RATIO_L,
+	HMBIRD_SHM_ISOCTRL_HIGH_RATIO,
+	HMBIRD_SHM_ISOCTRL_LOW_RATIO,
+	HMBIRD_SHM_ISOLATE_CTRL,
+	HMBIRD_SHM_ISO_FREE_RESCUE,
+	HMBIRD_SHM_MISFIT_DS,
+	HMBIRD_SHM_CPU7_TL,
+	HMBIRD_SHM_HEARTBEAT,		/* changing it reopens the boost window */
+	HMBIRD_SHM_HEARTBEAT_ENABLE,
+	HMBIRD_SHM_KEY_TASK_CTRL,
+	HMBIRD_SHM_GDSQ_SHARD_CTRL,
+	HMBIRD_SHM_GDSQ_STEAL_ORDER,
+	HMBIRD_SHM_GROUP_DSQ_CTRL,
+	HMBIRD_SHM_DSQ_INDEX_CTRL,
+	HMBIRD_SHM_CAP_SELECT_CTRL,
+	HMBIRD_SHM_SLICE_ADAPT_CTRL,
+	HMBIRD_SHM_SLICE_MIN_US,
+	HMBIRD_SHM_SLICE_MAX_US,
+	HMBIRD_SHM_LOCAL_VTIME_CTRL,
+	HMBIRD_SHM_LAT_HIST_CTRL,
+	HMBIRD_SHM_PRIO_HEUR_THRESH,
+	HMBIRD_SHM_HIGH_LOAD_RATIO,
+	HMBIRD_SHM_BUSY_LOAD_RATIO,
+	HMBIRD_SHM_INTERACTIVE_WAIT_US,
+	HMBIRD_SHM_DSP_RETRY_CTRL,
+	HMBIRD_SHM_DSP_RETRY_BUDGET_US,
+	HMBIRD_SHM_DSP_COALESCE_CTRL,
+	HMBIRD_SHM_HMBIRD_TRACE_CTRL,
+	HMBIRD_SHM_SLIM_WALT_CTRL,
+	HMBIRD_SHM_SLIM_WALT_POLICY,
+	HMBIRD_SHM_FRAME_PER_SEC,
+	HMBIRD_SHM_SCX_GOV_CTRL,
+	HMBIRD_SHM_SLIM_GOV_DEBUG,
+	HMBIRD_SHM_NR_TUNABLES,
+};
+
+/* indices into hmbird_shm_cpu_stats.cnt[] */
+enum hmbird_shm_stat {
+	HMBIRD_SHM_STAT_ENQ,
+	HMBIRD_SHM_STAT_DSP,
+	HMBIRD_SHM_STAT_DSP_LOCAL,
+	HMBIRD_SHM_STAT_CONSUME_LOCAL,
+	HMBIRD_SHM_STAT_CONSUME_REMOTE,
+	HMBIRD_SHM_STAT_SELECT_HIT,
+	HMBIRD_SHM_STAT_SELECT_MISS,
+	HMBIRD_SHM_STAT_TIMEOUT,
+	HMBIRD_SHM_STAT_NEAR_TIMEOUT,
+	HMBIRD_SHM_STAT_KICK,
+	HMBIRD_SHM_STAT_KEY_DSP,
+	HMBIRD_SHM_STAT_KEY_BOOST,
+	HMBIRD_SHM_NR_STATS,
+};
+
+struct hmbird_shm_hdr {
+	__u32	magic;		/* HMBIRD_SHM_MAGIC */
+	__u32	version;	/* HMBIRD_SHM_VERSION */
+	__u32	size;		/* sizeof(struct hmbird_shm) */
+	__u32	nr_tunables;	/* HMBIRD_SHM_NR_TUNABLES */
+	__u32	nr_stats;	/* HMBIRD_SHM_NR_STATS */
+	__u32	nr_cpus;	/* valid entries of cpu[] */
+
+	/* written by userspace */
+	__u32	req_seq;
+
+	/* written by the kernel */
+	__u32	ack_seq;
+	__s32	ack_err;	/* 0 or -EINVAL */
+	__u32	stats_seq;
+	__u64	stats_ts;	/* sched_clock() of the snapshot */
+	__s32	nr_key_tasks;
+	__u32	__pad;
+};
+
+struct hmbird_shm_cpu_stats {
+	__u64	cnt[HMBIRD_SHM_MAX_STATS];	/* enum hmbird_shm_stat */
+	__u32	nr_running;
+	__u32	local_dsq_nr;
+};
+
+struct hmbird_shm {
+	struct hmbird_shm_hdr		hdr;
+	__s32				cur[HMBIRD_SHM_MAX_TUNABLES];
+	__s32				req[HMBIRD_SHM_MAX_TUNABLES];
+	struct hmbird_shm_cpu_stats	cpu[HMBIRD_SHM_MAX_CPUS];
+};
+
+#endif /* __HMBIRD_SHM_H */
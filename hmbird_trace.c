@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * hmbird_trace: per-CPU binary event rings, see hmbird_trace.h for the layout.
+ *
+ * Fixed-size records are written with IRQs disabled on the local CPU only, so
+ * tracing can stay on in field builds without formatting cost or cross-CPU
+ * synchronization. The rings are allocated the first time the BPF scheduler
+ * is enabled with hmbird_trace_ctrl set and are kept afterwards, so that
+ * existing mappings stay valid.
+ *
+ * Included from ext.c.
+ */
+#include "hmbird_trace.h"
+
+#define HMBIRD_TRACE_NR_RECS						\
+	((HMBIRD_TRACE_RING_PAGES - 1) * PAGE_SIZE / sizeof(struct hmbird_trace_rec))
+
+static DEFINE_PER_CPU(struct hmbird_trace_hdr *, hmbird_trace_ring);
+static DEFINE_STATIC_KEY_FALSE(hmbird_trace_enabled);
+
+static struct hmbird_trace_rec *hmbird_trace_recs(struct hmbird_trace_hdr *hdr)
+{
+	return (void *)hdr + PAGE_SIZE;
+}
+
+static void __hmbird_trace(enum hmbird_trace_type type, s32 pid, u64 dsq_id,
+			   u32 arg)
+{
+	struct hmbird_trace_hdr *hdr;
+	struct hmbird_trace_rec *rec;
+	unsigned long flags;
+	u64 head;
+
+	local_irq_save(flags);
+
+	hdr = __this_cpu_read(hmbird_trace_ring);
+	if (unlikely(!hdr))
+		goto out;
+
+	head = hdr->head;
+	rec = &hmbird_trace_recs(hdr)[head & (HMBIRD_TRACE_NR_RECS - 1)];
+	rec->ts = sched_clock();
+	rec->dsq_id = dsq_id;
+	rec->pid = pid;
+	rec->arg = arg;
+	rec->cpu = smp_processor_id();
+	rec->type = type;
+	rec->__pad = 0;		/* the ring is mapped to userspace */
+
+	/* pairs with the reader's acquire load of head */
+	smp_store_release(&hdr->head, head + 1);
+out:
+	local_irq_restore(flags);
+}
+
+static __always_inline void hmbird_trace(enum hmbird_trace_type type,
+					 const struct task_struct *p,
+					 u64 dsq_id, u32 arg)
+{
+	if (static_branch_unlikely(&hmbird_trace_enabled))
+		__hmbird_trace(type, p ? p->pid : -1, dsq_id, arg);
+}
+
+static int hmbird_trace_alloc(void)
+{
+	int cpu;
+
+	BUILD_BUG_ON_NOT_POWER_OF_2(HMBIRD_TRACE_NR_RECS);
+
+	for_each_possible_cpu(cpu) {
+		struct hmbird_trace_hdr *hdr;
+
+		if (per_cpu(hmbird_trace_ring, cpu))
+			continue;
+
+		hdr = vmalloc_user(HMBIRD_TRACE_RING_PAGES * PAGE_SIZE);
+		if (!hdr)
+			return -ENOMEM;
+
+		hdr->nr_recs = HMBIRD_TRACE_NR_RECS;
+		hdr->rec_size = sizeof(struct hmbird_trace_rec);
+		WRITE_ONCE(per_cpu(hmbird_trace_ring, cpu), hdr);
+	}
+	return 0;
+}
+
+/* called with cpus_read_lock() held on BPF scheduler enable and disable */
+static void hmbird_trace_enable(bool enable)
+{
+	if (!enable || !READ_ONCE(hmbird_trace_ctrl)) {
+		static_branch_disable_cpuslocked(&hmbird_trace_enabled);
+		return;
+	}
+
+	if (hmbird_trace_alloc()) {
+		pr_warn("hmbird_trace: failed to allocate the trace rings\n");
+		return;
+	}
+
+	static_branch_enable_cpuslocked(&hmbird_trace_enabled);
+}
+
+/* map the ring of the CPU selected by the page offset read-only */
+static int hmbird_trace_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long cpu = vma->vm_pgoff / HMBIRD_TRACE_RING_PAGES;
+	struct hmbird_trace_hdr *hdr;
+
+	if (vma->vm_pgoff % HMBIRD_TRACE_RING_PAGES ||
+	    vma_pages(vma) != HMBIRD_TRACE_RING_PAGES ||
+	    cpu >= nr_cpu_ids || !cpu_possible(cpu))
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	hdr = READ_ONCE(per_cpu(hmbird_trace_ring, cpu));
+	if (!hdr)
+		return -ENODEV;
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+	return remap_vmalloc_range(vma, hdr, 0);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * Layout of the HMBird per-CPU trace rings, shared with userspace.
+ *
+ * Each CPU has a ring of HMBIRD_TRACE_RING_PAGES pages which is mmapped
+ * read-only from /proc/hmbird_sched/trace_ring at page offset
+ * cpu * HMBIRD_TRACE_RING_PAGES. The first page holds struct
+ * hmbird_trace_hdr, the rest an array of struct hmbird_trace_rec indexed by
+ * sequence number modulo nr_recs.
+ *
+ * The kernel writes a record and then increments head with release semantics.
+ * A reader loads head with acquire semantics, copies the records in
+ * [max(tail, head - nr_recs), head), then reloads head and drops the copied
+ * records below the new head - nr_recs, as they may have been overwritten
+ * while being copied.
+ */
+#ifndef __HMBIRD_TRACE_H
+#define __HMBIRD_TRACE_H
+
+#include <linux/types.h>
+
+#define HMBIRD_TRACE_RING_PAGES	17	/* header page and 16 record pages */
+
+enum hmbird_trace_type {
+	HMBIRD_TRACE_ENQUEUE,		/* arg: enq_flags low 32 bits */
+	HMBIRD_TRACE_DISPATCH,		/* dsq_id: target DSQ */
+	HMBIRD_TRACE_CONSUME,		/* dsq_id: source DSQ, arg: source CPU */
+	HMBIRD_TRACE_SELECT_CPU,	/* arg: selected CPU */
+	HMBIRD_TRACE_KICK,		/* arg: kicked CPU, dsq_id: SCX_KICK_* */
+	HMBIRD_TRACE_LONG_BALANCE,	/* arg: ns spent in balance */
+	HMBIRD_TRACE_HIGH_PRIO_DSP,	/* arg: ns finish_dispatch() took */
+	HMBIRD_TRACE_HIGH_PRIO_WAIT,	/* arg: ns waited before running */
+	HMBIRD_TRACE_SHADOW_TICK,	/* arg: ns of slice left */
+	HMBIRD_TRACE_GOV_FREQ,		/* dsq_id: policy CPU, arg: kHz */
+	HMBIRD_TRACE_NR_TYPES,
+};
+
+struct hmbird_trace_hdr {
+	__u64	head;		/* sequence number of the next record */
+	__u32	nr_recs;	/* power of two */
+	__u32	rec_size;	/* sizeof(struct hmbird_trace_rec) */
+};
+
+struct hmbird_trace_rec {
+	__u64	ts;		/* sched_clock() */
+	__u64	dsq_id;
+	__s32	pid;		/* -1 if not task related */
+	__u32	arg;
+	__u16	cpu;		/* CPU which recorded the event */
+	__u16	type;		/* enum hmbird_trace_type */
+	__u32	__pad;
+};
+
+#endif /* __HMBIRD_TRACE_H */
@@ -6,5 +6,34 @@ extern unsigned int highres_tick_ctrl_dbg;
 
 extern noinline int tracing_mark_write(const char *buf);
 
+/* slim_walt, see slim_walt.c */
+extern int slim_walt_ctrl;
+extern int slim_walt_policy;
+extern int sched_ravg_window_frame_per_sec;
+
+#define RAVG_HIST_SIZE		5
+
+enum task_event {
+	PUT_PREV_TASK,
+	PICK_NEXT_TASK,
+	TASK_WAKE,
+	TASK_UPDATE,
+};
+
+enum slim_walt_policy {
+	WINDOW_STATS_RECENT,
+	WINDOW_STATS_MAX,
+	WINDOW_STATS_MAX_RECENT_AVG,
+	WINDOW_STATS_AVG,
+	WINDOW_STATS_INVALID_POLICY,
+};
+
+struct slim_walt_task {
+	u64	mark_start;
+	u32	sum;
+	u32	sum_history[RAVG_HIST_SIZE];
+	u32	demand;
+	u16	demand_scaled;
+};
 
 #endif
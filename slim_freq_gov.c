@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * slim_freq_gov: the "scx" cpufreq governor.
+ *
+ * schedutil derives frequency requests from PELT, which isn't maintained for
+ * SCX tasks. This governor uses the per-CPU slim_walt utilization of the last
+ * frame window instead, on top of the CFS and RT utilization for the tasks
+ * which aren't on SCX, and re-evaluates once per window. Without slim_walt it
+ * degrades to a PELT based governor so that it stays sane when the BPF
+ * scheduler goes away before userspace restores the governor saved through
+ * /proc/hmbird_sched/save_gov.
+ *
+ * Setting scx_gov_ctrl to 0 freezes the frequency requests.
+ */
+
+struct scx_gov_policy {
+	struct cpufreq_policy	*policy;
+
+	raw_spinlock_t		update_lock;
+	u64			last_update;
+	unsigned int		next_freq;
+
+	/* slow path for drivers which can't switch from scheduler context */
+	bool			work_in_progress;
+	struct irq_work		irq_work;
+	struct work_struct	work;
+	struct mutex		work_lock;
+};
+
+struct scx_gov_cpu {
+	struct update_util_data	update_util;
+	struct scx_gov_policy	*gp;
+};
+
+static DEFINE_PER_CPU(struct scx_gov_cpu, scx_gov_cpu);
+
+static unsigned long scx_gov_cpu_util(int cpu)
+{
+	unsigned long util = cpu_util_cfs(cpu) + cpu_util_rt(cpu_rq(cpu));
+
+	if (static_branch_unlikely(&slim_walt_enabled))
+		util += slim_walt_cpu_util(cpu);
+
+	return min(util, arch_scale_cpu_capacity(cpu));
+}
+
+/* like schedutil, request 1.25 times the frequency needed to fit @util */
+static unsigned int scx_gov_next_freq(struct cpufreq_policy *policy,
+				      unsigned long util, unsigned long max)
+{
+	unsigned long freq = policy->cpuinfo.max_freq;
+
+	freq = (freq + (freq >> 2)) * util / max;
+	return cpufreq_driver_resolve_freq(policy, freq);
+}
+
+static void scx_gov_update(struct update_util_data *data, u64 time,
+			   unsigned int flags)
+{
+	struct scx_gov_cpu *gc = container_of(data, struct scx_gov_cpu, update_util);
+	struct scx_gov_policy *gp = gc->gp;
+	struct cpufreq_policy *policy = gp->policy;
+	unsigned long util = 0, max = 1;
+	unsigned int freq;
+	int cpu;
+
+	if (!READ_ONCE(scx_gov_ctrl) || !cpufreq_this_cpu_can_update(policy))
+		return;
+
+	raw_spin_lock(&gp->update_lock);
+
+	/* evaluate once per frame window */
+	if (time < gp->last_update + READ_ONCE(slim_walt_window))
+		goto out_unlock;
+	gp->last_update = time;
+
+	/* the CPU with the highest util to capacity ratio decides */
+	for_each_cpu(cpu, policy->cpus) {
+		unsigned long cap = arch_scale_cpu_capacity(cpu);
+		unsigned long cpu_util = scx_gov_cpu_util(cpu);
+
+		if (cpu_util * max >= util * cap) {
+			util = cpu_util;
+			max = cap;
+		}
+	}
+
+	freq = scx_gov_next_freq(policy, util, max);
+
+	if (unlikely(READ_ONCE(slim_gov_debug)))
+		hmbird_trace(HMBIRD_TRACE_GOV_FREQ, NULL, policy->cpu, freq);
+
+	if (freq == gp->next_freq)
+		goto out_unlock;
+	gp->next_freq = freq;
+
+	if (policy->fast_switch_enabled) {
+		cpufreq_driver_fast_switch(policy, freq);
+	} else if (!gp->work_in_progress) {
+		/* can't queue work while holding the rq lock, bounce */
+		gp->work_in_progress = true;
+		irq_work_queue(&gp->irq_work);
+	}
+
+out_unlock:
+	raw_spin_unlock(&gp->update_lock);
+}
+
+static void scx_gov_work(struct work_struct *work)
+{
+	struct scx_gov_policy *gp = container_of(work, struct scx_gov_policy, work);
+	unsigned long flags;
+	unsigned int freq;
+
+	raw_spin_lock_irqsave(&gp->update_lock, flags);
+	freq = gp->next_freq;
+	gp->work_in_progress = false;
+	raw_spin_unlock_irqrestore(&gp->update_lock, flags);
+
+	mutex_lock(&gp->work_lock);
+	__cpufreq_driver_target(gp->policy, freq, CPUFREQ_RELATION_L);
+	mutex_unlock(&gp->work_lock);
+}
+
+static void scx_gov_irq_work(struct irq_work *irq_work)
+{
+	struct scx_gov_policy *gp = container_of(irq_work, struct scx_gov_policy,
+						 irq_work);
+
+	queue_work(system_highpri_wq, &gp->work);
+}
+
+static int scx_gov_init(struct cpufreq_policy *policy)
+{
+	struct scx_gov_policy *gp;
+
+	if (policy->governor_data)
+		return -EBUSY;
+
+	gp = kzalloc(sizeof(*gp), GFP_KERNEL);
+	if (!gp)
+		return -ENOMEM;
+
+	gp->policy = policy;
+	raw_spin_lock_init(&gp->update_lock);
+	init_irq_work(&gp->irq_work, scx_gov_irq_work);
+	INIT_WORK(&gp->work, scx_gov_work);
+	mutex_init(&gp->work_lock);
+
+	cpufreq_enable_fast_switch(policy);
+	policy->governor_data = gp;
+	return 0;
+}
+
+static void scx_gov_exit(struct cpufreq_policy *policy)
+{
+	struct scx_gov_policy *gp = policy->governor_data;
+
+	policy->governor_data = NULL;
+	cpufreq_disable_fast_switch(policy);
+	mutex_destroy(&gp->work_lock);
+	kfree(gp);
+}
+
+static int scx_gov_start(struct cpufreq_policy *policy)
+{
+	struct scx_gov_policy *gp = policy->governor_data;
+	int cpu;
+
+	gp->last_update = 0;
+	gp->next_freq = 0;
+	gp->work_in_progress = false;
+
+	for_each_cpu(cpu, policy->cpus) {
+		struct scx_gov_cpu *gc = &per_cpu(scx_gov_cpu, cpu);
+
+		gc->gp = gp;
+		cpufreq_add_update_util_hook(cpu, &gc->update_util,
+					     scx_gov_update);
+	}
+	return 0;
+}
+
+static void scx_gov_stop(struct cpufreq_policy *policy)
+{
+	struct scx_gov_policy *gp = policy->governor_data;
+	int cpu;
+
+	for_each_cpu(cpu, policy->cpus)
+		cpufreq_remove_update_util_hook(cpu);
+
+	synchronize_rcu();
+
+	if (!policy->fast_switch_enabled) {
+		irq_work_sync(&gp->irq_work);
+		cancel_work_sync(&gp->work);
+	}
+}
+
+static void scx_gov_limits(struct cpufreq_policy *policy)
+{
+	struct scx_gov_policy *gp = policy->governor_data;
+	unsigned long flags;
+
+	if (!policy->fast_switch_enabled) {
+		mutex_lock(&gp->work_lock);
+		cpufreq_policy_apply_limits(policy);
+		mutex_unlock(&gp->work_lock);
+	}
+
+	/* force re-evaluation on the next update */
+	raw_spin_lock_irqsave(&gp->update_lock, flags);
+	gp->next_freq = 0;
+	raw_spin_unlock_irqrestore(&gp->update_lock, flags);
+}
+
+static struct cpufreq_governor scx_gov = {
+	.name			= "scx",
+	.owner			= THIS_MODULE,
+	.flags			= CPUFREQ_GOV_DYNAMIC_SWITCHING,
+	.init			= scx_gov_init,
+	.exit			= scx_gov_exit,
+	.start			= scx_gov_start,
+	.stop			= scx_gov_stop,
+	.limits			= scx_gov_limits,
+};
+
+cpufreq_governor_init(scx_gov);
@@ -11,36 +11,17 @@ unsigned int highres_tick_ctrl_dbg;
 #define SLIM_SCHED_DIR		"slim_sched"
 
 
+/*
+ * Userspace style trace marker. Emitted as is, without formatting or
+ * rate-limiting state shared across CPUs. Scheduler events go to the
+ * hmbird_trace rings instead.
+ */
 noinline int tracing_mark_write(const char *buf)
 {
-        static u64 last_trace_time = 0;
-        static int trace_count = 0;
-        u64 current_time = sched_clock();
-        
-        /* Rate limiting: only trace if enough time has passed or it's important */
-        if (current_time - last_trace_time > 1000000 || /* 1ms interval */
-            strstr(buf, "ERROR") || strstr(buf, "WARNING") || 
-            strstr(buf, "High priority") || strstr(buf, "Long balance")) {
-            
-            trace_count++;
-            
-            /* Enhanced trace with timestamp and sequence */
-            trace_printk("[%llu:%d] %s", current_time, trace_count, buf);
-            
-            last_trace_time = current_time;
-            
-            /* Additional system state info for critical messages */
-            if (strstr(buf, "ERROR") || strstr(buf, "WARNING")) {
-                trace_printk("[%llu:%d] System: CPUs=%d, HighresTick=%u", 
-                           current_time, trace_count + 1, 
-                           num_online_cpus(), highres_tick_ctrl);
-            }
-        }
-        
-        return 0;
+	trace_puts(buf);
+	return 0;
 }
 
-
 static char *files_name[] = {
 	HIGHRES_TICK_CTRL,
 	HIGHRES_TICK_CTRL_DBG,
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * slim_walt: WALT-style window based load tracking for sched_ext.
+ *
+ * Time is split into windows of NSEC_PER_SEC / frame_per_sec so that the
+ * windows line up with display frames. For each task, the busy time within a
+ * window, scaled by CPU and frequency capacity, is pushed into a short history
+ * from which the task's demand is derived according to slim_walt_policy. Each
+ * CPU accumulates the busy time of the tasks running on it in the current
+ * window and reports the previous, complete, window as its utilization.
+ *
+ * Included from ext.c. All updates happen with the task's rq locked. The
+ * window and slim_walt_ctrl are latched when the BPF scheduler is enabled.
+ */
+
+#define SLIM_WALT_MIN_FPS	30
+#define SLIM_WALT_MAX_FPS	240
+
+struct slim_walt_rq {
+	u64			window_start;
+	u64			curr_runnable_sum;
+	u64			prev_runnable_sum;
+};
+
+static DEFINE_PER_CPU(struct slim_walt_rq, slim_walt_rq);
+static DEFINE_STATIC_KEY_FALSE(slim_walt_enabled);
+static u64 slim_walt_window = NSEC_PER_SEC / 125;
+static u64 slim_walt_epoch;
+
+static u64 slim_walt_window_start_of(u64 t)
+{
+	u64 rem;
+
+	div64_u64_rem(t - slim_walt_epoch, slim_walt_window, &rem);
+	return t - rem;
+}
+
+/* make @delta capacity and frequency invariant */
+static u64 slim_walt_scale_exec_time(u64 delta, struct rq *rq)
+{
+	int cpu = cpu_of(rq);
+
+	delta = (delta * arch_scale_cpu_capacity(cpu)) >> SCHED_CAPACITY_SHIFT;
+	return (delta * arch_scale_freq_capacity(cpu)) >> SCHED_CAPACITY_SHIFT;
+}
+
+static u16 slim_walt_scale_demand(u64 demand)
+{
+	return min_t(u64, div64_u64(demand << SCHED_CAPACITY_SHIFT,
+				    slim_walt_window),
+		     SCHED_CAPACITY_SCALE);
+}
+
+static void slim_walt_update_history(struct slim_walt_task *wt, u32 runtime,
+				     u64 samples)
+{
+	u32 *hist = wt->sum_history;
+	int i, nr = min_t(u64, samples, RAVG_HIST_SIZE);
+	u32 max = 0, demand;
+	u64 sum = 0;
+
+	for (i = RAVG_HIST_SIZE - 1; i >= nr; i--)
+		hist[i] = hist[i - nr];
+	for (i = 0; i < nr; i++)
+		hist[i] = runtime;
+
+	for (i = 0; i < RAVG_HIST_SIZE; i++) {
+		sum += hist[i];
+		max = max(max, hist[i]);
+	}
+
+	switch (READ_ONCE(slim_walt_policy)) {
+	case WINDOW_STATS_RECENT:
+		demand = runtime;
+		break;
+	case WINDOW_STATS_MAX:
+		demand = max;
+		break;
+	case WINDOW_STATS_AVG:
+		demand = div_u64(sum, RAVG_HIST_SIZE);
+		break;
+	default:
+		demand = max_t(u32, div_u64(sum, RAVG_HIST_SIZE), runtime);
+		break;
+	}
+
+	wt->demand = demand;
+	wt->demand_scaled = slim_walt_scale_demand(demand);
+}
+
+static void slim_walt_update_window_start(struct rq *rq, u64 wallclock)
+{
+	struct slim_walt_rq *wrq = per_cpu_ptr(&slim_walt_rq, cpu_of(rq));
+	u64 nr;
+
+	if (wallclock < wrq->window_start + slim_walt_window)
+		return;
+
+	nr = div64_u64(wallclock - wrq->window_start, slim_walt_window);
+	wrq->prev_runnable_sum = nr == 1 ? wrq->curr_runnable_sum : 0;
+	wrq->curr_runnable_sum = 0;
+	wrq->window_start += nr * slim_walt_window;
+
+	/* a window completed, let the governor pick up the new utilization */
+	cpufreq_update_util(rq, 0);
+}
+
+/* account [@ms, @wallclock) of busy time to @rq's current and previous windows */
+static void slim_walt_update_rq_busy(struct rq *rq, u64 ms, u64 wallclock)
+{
+	struct slim_walt_rq *wrq = per_cpu_ptr(&slim_walt_rq, cpu_of(rq));
+	u64 ws = wrq->window_start;
+
+	if (ms >= ws) {
+		wrq->curr_runnable_sum += slim_walt_scale_exec_time(wallclock - ms, rq);
+		return;
+	}
+
+	if (wallclock > ws)
+		wrq->curr_runnable_sum += slim_walt_scale_exec_time(wallclock - ws, rq);
+	ms = max(ms, ws - slim_walt_window);
+	wrq->prev_runnable_sum += slim_walt_scale_exec_time(min(ws, wallclock) - ms, rq);
+}
+
+/*
+ * Push the windows between @ms and @wallclock into @p's history. Like WALT,
+ * windows in which @p was sleeping aren't accounted so that a task's demand
+ * is remembered across sleeps.
+ */
+static void slim_walt_update_task_demand(struct task_struct *p, struct rq *rq,
+					 u64 ms, u64 wallclock, bool busy)
+{
+	struct slim_walt_task *wt = &scx_ext(p)->ravg;
+	u64 end = slim_walt_window_start_of(ms) + slim_walt_window;
+	u64 ws;
+
+	if (wallclock < end) {
+		if (busy)
+			wt->sum += slim_walt_scale_exec_time(wallclock - ms, rq);
+		return;
+	}
+
+	if (busy)
+		wt->sum += slim_walt_scale_exec_time(end - ms, rq);
+	slim_walt_update_history(wt, wt->sum, 1);
+	wt->sum = 0;
+
+	if (!busy)
+		return;
+
+	ws = slim_walt_window_start_of(wallclock);
+	if (ws > end)
+		slim_walt_update_history(wt,
+				slim_walt_scale_exec_time(slim_walt_window, rq),
+				div64_u64(ws - end, slim_walt_window));
+	wt->sum = slim_walt_scale_exec_time(wallclock - ws, rq);
+}
+
+/**
+ * scx_update_task_ravg - Update the window based load of a task and its CPU
+ * @p: task to update
+ * @rq: @p's rq, locked
+ * @event: enum task_event, what's happening to @p
+ *
+ * Tasks move between rqs, so the windows are on sched_clock() like
+ * slim_walt_epoch rather than on the per rq clocks.
+ */
+static void scx_update_task_ravg(struct task_struct *p, struct rq *rq,
+				 int event)
+{
+	struct slim_walt_task *wt;
+	u64 ms, wallclock;
+	bool busy;
+
+	if (!static_branch_unlikely(&slim_walt_enabled))
+		return;
+
+	lockdep_assert_rq_held(rq);
+	wallclock = sched_clock();
+
+	slim_walt_update_window_start(rq, wallclock);
+
+	wt = &scx_ext(p)->ravg;
+	ms = wt->mark_start;
+
+	/* first update since the windows were set up, start afresh */
+	if (ms < slim_walt_epoch) {
+		memset(wt, 0, sizeof(*wt));
+		wt->mark_start = wallclock;
+		return;
+	}
+
+	if (wallclock <= ms)
+		return;
+
+	busy = event != PICK_NEXT_TASK && event != TASK_WAKE &&
+		task_current(rq, p);
+
+	if (busy)
+		slim_walt_update_rq_busy(rq, ms, wallclock);
+	slim_walt_update_task_demand(p, rq, ms, wallclock, busy);
+
+	wt->mark_start = wallclock;
+}
+
+/* demand of @p in %SCHED_CAPACITY_SCALE */
+static u32 slim_walt_task_util(const struct task_struct *p)
+{
+	return READ_ONCE(scx_ext(p)->ravg.demand_scaled);
+}
+
+/* utilization of @cpu in the last complete window in %SCHED_CAPACITY_SCALE */
+static unsigned long slim_walt_cpu_util(int cpu)
+{
+	return slim_walt_scale_demand(READ_ONCE(per_cpu(slim_walt_rq, cpu).prev_runnable_sum));
+}
+
+/*
+ * Called on BPF scheduler enable and disable. No task is on SCX at either
+ * point, so the windows can be reset without synchronizing with the updaters.
+ */
+static void slim_walt_enable(bool enable)
+{
+	int fps = clamp(READ_ONCE(sched_ravg_window_frame_per_sec),
+			SLIM_WALT_MIN_FPS, SLIM_WALT_MAX_FPS);
+	int cpu;
+
+	if (!enable || !READ_ONCE(slim_walt_ctrl)) {
+		static_branch_disable(&slim_walt_enabled);
+		return;
+	}
+
+	slim_walt_window = NSEC_PER_SEC / fps;
+	slim_walt_epoch = sched_clock();
+
+	for_each_possible_cpu(cpu) {
+		struct slim_walt_rq *wrq = per_cpu_ptr(&slim_walt_rq, cpu);
+
+		wrq->window_start = slim_walt_epoch;
+		wrq->curr_runnable_sum = 0;
+		wrq->prev_runnable_sum = 0;
+	}
+
+	static_branch_enable(&slim_walt_enabled);
+}
@@ -0,0 +1,1125 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2024 Oplus. All rights reserved.
+ *
+ * hmbird_sim: replay scheduling traces against the HMBird dispatch policy.
+ *
+ * The policy decisions come from ext_policy.h, the same code ext.c runs, and
+ * the simulator models their surroundings: per-CPU local DSQs, the global DSQ
+ * or its per-cluster shards with the cluster steal order, the default and the
+ * capacity aware CPU selection, slice refill and the balance keep decision.
+ * The recorded tasks are replayed as bursts of work woken up at their recorded
+ * times on the topology given with -t, with CPUs running at cap/1024 the speed
+ * of the biggest ones.
+ *
+ * Two trace formats are accepted:
+ *
+ *   ftrace	text output of the sched_wakeup, sched_wakeup_new and
+ *		sched_switch events. A burst starts at the wakeup and lasts as
+ *		long as the task ran until it switched out in a sleeping state,
+ *		scaled by the capacity of the CPU it ran on in the -t topology.
+ *
+ *   ring (-r)	struct hmbird_trace_rec records as drained from
+ *		/proc/hmbird_sched/trace_ring, concatenated across CPUs. Every
+ *		%HMBIRD_TRACE_ENQUEUE of a wakeup starts a burst. The rings
+ *		don't record run times, so bursts last -w usecs or up to the
+ *		next wakeup of the task, whichever is shorter.
+ *
+ * The model is a BPF scheduler dispatching everything it doesn't queue locally
+ * to %SCX_DSQ_GLOBAL, with queued tasks balanced on every tick the way the
+ * wakeups of the other sched classes would. Affinities aren't recorded, so all
+ * tasks may run on any CPU, and all of them are taken to have an mm.
+ *
+ * For each trace, the wakeup latency and the throughput are reported, one line
+ * per trace with -q so that runs under different options can be compared with
+ * diff or a spreadsheet.
+ *
+ * Build from the top of the tree with
+ *
+ *   cc -O2 -Wall -o hmbird_sim tools/hmbird_sim/hmbird_sim.c
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../ext_policy.h"
+#include "../../hmbird_trace.h"
+
+#define SIM_MAX_CPUS		16
+#define SIM_MAX_CLUSTERS	4
+#define SIM_INF			(~(u64)0)
+#define SIM_ENQ_WAKEUP		0x1	/* SCX_ENQ_WAKEUP */
+#define NSEC_PER_USEC		((u64)1000)
+#define NSEC_PER_MSEC		((u64)1000000)
+#define NSEC_PER_SEC		((u64)1000000000)
+
+/* the tunables, named and defaulted after the proc files */
+struct sim_opts {
+	int		nr_clusters;
+	int		cluster_nr[SIM_MAX_CLUSTERS];
+	unsigned long	cluster_cap[SIM_MAX_CLUSTERS];
+
+	u64		slice_dfl;
+	u64		tick;
+	u64		ring_run;
+	bool		ring;
+	bool		quiet;
+
+	bool		slice_adapt_ctrl;
+	int		slice_min_us;
+	int		slice_max_us;
+	bool		prio_heur;
+	int		prio_heur_thresh;
+	int		interactive_wait_us;
+	bool		load_heur;
+	int		high_load_ratio;
+	int		busy_load_ratio;
+	bool		cap_select_ctrl;
+	int		misfit_ds;
+	int		cpu7_tl;
+	bool		gdsq_shard_ctrl;
+	int		gdsq_steal_order;
+};
+
+static struct sim_opts opts = {
+	.slice_dfl		= 20 * NSEC_PER_MSEC,
+	.tick			= 4 * NSEC_PER_MSEC,
+	.ring_run		= 1 * NSEC_PER_MSEC,
+	.slice_min_us		= 1000,
+	.slice_max_us		= 20000,
+	.prio_heur_thresh	= 120,
+	.interactive_wait_us	= 10000,
+	.high_load_ratio	= 2,
+	.busy_load_ratio	= 1,
+	.misfit_ds		= 90,
+	.cpu7_tl		= 70,
+};
+
+struct sim_burst {
+	u64		wake;		/* recorded wakeup */
+	u64		work;		/* ns of running at full capacity */
+};
+
+enum sim_task_state {
+	SIM_SLEEPING,
+	SIM_QUEUED,
+	SIM_RUNNING,
+};
+
+struct sim_task {
+	int			pid;
+	int			prio;
+	struct sim_burst	*bursts;
+	int			nr_bursts;
+	int			alloc_bursts;
+
+	/* replay state */
+	enum sim_task_state	state;
+	int			cur;		/* burst being run */
+	int			cpu;		/* last CPU */
+	u64			rem;		/* work left in the burst */
+	u64			slice;
+	u64			woken;		/* wakeup of the current burst */
+	bool			started;	/* current burst ran already */
+	u64			exec_start;
+	u32			util;
+	u64			util_stamp;
+	u64			avg_run;
+	u64			run_sum;
+	u64			avg_wake_gap;
+	u64			woken_at;
+
+	/* trace parsing state */
+	u64			run_start;
+	bool			on_cpu;
+	int			rec_cpu;
+};
+
+struct sim_dsq {
+	struct sim_task		**q;
+	int			head;
+	int			nr;
+	int			alloc;
+};
+
+struct sim_cpu {
+	int			cluster;
+	unsigned long		cap;
+	struct sim_task		*curr;
+	u64			run_start;
+	u64			next;		/* pending evaluation */
+	u64			gen;		/* event generation */
+	struct sim_dsq		local;
+};
+
+enum sim_event_type {
+	SIM_EV_WAKE,
+	SIM_EV_CPU,
+};
+
+struct sim_event {
+	u64			ts;
+	enum sim_event_type	type;
+	int			idx;		/* task or CPU */
+	u64			gen;
+};
+
+struct sim_stats {
+	u64			*lat;
+	u64			nr_lat;
+	u64			alloc_lat;
+	u64			work_done;
+	u64			nr_bursts;
+	u64			nr_picks;
+	u64			nr_preempts;
+	u64			nr_migrations;
+	u64			nr_local;	/* wakeups queued locally */
+	u64			first_wake;
+	u64			last_done;
+};
+
+static struct sim_task *tasks;
+static int nr_tasks, alloc_tasks;
+static struct sim_cpu cpus[SIM_MAX_CPUS];
+static int nr_cpus;
+static struct sim_dsq gdsqs[SIM_MAX_CLUSTERS];
+static u8 steal[SIM_MAX_CLUSTERS][SIM_MAX_CLUSTERS - 1];
+static int prime_cluster;
+static struct sim_event *events;
+static int nr_events, alloc_events;
+static struct sim_stats stats;
+
+static void *xrealloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr) {
+		fprintf(stderr, "hmbird_sim: out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+static void *grow(void *ptr, int *alloc, int nr, size_t size)
+{
+	if (nr < *alloc)
+		return ptr;
+	*alloc = *alloc ? *alloc * 2 : 64;
+	return xrealloc(ptr, *alloc * size);
+}
+
+/*
+ * Trace parsing
+ */
+static struct sim_task *find_task(int pid, int prio)
+{
+	struct sim_task *t;
+	int i;
+
+	for (i = nr_tasks - 1; i >= 0; i--)
+		if (tasks[i].pid == pid)
+			return &tasks[i];
+
+	tasks = grow(tasks, &alloc_tasks, nr_tasks, sizeof(*tasks));
+	t = &tasks[nr_tasks++];
+	memset(t, 0, sizeof(*t));
+	t->pid = pid;
+	t->prio = prio;
+	return t;
+}
+
+static struct sim_burst *add_burst(struct sim_task *t, u64 wake)
+{
+	struct sim_burst *b;
+
+	t->bursts = grow(t->bursts, &t->alloc_bursts, t->nr_bursts,
+			 sizeof(*t->bursts));
+	b = &t->bursts[t->nr_bursts++];
+	b->wake = wake;
+	b->work = 0;
+	return b;
+}
+
+/* "123.456789" to ns */
+static u64 parse_ts(const char *s)
+{
+	unsigned long sec, usec;
+
+	if (sscanf(s, "%lu.%lu", &sec, &usec) != 2)
+		return 0;
+	return sec * NSEC_PER_SEC + usec * NSEC_PER_USEC;
+}
+
+static unsigned long rec_cpu_cap(int cpu)
+{
+	return cpu >= 0 && cpu < nr_cpus ? cpus[cpu].cap : SCHED_CAPACITY_SCALE;
+}
+
+static void ftrace_switch_out(struct sim_task *t, u64 ts, bool sleeping)
+{
+	if (t->on_cpu && t->nr_bursts && ts > t->run_start)
+		t->bursts[t->nr_bursts - 1].work +=
+			(ts - t->run_start) * rec_cpu_cap(t->rec_cpu) /
+			SCHED_CAPACITY_SCALE;
+	t->on_cpu = false;
+	if (sleeping)
+		t->run_start = 0;
+}
+
+/*
+ * Lines look like
+ *
+ *   <comm>-<pid> [<cpu>] <flags> <ts>: sched_switch: prev_comm=... prev_pid=N
+ *	prev_prio=N prev_state=S ==> next_comm=... next_pid=N next_prio=N
+ *   <comm>-<pid> [<cpu>] <flags> <ts>: sched_wakeup: comm=... pid=N prio=N
+ *	target_cpu=N
+ */
+static int parse_ftrace(FILE *f)
+{
+	char line[1024];
+
+	while (fgets(line, sizeof(line), f)) {
+		char *ev, *p, *tsp, state[16];
+		int cpu, pid, prio, next_pid, next_prio;
+		struct sim_task *t;
+		u64 ts;
+
+		ev = strstr(line, ": sched_");
+		p = strchr(line, '[');
+		if (!ev || !p || p > ev || sscanf(p, "[%d]", &cpu) != 1)
+			continue;
+
+		/* the timestamp is the last field before the event */
+		*ev = '\0';
+		tsp = strrchr(line, ' ');
+		ts = parse_ts(tsp ? tsp + 1 : line);
+		ev += 2;
+
+		if (!strncmp(ev, "sched_wakeup", 12)) {
+			p = strstr(ev, " pid=");
+			if (!p || sscanf(p, " pid=%d prio=%d", &pid, &prio) != 2 ||
+			    !pid)
+				continue;
+			t = find_task(pid, prio);
+			if (!t->on_cpu && !t->run_start) {
+				add_burst(t, ts);
+				t->run_start = ts;	/* marks it runnable */
+			}
+		} else if (!strncmp(ev, "sched_switch", 12)) {
+			p = strstr(ev, "prev_pid=");
+			if (!p || sscanf(p, "prev_pid=%d prev_prio=%d prev_state=%15s",
+					 &pid, &prio, state) != 3)
+				continue;
+			if (pid) {
+				t = find_task(pid, prio);
+				ftrace_switch_out(t, ts, state[0] != 'R');
+			}
+
+			p = strstr(p, "next_pid=");
+			if (!p || sscanf(p, "next_pid=%d next_prio=%d",
+					 &next_pid, &next_prio) != 2 || !next_pid)
+				continue;
+			t = find_task(next_pid, next_prio);
+			/* runnable from before the trace started */
+			if (!t->nr_bursts)
+				add_burst(t, ts);
+			t->on_cpu = true;
+			t->run_start = ts;
+			t->rec_cpu = cpu;
+		}
+	}
+
+	return ferror(f) ? -EIO : 0;
+}
+
+static int parse_ring(FILE *f)
+{
+	struct hmbird_trace_rec rec;
+	int i, j;
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		struct sim_task *t;
+
+		if (rec.type != HMBIRD_TRACE_ENQUEUE || rec.pid <= 0 ||
+		    !(rec.arg & SIM_ENQ_WAKEUP))
+			continue;
+		t = find_task(rec.pid, opts.prio_heur_thresh);
+		if (!t->nr_bursts)
+			t->rec_cpu = rec.cpu;
+		add_burst(t, rec.ts);
+	}
+	if (ferror(f))
+		return -EIO;
+
+	/* the rings are per CPU, put each task's wakeups back in order */
+	for (i = 0; i < nr_tasks; i++) {
+		struct sim_task *t = &tasks[i];
+
+		for (j = 1; j < t->nr_bursts; j++) {
+			struct sim_burst b = t->bursts[j];
+			int k = j;
+
+			while (k > 0 && t->bursts[k - 1].wake > b.wake) {
+				t->bursts[k] = t->bursts[k - 1];
+				k--;
+			}
+			t->bursts[k] = b;
+		}
+
+		for (j = 0; j < t->nr_bursts; j++) {
+			u64 run = opts.ring_run;
+
+			if (j + 1 < t->nr_bursts &&
+			    t->bursts[j + 1].wake - t->bursts[j].wake < run)
+				run = t->bursts[j + 1].wake - t->bursts[j].wake;
+			t->bursts[j].work = run ?: 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * DSQs
+ */
+static void dsq_enqueue(struct sim_dsq *dsq, struct sim_task *t, bool head)
+{
+	if (dsq->nr == dsq->alloc) {
+		int alloc = dsq->alloc ? dsq->alloc * 2 : 64, i;
+		struct sim_task **q = xrealloc(NULL, alloc * sizeof(*q));
+
+		for (i = 0; i < dsq->nr; i++)
+			q[i] = dsq->q[(dsq->head + i) % dsq->alloc];
+		free(dsq->q);
+		dsq->q = q;
+		dsq->head = 0;
+		dsq->alloc = alloc;
+	}
+
+	/* no BPF scheduler to dispatch to the priqs or vtime order the local DSQs */
+	switch (scx_policy_dsq_pos(head, false, false)) {
+	case SCX_POS_HEAD:
+		dsq->head = (dsq->head + dsq->alloc - 1) % dsq->alloc;
+		dsq->q[dsq->head] = t;
+		break;
+	default:
+		dsq->q[(dsq->head + dsq->nr) % dsq->alloc] = t;
+		break;
+	}
+	dsq->nr++;
+	t->state = SIM_QUEUED;
+}
+
+static struct sim_task *dsq_pop(struct sim_dsq *dsq)
+{
+	struct sim_task *t;
+
+	if (!dsq->nr)
+		return NULL;
+	t = dsq->q[dsq->head];
+	dsq->head = (dsq->head + 1) % dsq->alloc;
+	dsq->nr--;
+	return t;
+}
+
+static int gdsq_of(int cpu)
+{
+	return opts.gdsq_shard_ctrl ? cpus[cpu].cluster : 0;
+}
+
+/* global DSQ shards @cpu consumes from, in order, see consume_global_dsq_n() */
+static int gdsq_order(int cpu, int *order)
+{
+	int cl = cpus[cpu].cluster, i, n = 0;
+
+	order[n++] = gdsq_of(cpu);
+	if (opts.gdsq_shard_ctrl)
+		for (i = 0; i < opts.nr_clusters - 1; i++)
+			order[n++] = steal[cl][i];
+	return n;
+}
+
+static bool cpu_has_waiting(int cpu)
+{
+	int order[SIM_MAX_CLUSTERS], n, i;
+
+	if (cpus[cpu].local.nr)
+		return true;
+	n = gdsq_order(cpu, order);
+	for (i = 0; i < n; i++)
+		if (gdsqs[order[i]].nr)
+			return true;
+	return false;
+}
+
+static bool cpu_idle(int cpu)
+{
+	return !cpus[cpu].curr && !cpus[cpu].local.nr;
+}
+
+/*
+ * Events, a binary min-heap on ts
+ */
+static void push_event(u64 ts, enum sim_event_type type, int idx, u64 gen)
+{
+	int i;
+
+	events = grow(events, &alloc_events, nr_events, sizeof(*events));
+	i = nr_events++;
+	while (i > 0 && events[(i - 1) / 2].ts > ts) {
+		events[i] = events[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	events[i] = (struct sim_event){ .ts = ts, .type = type, .idx = idx,
+					.gen = gen };
+}
+
+static struct sim_event pop_event(void)
+{
+	struct sim_event ev = events[0], last = events[--nr_events];
+	int i = 0;
+
+	for (;;) {
+		int c = 2 * i + 1;
+
+		if (c >= nr_events)
+			break;
+		if (c + 1 < nr_events && events[c + 1].ts < events[c].ts)
+			c++;
+		if (events[c].ts >= last.ts)
+			break;
+		events[i] = events[c];
+		i = c;
+	}
+	if (nr_events)
+		events[i] = last;
+	return ev;
+}
+
+/* re-evaluate @cpu at @ts, invalidating the pending evaluation */
+static void kick_cpu(int cpu, u64 ts)
+{
+	cpus[cpu].next = ts;
+	push_event(ts, SIM_EV_CPU, cpu, ++cpus[cpu].gen);
+}
+
+static u64 next_tick(u64 now)
+{
+	return (now / opts.tick + 1) * opts.tick;
+}
+
+/*
+ * The policy, mirroring ext.c around the ext_policy.h decisions
+ */
+static u32 task_util(struct sim_task *t, u64 now)
+{
+	return now > t->util_stamp ?
+		scx_policy_util_decay(t->util, now - t->util_stamp, false) :
+		t->util;
+}
+
+static void update_util(struct sim_task *t, u64 now, bool ran)
+{
+	if (now > t->util_stamp)
+		t->util = scx_policy_util_decay(t->util, now - t->util_stamp, ran);
+	t->util_stamp = now;
+}
+
+static bool task_high_prio(struct sim_task *t)
+{
+	return opts.prio_heur && t->prio < opts.prio_heur_thresh;
+}
+
+static bool cpu_overloaded(int cpu, int ratio)
+{
+	int nr = cpus[cpu].local.nr + !!cpus[cpu].curr;
+
+	return opts.load_heur && nr > nr_cpus * ratio;
+}
+
+static void slice_bounds(u64 *min, u64 *max)
+{
+	*min = (u64)(opts.slice_min_us > 1 ? opts.slice_min_us : 1) *
+		NSEC_PER_USEC;
+	*max = (u64)(opts.slice_max_us > 1 ? opts.slice_max_us : 1) *
+		NSEC_PER_USEC;
+	if (*max < *min)
+		*max = *min;
+}
+
+static u64 task_slice_base(struct sim_task *t)
+{
+	u64 min, max;
+
+	if (!opts.slice_adapt_ctrl)
+		return opts.slice_dfl;
+
+	slice_bounds(&min, &max);
+	return scx_policy_slice_base(t->avg_run, t->run_sum, t->avg_wake_gap,
+				     min, max);
+}
+
+static u64 task_slice(struct sim_task *t, int cpu)
+{
+	u64 min, max;
+
+	if (!opts.slice_adapt_ctrl)
+		return opts.slice_dfl;
+
+	slice_bounds(&min, &max);
+	return scx_policy_slice_share(task_slice_base(t),
+				      cpu >= 0 ? cpus[cpu].local.nr : 0, min);
+}
+
+/* idle CPU in @cl or the clusters after it in its steal order, or -1 */
+static int pick_idle_cpu_from(int near, int cl, unsigned long skip)
+{
+	int i, cpu;
+
+	for (i = -1; i < opts.nr_clusters - 1; i++) {
+		int c = i < 0 ? cl : steal[cl][i];
+
+		if (skip & (1UL << c))
+			continue;
+		if (c == cpus[near].cluster && cpu_idle(near))
+			return near;
+		for (cpu = 0; cpu < nr_cpus; cpu++)
+			if (cpus[cpu].cluster == c && cpu_idle(cpu))
+				return cpu;
+	}
+	return -1;
+}
+
+/* scx_select_cpu_cap() and scx_select_cpu_dfl(), sets *@local on a hit */
+static int select_cpu(struct sim_task *t, u64 now, bool *local)
+{
+	int prev = t->cpu, cpu;
+
+	*local = false;
+
+	if (opts.cap_select_ctrl) {
+		unsigned long skip = 0;
+		int target;
+
+		target = scx_policy_fit_cluster(task_util(t, now),
+						cpus[prev].cluster,
+						opts.cluster_cap,
+						opts.nr_clusters, prime_cluster,
+						opts.misfit_ds, opts.cpu7_tl,
+						&skip);
+
+		if (cpus[prev].cluster == target && cpu_idle(prev)) {
+			*local = true;
+			return prev;
+		}
+
+		cpu = pick_idle_cpu_from(prev, target, skip);
+		if (cpu >= 0) {
+			*local = true;
+			return cpu;
+		}
+
+		if (target != cpus[prev].cluster)
+			for (cpu = 0; cpu < nr_cpus; cpu++)
+				if (cpus[cpu].cluster == target)
+					return cpu;
+		return prev;
+	}
+
+	if (cpu_idle(prev)) {
+		*local = true;
+		return prev;
+	}
+
+	cpu = pick_idle_cpu_from(prev, cpus[prev].cluster, 0);
+	if (cpu >= 0) {
+		*local = true;
+		return cpu;
+	}
+	return prev;
+}
+
+/*
+ * Queue @t on the global DSQ of @cpu. Kick an idle CPU consuming it, or make
+ * the busy ones balance on their next tick.
+ */
+static void enqueue_global(struct sim_task *t, int cpu, bool head, u64 now)
+{
+	int order[SIM_MAX_CLUSTERS], g = gdsq_of(cpu), c, i, n;
+	u64 tick = next_tick(now);
+
+	dsq_enqueue(&gdsqs[g], t, head);
+
+	for (c = 0; c < nr_cpus; c++) {
+		n = gdsq_order(c, order);
+		for (i = 0; i < n && order[i] != g; i++)
+			;
+		if (i == n)
+			continue;
+
+		if (cpu_idle(c)) {
+			kick_cpu(c, now);
+			return;
+		}
+
+		/* the first of the two events to fire invalidates the other */
+		if (cpus[c].curr && cpus[c].next > tick) {
+			cpus[c].next = tick;
+			push_event(tick, SIM_EV_CPU, c, cpus[c].gen);
+		}
+	}
+}
+
+static void task_wake(struct sim_task *t, u64 now)
+{
+	bool local;
+	int cpu;
+
+	if (t->woken_at && now > t->woken_at)
+		t->avg_wake_gap = scx_policy_ewma(t->avg_wake_gap,
+						  now - t->woken_at);
+	t->woken_at = now;
+
+	t->rem = t->bursts[t->cur].work;
+	t->woken = now;
+	t->started = false;
+	if (!stats.first_wake)
+		stats.first_wake = now;
+
+	cpu = select_cpu(t, now, &local);
+	if (!t->slice)
+		t->slice = task_slice(t, local ? cpu : -1);
+
+	if (local) {
+		stats.nr_local++;
+		dsq_enqueue(&cpus[cpu].local, t, false);
+		kick_cpu(cpu, now);
+	} else {
+		enqueue_global(t, cpu, scx_policy_fallback_head(task_high_prio(t)),
+			       now);
+	}
+}
+
+static void record_lat(u64 lat)
+{
+	if (stats.nr_lat == stats.alloc_lat) {
+		stats.alloc_lat = stats.alloc_lat ? stats.alloc_lat * 2 : 1024;
+		stats.lat = xrealloc(stats.lat,
+				     stats.alloc_lat * sizeof(*stats.lat));
+	}
+	stats.lat[stats.nr_lat++] = lat;
+}
+
+/* set_next_task_scx() */
+static void task_pick(struct sim_task *t, int cpu, u64 now)
+{
+	struct scx_policy_pick pick = {};
+	u64 wait = 0;
+
+	if (!t->started) {
+		record_lat(now - t->woken);
+		t->started = true;
+	}
+	if (t->cpu != cpu)
+		stats.nr_migrations++;
+
+	if (opts.prio_heur) {
+		if (t->exec_start && now > t->exec_start)
+			wait = now - t->exec_start;
+		pick.interactive = scx_policy_interactive(wait, true,
+				(u64)opts.interactive_wait_us * NSEC_PER_USEC);
+	}
+
+	t->state = SIM_RUNNING;
+	t->cpu = cpu;
+	t->exec_start = now;
+	update_util(t, now, false);
+	cpus[cpu].curr = t;
+	cpus[cpu].run_start = now;
+
+	if (!t->slice)
+		t->slice = task_slice(t, cpu);
+	pick.high_prio = task_high_prio(t);
+	pick.overloaded = cpu_overloaded(cpu, opts.busy_load_ratio);
+	t->slice = scx_policy_pick_slice(t->slice, &pick, opts.slice_dfl,
+					 SIM_INF);
+	stats.nr_picks++;
+}
+
+/* account the time @cpu's current task ran up to @now */
+static void cpu_account(int cpu, u64 now)
+{
+	struct sim_cpu *c = &cpus[cpu];
+	struct sim_task *t = c->curr;
+	u64 ran, work;
+
+	if (!t || now <= c->run_start)
+		return;
+
+	ran = now - c->run_start;
+	work = ran * c->cap / SCHED_CAPACITY_SCALE;
+	work = work < t->rem ? work : t->rem;
+	t->rem -= work;
+	stats.work_done += work;
+	t->slice -= ran < t->slice ? ran : t->slice;
+	t->run_sum += ran;
+	t->exec_start = now;
+	update_util(t, now, true);
+	c->run_start = now;
+}
+
+static void task_done(struct sim_task *t, u64 now)
+{
+	t->avg_run = scx_policy_ewma(t->avg_run, t->run_sum);
+	t->run_sum = 0;
+	t->state = SIM_SLEEPING;
+	stats.nr_bursts++;
+	stats.last_done = now;
+
+	if (++t->cur < t->nr_bursts) {
+		u64 wake = t->bursts[t->cur].wake;
+
+		/* can't wake up before the previous burst is done */
+		push_event(wake > now ? wake : now, SIM_EV_WAKE, t - tasks, 0);
+	}
+}
+
+/* pick the next task of @cpu, local DSQ first, then the global DSQs */
+static struct sim_task *cpu_consume(int cpu)
+{
+	int order[SIM_MAX_CLUSTERS], n, i;
+	struct sim_task *t;
+
+	t = dsq_pop(&cpus[cpu].local);
+	if (t)
+		return t;
+
+	n = gdsq_order(cpu, order);
+	for (i = 0; i < n; i++) {
+		t = dsq_pop(&gdsqs[order[i]]);
+		if (t)
+			return t;
+	}
+	return NULL;
+}
+
+static void cpu_event(int cpu, u64 now)
+{
+	struct sim_cpu *c = &cpus[cpu];
+	struct sim_task *t = c->curr;
+	u64 next, ts;
+
+	cpu_account(cpu, now);
+
+	if (t) {
+		if (!t->rem) {
+			c->curr = NULL;
+			task_done(t, now);
+		} else if (!cpu_has_waiting(cpu)) {
+			/* nothing else to run, keep going on a refilled slice */
+			if (!t->slice)
+				t->slice = task_slice(t, cpu);
+		} else if (!t->slice ||
+			   !scx_policy_keep_prev(t->slice, task_slice_base(t),
+						 task_high_prio(t),
+						 cpu_overloaded(cpu,
+							opts.high_load_ratio))) {
+			c->curr = NULL;
+			if (t->slice)
+				stats.nr_preempts++;
+			enqueue_global(t, cpu, false, now);
+		}
+	}
+
+	if (!c->curr) {
+		t = cpu_consume(cpu);
+		if (!t) {
+			c->next = SIM_INF;
+			return;
+		}
+		task_pick(t, cpu, now);
+	}
+
+	/* the burst ends, the slice runs out or the next tick balances */
+	t = c->curr;
+	next = now + (t->rem * SCHED_CAPACITY_SCALE + c->cap - 1) / c->cap;
+	if (t->slice != SIM_INF && now + t->slice < next)
+		next = now + t->slice;
+	if (cpu_has_waiting(cpu)) {
+		ts = next_tick(now);
+		if (ts < next)
+			next = ts;
+	}
+	kick_cpu(cpu, next);
+}
+
+/*
+ * Setup and reporting
+ */
+static int parse_topo(const char *s)
+{
+	int cpu = 0, cl;
+
+	for (cl = 0; *s; cl++) {
+		unsigned long cap;
+		int nr, len, i;
+
+		if (cl == SIM_MAX_CLUSTERS ||
+		    sscanf(s, "%dx%lu%n", &nr, &cap, &len) != 2 || nr <= 0 ||
+		    !cap || cap > SCHED_CAPACITY_SCALE || cpu + nr > SIM_MAX_CPUS)
+			return -EINVAL;
+
+		opts.cluster_nr[cl] = nr;
+		opts.cluster_cap[cl] = cap;
+		for (i = 0; i < nr; i++, cpu++) {
+			cpus[cpu].cluster = cl;
+			cpus[cpu].cap = cap;
+		}
+
+		s += len;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -EINVAL;
+	}
+
+	opts.nr_clusters = cl;
+	nr_cpus = cpu;
+	return nr_cpus ? 0 : -EINVAL;
+}
+
+static void build_clusters(void)
+{
+	int i, top = 0;
+
+	/* a lone top capacity CPU above at least two other clusters is prime */
+	prime_cluster = -1;
+	if (opts.nr_clusters > 2) {
+		for (i = 1; i < opts.nr_clusters; i++)
+			if (opts.cluster_cap[i] > opts.cluster_cap[top])
+				top = i;
+		if (opts.cluster_nr[top] == 1)
+			prime_cluster = top;
+	}
+
+	for (i = 0; i < opts.nr_clusters; i++)
+		scx_policy_build_steal(opts.cluster_cap, opts.nr_clusters,
+				       opts.gdsq_steal_order, i, steal[i]);
+}
+
+static void reset(void)
+{
+	int i;
+
+	free(stats.lat);
+	memset(&stats, 0, sizeof(stats));
+	for (i = 0; i < nr_tasks; i++)
+		free(tasks[i].bursts);
+	nr_tasks = 0;
+	nr_events = 0;
+	for (i = 0; i < nr_cpus; i++) {
+		cpus[i].curr = NULL;
+		cpus[i].next = SIM_INF;
+		cpus[i].gen = 0;
+		cpus[i].local.nr = 0;
+	}
+	for (i = 0; i < SIM_MAX_CLUSTERS; i++)
+		gdsqs[i].nr = 0;
+}
+
+static void replay(void)
+{
+	int i;
+
+	for (i = 0; i < nr_tasks; i++) {
+		struct sim_task *t = &tasks[i];
+
+		t->cpu = t->rec_cpu < nr_cpus ? t->rec_cpu : 0;
+		if (t->nr_bursts)
+			push_event(t->bursts[0].wake, SIM_EV_WAKE, i, 0);
+	}
+
+	while (nr_events) {
+		struct sim_event ev = pop_event();
+
+		if (ev.type == SIM_EV_WAKE)
+			task_wake(&tasks[ev.idx], ev.ts);
+		else if (ev.gen == cpus[ev.idx].gen)
+			cpu_event(ev.idx, ev.ts);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static u64 pct(int p)
+{
+	if (!stats.nr_lat)
+		return 0;
+	return stats.lat[(stats.nr_lat - 1) * p / 100];
+}
+
+static void report(const char *name)
+{
+	u64 span = stats.last_done > stats.first_wake ?
+		stats.last_done - stats.first_wake : 0;
+	u64 sum = 0, i;
+
+	qsort(stats.lat, stats.nr_lat, sizeof(*stats.lat), cmp_u64);
+	for (i = 0; i < stats.nr_lat; i++)
+		sum += stats.lat[i];
+
+	if (opts.quiet) {
+		printf("%s tasks=%d bursts=%" PRIu64 " lat_avg_us=%" PRIu64
+		       " lat_p50_us=%" PRIu64 " lat_p99_us=%" PRIu64
+		       " lat_max_us=%" PRIu64 " cap_pct=%" PRIu64
+		       " bursts_per_sec=%" PRIu64 " picks=%" PRIu64
+		       " preempts=%" PRIu64 " migrations=%" PRIu64 "\n",
+		       name, nr_tasks, stats.nr_bursts,
+		       (stats.nr_lat ? sum / stats.nr_lat : 0) / NSEC_PER_USEC,
+		       pct(50) / NSEC_PER_USEC, pct(99) / NSEC_PER_USEC,
+		       pct(100) / NSEC_PER_USEC,
+		       span ? stats.work_done * 100 / (span * nr_cpus) : 0,
+		       span ? stats.nr_bursts * NSEC_PER_SEC / span : 0,
+		       stats.nr_picks, stats.nr_preempts, stats.nr_migrations);
+		return;
+	}
+
+	printf("%s: %d tasks, %" PRIu64 " bursts over %" PRIu64 " usecs\n",
+	       name, nr_tasks, stats.nr_bursts, span / NSEC_PER_USEC);
+	printf("  wakeup latency usecs: avg %" PRIu64 " p50 %" PRIu64
+	       " p99 %" PRIu64 " max %" PRIu64 "\n",
+	       (stats.nr_lat ? sum / stats.nr_lat : 0) / NSEC_PER_USEC,
+	       pct(50) / NSEC_PER_USEC, pct(99) / NSEC_PER_USEC,
+	       pct(100) / NSEC_PER_USEC);
+	printf("  throughput: %" PRIu64 " bursts/s, %" PRIu64 "%% of capacity\n",
+	       span ? stats.nr_bursts * NSEC_PER_SEC / span : 0,
+	       span ? stats.work_done * 100 / (span * nr_cpus) : 0);
+	printf("  picks %" PRIu64 " preempts %" PRIu64 " migrations %" PRIu64
+	       " local wakeups %" PRIu64 "\n",
+	       stats.nr_picks, stats.nr_preempts, stats.nr_migrations,
+	       stats.nr_local);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+"Usage: hmbird_sim [options] TRACE...\n"
+"\n"
+"  -t TOPO   clusters as NRxCAP[,NRxCAP...] (default 4x512,3x870,1x1024)\n"
+"  -r        traces are hmbird_trace_rec dumps instead of ftrace text\n"
+"  -w US     burst length for ring traces (default 1000)\n"
+"  -k US     tick period (default 4000)\n"
+"  -s US     default slice, SCX_SLICE_DFL (default 20000)\n"
+"  -a        slice_adapt_ctrl, with -m slice_min_us and -M slice_max_us\n"
+"  -p THRESH prio heuristics with prio_heur_thresh, -i interactive_wait_us\n"
+"  -l HIGH,BUSY  load heuristics with high_load_ratio and busy_load_ratio\n"
+"  -c MISFIT,TL  cap_select_ctrl with misfit_ds and cpu7_tl\n"
+"  -g ORDER  gdsq_shard_ctrl with gdsq_steal_order\n"
+"  -q        one line per trace\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *topo = "4x512,3x870,1x1024";
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "t:rw:k:s:am:M:p:i:l:c:g:qh")) != -1) {
+		switch (opt) {
+		case 't':
+			topo = optarg;
+			break;
+		case 'r':
+			opts.ring = true;
+			break;
+		case 'w':
+			opts.ring_run = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+			break;
+		case 'k':
+			opts.tick = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+			break;
+		case 's':
+			opts.slice_dfl = strtoull(optarg, NULL, 0) * NSEC_PER_USEC;
+			break;
+		case 'a':
+			opts.slice_adapt_ctrl = true;
+			break;
+		case 'm':
+			opts.slice_min_us = atoi(optarg);
+			break;
+		case 'M':
+			opts.slice_max_us = atoi(optarg);
+			break;
+		case 'p':
+			opts.prio_heur = true;
+			opts.prio_heur_thresh = atoi(optarg);
+			break;
+		case 'i':
+			opts.interactive_wait_us = atoi(optarg);
+			break;
+		case 'l':
+			opts.load_heur = true;
+			if (sscanf(optarg, "%d,%d", &opts.high_load_ratio,
+				   &opts.busy_load_ratio) != 2)
+				usage();
+			break;
+		case 'c':
+			opts.cap_select_ctrl = true;
+			if (sscanf(optarg, "%d,%d", &opts.misfit_ds,
+				   &opts.cpu7_tl) != 2)
+				usage();
+			break;
+		case 'g':
+			opts.gdsq_shard_ctrl = true;
+			opts.gdsq_steal_order = atoi(optarg);
+			break;
+		case 'q':
+			opts.quiet = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc || !opts.tick || !opts.slice_dfl)
+		usage();
+	if (parse_topo(topo)) {
+		fprintf(stderr, "hmbird_sim: invalid topology %s\n", topo);
+		return 1;
+	}
+	build_clusters();
+
+	for (i = optind; i < argc; i++) {
+		FILE *f = fopen(argv[i], opts.ring ? "rb" : "r");
+		int err;
+
+		if (!f) {
+			fprintf(stderr, "hmbird_sim: %s: %s\n", argv[i],
+				strerror(errno));
+			ret = 1;
+			continue;
+		}
+
+		reset();
+		err = opts.ring ? parse_ring(f) : parse_ftrace(f);
+		fclose(f);
+		if (err) {
+			fprintf(stderr, "hmbird_sim: %s: %s\n", argv[i],
+				strerror(-err));
+			ret = 1;
+			continue;
+		}
+
+		replay();
+		report(argv[i]);
+	}
+
+	return ret;
+}